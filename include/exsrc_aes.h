@@ -22,6 +22,12 @@
   #define CTR 0
 #endif
 
+// AES_TTABLE builds AES_CBC_*_buffer on 32-bit lookup tables instead of the byte-wise
+// reference rounds. Both are always available under their _ttable/_reference names.
+#ifndef AES_TTABLE
+  #define AES_TTABLE 0
+#endif
+
 
 //#define AES128 1
 //#define AES192 1
@@ -72,6 +78,11 @@ void AES_ECB_decrypt(struct AES_ctx* ctx, const uint8_t* buf);
 void AES_CBC_encrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, uint32_t length);
 void AES_CBC_decrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, uint32_t length);
 
+void AES_CBC_encrypt_buffer_reference(struct AES_ctx* ctx, uint8_t* buf, uint32_t length);
+void AES_CBC_decrypt_buffer_reference(struct AES_ctx* ctx, uint8_t* buf, uint32_t length);
+void AES_CBC_encrypt_buffer_ttable(struct AES_ctx* ctx, uint8_t* buf, uint32_t length);
+void AES_CBC_decrypt_buffer_ttable(struct AES_ctx* ctx, uint8_t* buf, uint32_t length);
+
 #endif // #if defined(CBC) && (CBC == 1)
 
 
@@ -13,15 +13,70 @@
 #include <signal.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
 
 #include "exsrc_minIni.h"
 #include "reactant_util.h"
 
 
 #define CONF_INI "cfg.ini"
+#define MAX_EVENTS (256)   // Ready events handled per epoll_wait() call
+
+// Protocol versions, agreed per connection
+#define PROTOCOL_LEGACY (1)     // Publishes send channel and payload as two frames
+#define PROTOCOL_COMBINED (2)   // Publishes may send channel and payload in one frame
+#define PROTOCOL_INTERNED (3)   // Channels announced by the Core may be referred to by ID
+#define PROTOCOL_SEQUENCED (4)  // Relays carry the channel sequence number; subscriptions may replay history
+#define PROTOCOL_FRAGMENTED (5) // Messages too large for one frame continue in the frames after it
+#define PROTOCOL_VARIABLE (6)   // Every frame is preceded by its length; messages too large for one frame take a longer one
+#define PROTOCOL_HASHED (7)     // As variable, fixed frames after the negotiation hash every byte rather than up to the first zero
+#define PROTOCOL_SEALED (8)     // As hashed, every frame after the negotiation sealed with an AEAD; the Core chooses which
+#define PROTOCOL_VERSION PROTOCOL_SEALED
+#define PROTOCOL_CHANNEL "$protocol"    // Payload of negotiation frames
+
+#define FRAME_ENCODINGS (PROTOCOL_VARIABLE + 1)     // Frames cached per family, by the version that introduced the encoding
+#define FRAME_FAMILIES (3)  // Frames hashed up to the first zero byte, hashed whole, and sealed
+#define FRAME_FORMATS (FRAME_FAMILIES * FRAME_ENCODINGS)
+
+// Frame kinds, flagged in source_id
+#define FRAME_HELLO (0x40000000)    // Protocol negotiation; bytes_remaining holds the version
+#define FRAME_PUBLISH (0x20000000)  // Combined publish; payload is [channel length][channel][payload]
+#define FRAME_CHANNEL (0x10000000)  // Channel announcement; payload is [channel ID][channel]
+#define FRAME_INTERNED (0x08000000) // With FRAME_PUBLISH, payload is [channel ID][payload] instead
+#define FRAME_RETAIN (0x04000000)   // On a publish's payload frame, the Core keeps the message for new subscribers
+#define FRAME_SEQUENCE (0x02000000) // With FRAME_INTERNED, payload is [channel ID][sequence][payload] instead
+#define FRAME_REPLAY (0x01000000)   // Subscription payload is [sequence][channel]; history from the sequence on is replayed first
+#define FRAME_FRAGMENT (0x00800000) // Frame of a message split across frames; bytes_remaining counts the payload bytes in the frames after it
+#define FRAGMENT_SATURATED (0x7FFF) // bytes_remaining of a fragment with at least this many bytes after it
+#define FRAGMENT_PAYLOAD (249)      // Payload bytes carried by each fragment
+#define FRAME_TRANSFER (0x00400000) // Bulk transfer; the payload starts with its transfer_kind_t and is sized by the frame
+
+// Bulk transfers, carried in variable frames
+#define TRANSFER_CHUNK (32 * 1024)  // Data bytes per chunk
+#define TRANSFER_HEADER (17)        // Bytes ahead of the data of a TRANSFER_DATA payload
+#define TRANSFER_BEGIN_HEADER (49)  // Bytes ahead of the channel of a TRANSFER_BEGIN payload
+#define TRANSFER_WINDOW (8)         // Chunks a sender has in flight before the Core acknowledges them
+#define TRANSFER_TIMEOUT (5000)     // Milliseconds a sender waits on the Core before giving up; the transfer may be resumed
+#define TRANSFER_RECEIVING (4)      // Incomplete transfers a Node collects at once
+#define STREAM_LIMIT (64)           // Transfers the Core follows at once, interrupted ones included
+
+typedef enum _transfer_kind_t
+{
+    TRANSFER_BEGIN = 1,     // [kind][ID][chunks][chunk size][size][SHA-256][channel]; ID 0 starts a transfer, any other resumes it
+    TRANSFER_ACCEPT,        // [kind][ID][next chunk]; answers TRANSFER_BEGIN, with ID 0 if refused
+    TRANSFER_DATA,          // [kind][ID][index][length][FNV-1a][data]
+    TRANSFER_ACK,           // [kind][ID][next chunk]; every chunk before it is queued to every subscriber
+
+} transfer_kind_t;
 
 extern const int LISTEN_QUEUE;
 extern const int TABLE_SIZE;
+extern const int HELLO_TIMEOUT;    // Milliseconds a Node waits for the Core to negotiate
 
 typedef struct _core_t
 {
@@ -30,50 +85,387 @@ typedef struct _core_t
     int node_id;
     char key[33];
     char iv[17];
+    crypto_session_t session;   // Round keys of key, expanded once for every message
+    int protocol;   // Version agreed with the Core
+    pthread_mutex_t send_lock;  // Keeps the frames of one message together on the socket
+    buffer_pool_t buffers;      // Messages too large for one frame, while built or reassembled
+
+    hash_table_t channels;      // Channel name -> ID announced by the Core
+    char ** names;              // Channel ID -> name announced by the Core
+    uint32_t * sequences;       // Channel ID -> sequence number of the last relay received
+    uint32_t names_size;
+    pthread_mutex_t channel_lock;
+
+    pthread_mutex_t transfer_lock;  // Guards the transfer being sent
+    pthread_cond_t transfer_ready;  // Signalled as the Core answers, and as the transfer ends
+    char transferring;          // One transfer is sent at a time
+    char transfer_answered;     // The Core answered TRANSFER_BEGIN
+    uint32_t transfer_id;       // ID the Core accepted the transfer under
+    uint32_t transfer_next;     // First chunk the Core has not acknowledged
 
 } core_t;
 
-typedef core_t node_t;
+typedef struct _node_t
+{
+    struct _connection_t * connection;  // Shared by every subscription of the device
+    int slot;       // Index of the channel in the connection's subscription list
+
+} node_t;
+
+typedef struct _history_t
+{
+    uint32_t sequence;
+    char * payload;
+    struct _frame_t * frames[FRAME_FORMATS];   // The message as each protocol version carries it, built on demand
+
+} history_t;
+
+typedef struct _checkpoint_t
+{
+    uint32_t sequence;
+    uint64_t position;  // Log position of the channel's publish with this sequence number
+
+} checkpoint_t;
 
 typedef struct _channel_t
 {
-    // char * name; // Don't need name, it's the key of containing hash_data_t
+    uint32_t id;    // Index in the router's channel array; never reused
+    char name[250];
     int size;
-    node_t * nodes;
+    int capacity;
+    node_t * nodes;     // Subscribers by value, in no particular order
+
+    char * retained;    // Payload of the last retained publish, replayed on subscribe
+    uint32_t retained_sequence;
+    struct _frame_t * replay[FRAME_FORMATS];   // The retained message as each protocol version carries it
+
+    uint32_t sequence;          // Sequence number of the last publish
+    history_t * history;        // Ring of recent publishes, oldest at history_head; taken from the lists pool
+    uint32_t history_head;
+    uint32_t history_count;
+    size_t history_bytes;       // Payload bytes held by the ring
+    checkpoint_t * checkpoints; // Log positions of every CHECKPOINT_INTERVAL-th logged publish, oldest first; taken from the lists pool
+    uint32_t checkpoint_count;
+    uint32_t checkpoint_capacity;
+
+    pthread_mutex_t lock;       // Guards the sequence, retained message, history and checkpoints; held through a publish so its channel stays in order
 
 } channel_t;
 
+#define INPUT_FRAMES (16)  // Frames buffered per connection read
+#define OUTPUT_INITIAL (4)  // Initial outbound queue capacity, in messages
+#define OUTPUT_IOV (64)     // Queued messages written per writev() call
+#define MAX_CONNECTIONS (1 << 20)   // Upper bound on descriptors tracked by the Core
+
+typedef enum _overflow_t
+{
+    OVERFLOW_DROP = 0,      // Discard new messages for the slow consumer
+    OVERFLOW_CONFLATE,      // Replace queued messages of the same channel with the newest
+    OVERFLOW_DISCONNECT,    // Close the slow consumer's connection
+
+} overflow_t;
+
+typedef enum _table_kind_t
+{
+    TABLE_CHAINED = 0,      // Separate chaining (hash_table_t)
+    TABLE_OPEN,             // Open addressing (open_table_t)
+
+} table_kind_t;
+
+typedef struct _membership_t
+{
+    channel_t * channel;
+    int index;      // Index of the connection's entry in channel->nodes
+
+} membership_t;
+
+typedef struct _backlog_t
+{
+    channel_t * channel;
+    uint32_t next;      // Sequence number of the next message to replay
+    uint64_t position;  // Log position the next page is read from
+
+} backlog_t;
+
+typedef struct _core_config_t
+{
+    int shards;             // Reactor threads; 0 or less starts one per online CPU
+    int high_water;         // Queued messages per connection before overflow handling
+    overflow_t overflow;
+    float load_factor;      // Channels per routing table bucket before the table grows
+    table_kind_t table;     // Routing table implementation
+    int history;            // Publishes kept per channel for replay; 0 disables history
+    int history_bytes;      // Payload bytes kept per channel; 0 bounds history by count alone
+    char log_directory[256];    // Directory of the durable publish log; empty disables the log
+    long log_segment;           // Bytes written to a log segment before the next one is started
+    long log_retain_bytes;      // Bytes of sealed segments kept; 0 keeps any size
+    long log_retain_age;        // Seconds sealed segments are kept; 0 keeps any age
+    char fixed_frames;          // Fragment large messages rather than send longer frames, so frame lengths reveal nothing
+    crypto_aead_t aead;         // Cipher of PROTOCOL_SEALED connections; CRYPTO_AEAD_NONE keeps every connection on AES-CBC
+
+} core_config_t;
+
+typedef struct _core_stats_t
+{
+    pool_stats_t frames;
+    pool_stats_t buffers;
+    pool_stats_t payloads;
+    pool_stats_t channels;
+    pool_stats_t connections;
+    pool_stats_t lists;
+
+} core_stats_t;
+
+#define FRAME_SLAB (256)   // Frames carved from each pool slab
+#define LOG_SEGMENT (16 * 1024 * 1024)  // Default log segment size
+#define RECORD_RETAIN (0x01)    // Log record flag; the publish was retained
+#define CHECKPOINT_INTERVAL (32)    // Logged publishes of a channel between its checkpoints
+#define REPLAY_BATCH (64)       // Logged messages a replay queues at once; fewer below twice the high-water mark
+#define REPLAY_SCAN (4096)      // Log records of any channel a replay reads at once
+#define BUFFER_SMALLEST (512)   // Smallest pooled message buffer
+#define BUFFER_SLAB (64 * 1024) // Bytes carved at once for each class of message buffers
+#define LIST_SMALLEST (64)      // Smallest pooled subscriber, subscription or queue array
+#define PAYLOAD_SMALLEST (32)   // Smallest pooled retained or history payload
+#define CHANNEL_SLAB (64)       // Channels and patterns carved from each pool slab
+#define CONNECTION_SLAB (16)    // Connections carved from each pool slab
+
+typedef struct _frame_t
+{
+    int references;     // Queues still holding the frame, plus the publisher while relaying
+    pool_t * pool;      // Pool the frame returns to once unreferenced
+    buffer_pool_t * buffers;    // Pool of data, when the frames do not fit storage
+    int size;           // Bytes of encrypted frames, after the length prefix
+    char * data;        // [length prefix][encrypted frames], relayed unchanged
+    char storage[MESSAGE_PREFIX + 2 * MESSAGE_LENGTH];
+
+} frame_t;
+
+typedef struct _outbound_t
+{
+    const void * tag;   // Channel the message was published on
+    frame_t * frame;    // Shared with every other subscriber of the message
+    int start;          // Offset of the frame data sent; the length prefix is left out on fixed-frame connections
+
+} outbound_t;
+
+typedef enum _connection_state_t
+{
+    CONNECTION_IDLE = 0,    // Next frame starts a new message
+    CONNECTION_PAYLOAD,     // Next frame is the payload of a pending publish
+    CONNECTION_FRAGMENT,    // Next frame continues a fragmented publish
+
+} connection_state_t;
+
+typedef struct _connection_t
+{
+    int sock;
+    struct sockaddr_in addr;
+    int node_id;    // Device ID given with its last subscription
+
+    char input[INPUT_FRAMES * MESSAGE_LENGTH];  // Received bytes not yet handled as frames
+    int input_size;
+
+    int protocol;   // Version agreed with the Node
+    crypto_session_t sealed;    // Opens the Node's frames once PROTOCOL_SEALED is agreed, keyed with the salt it offered
+    connection_state_t state;
+    char header[MESSAGE_LENGTH];    // Encrypted channel frame of a pending publish
+    char channel[250];
+
+    char * assembly;            // Pooled buffer collecting a frame longer than the input buffer, or a fragmented publish
+    size_t assembly_size;       // Bytes collected
+    size_t assembly_expected;   // Length of the frame being collected
+    uint32_t assembly_id;       // Channel ID of the fragmented publish; 0 when it names connection->channel
+    char assembly_retain;
+
+    pthread_mutex_t lock;   // Guards the outbound queue; relays arrive from every shard
+    int epoll_fd;           // Epoll instance of the owning shard
+    outbound_t * output;    // Ring of queued messages
+    int output_capacity;
+    int output_head;
+    int output_count;
+    int output_offset;      // Bytes of the head message already written
+    char writing;           // Waiting for the socket to become writable
+    char closing;           // Shut down; the owning shard closes it
+    int dropped;            // Messages lost to overflow handling
+    uint32_t published;     // Publishes received from the Node
+    uint32_t delivered;     // Messages queued to the Node
+
+    uint8_t * announced;    // Bitmap of channel IDs the Node has been told; guarded by the connection lock
+    uint32_t announced_size;
+    uint32_t relayed;       // Transfer frame last queued; guarded by the streams lock
+    int references;         // One while registered, and one per relay holding it outside the router lock
+
+    membership_t * subscriptions;   // Subscriber entries of this connection, in channels and patterns; guarded by the router lock
+    int subscription_count;
+    int subscription_capacity;
+
+    backlog_t * backlogs;   // Replays still reading the log, oldest first; live relays of their channels wait for them
+    int backlog_count;      // Guarded by the connection lock; only the owning shard changes the list
+    int backlog_capacity;
+
+} connection_t;
+
+typedef struct _router_t
+{
+    table_kind_t kind;
+    hash_table_t table;     // Channel name -> channel ID, when kind is TABLE_CHAINED
+    open_table_t open;      // Channel name -> channel ID, when kind is TABLE_OPEN
+    pthread_rwlock_t lock;  // Guards the tables, subscriber lists and connection lookup; publishes only read them
+
+    channel_t ** channels;  // Channels by ID; ID 0 is never assigned
+    uint32_t channel_count;
+    uint32_t channel_capacity;
+    trie_t patterns;        // Wildcard subscriptions; pattern -> channel_t with ID 0
+    uint32_t stamp;         // Transfer frames relayed, so a connection matching several subscriptions gets one copy
+
+    pool_t frames;  // Relayed messages, shared by every subscriber queue
+    buffer_pool_t buffers;  // Messages too large for frame storage or the input buffer
+    buffer_pool_t payloads; // Retained and history payloads
+    pool_t channel_pool;    // Channels and wildcard patterns
+    pool_t connection_pool; // Connections of every shard
+    buffer_pool_t lists;    // Subscriber, subscription, stream target, announcement and outbound queue arrays
+
+    connection_t ** connections;    // Open connections by descriptor
+    int capacity;
+    int high_water;
+    overflow_t overflow;
+    int history;
+    size_t history_bytes;
+    log_t log;      // Durable record of every publish, when logging
+    char logging;
+    char fixed_frames;
+    crypto_aead_t aead;
+    char * key;     // Pre-shared key, which sealed connections key their frames from
+    uint8_t salt[AEAD_SALT];    // Keys every frame the Core seals; drawn at start
+
+    pthread_mutex_t streams_lock;   // Guards the transfers; taken before the router lock
+    struct _stream_t * streams;     // Transfers being fanned out, STREAM_LIMIT of them; a free slot has ID 0
+    uint32_t transfers;     // Transfer IDs handed out
+    int stalled;            // Streams holding an acknowledgement back until a subscriber queue drains
+    int wakeup;             // Event descriptor every reactor watches; signalled to stop the Core
+    char stopping;          // Set by stop_core_server() from any thread; read atomically
+
+} router_t;
+
+typedef struct _shard_t
+{
+    int id;
+    int sock;   // Listening socket (SO_REUSEPORT)
+    crypto_session_t session;   // Round keys, expanded once for every frame the shard packs or unpacks
+    crypto_session_t hashed;    // As session, hashing whole frames, for connections that agreed to PROTOCOL_HASHED
+    crypto_session_t sealed;    // As session, for connections that agreed to PROTOCOL_SEALED
+    router_t * router;  // Routing state shared by every shard
+    pthread_t thread;
+    connection_t ** targets;    // Subscribers of the publish being relayed, gathered under the router lock
+    int target_capacity;
+
+} shard_t;
+
+typedef struct _stream_t
+{
+    uint32_t id;                // Transfer ID; 0 while the slot is free
+    router_t * router;
+    char channel[250];          // Looked up for every frame; a transfer alone never interns its channel
+    connection_t * sender;      // NULL while the sender is disconnected; it may resume the transfer
+    uint32_t chunks;
+    uint32_t next;              // Next chunk expected; every chunk before it was queued to the subscribers
+    uint32_t acknowledged;      // Chunks acknowledged to the sender
+    connection_t ** targets;    // Subscribers the last frame was queued to, each held until the next frame or its close
+    int target_count;
+    int target_capacity;
+
+} stream_t;
+
+typedef struct _relay_t
+{
+    shard_t * shard;
+    channel_t * channel;    // Channel the message was published on
+    char * payload;
+    int format;             // Version the publisher encoded the message with, FRAME_ENCODINGS more per family
+    char * first;           // Message as received, relayed unchanged to that version
+    char * second;
+    frame_t * frames[FRAME_FORMATS];    // The message as each protocol version carries it
+    frame_t * announcement[FRAME_FAMILIES];    // Channel announcement, per family
+    uint32_t sequence;      // Position of the message in its channel
+    connection_t ** targets;    // Subscribers, each held for the fan-out; the shard's array
+    int target_count;
+
+} relay_t;
+
+typedef struct _replay_t
+{
+    shard_t * shard;
+    connection_t * connection;
+    channel_t * channel;
+    uint32_t from;          // First sequence number to replay
+    uint32_t until;         // First sequence number still in memory; the log is only read before it
+    char bounded;           // Whether until is set
+    uint32_t next;          // Sequence number after the last message read
+    int limit;              // Frames a page of the log ends at; 0 reads to the durable end
+    int scanned;            // Log records of any channel read by the page
+    char stopped;           // The page ended before the durable end of the log
+    frame_t ** frames;      // Frames to queue, oldest first
+    int count;
+    int capacity;
+    int owned;              // Leading frames built from the log for this replay alone
+    frame_t * announcement[FRAME_FAMILIES];
+
+} replay_t;
+
 typedef struct _subscription_t
 {
     char channel[250];
+    uint32_t id;    // Announced by the Core; 0 until then
     void (*callback)(char *);
+    void (*transfer)(const char *, size_t);   // Set instead of callback for transfer subscriptions
 
 } subscription_t;
 
+typedef struct _transfer_t
+{
+    uint32_t id;        // Transfer ID; 0 while the slot is free
+    char channel[250];
+    uint32_t chunks;
+    uint32_t chunk_size;
+    uint32_t size;
+    unsigned char hash[SHA256_DIGEST_LENGTH];   // Of the whole transfer
+    char * data;        // Pooled buffer each chunk is placed in
+    uint8_t * received; // Bitmap of the chunks placed, so a resumed transfer only fills the gaps
+    uint32_t count;
+
+} transfer_t;
+
 typedef struct _subpack_t
 {
     core_t * core;
     int size;
     subscription_t * subs;
     pthread_mutex_t * lock;
+    transfer_t transfers[TRANSFER_RECEIVING];   // Transfers being received; only the listener touches them
 
 } subpack_t;
 
-typedef struct _fds
-{
-    fd_set set;
-    int max_fd;
-
-} fds;
-
 unsigned long get_interface();
 int start_discovery_server(int port);
 int discover_server(int port);
 int start_core_server(int port, char * key, char * iv);
+int start_core_server_sharded(int port, char * key, char * iv, int count);
+int start_core_server_config(int port, char * key, char * iv, core_config_t * config);
+void core_config_default(core_config_t * config);
+void core_config_load(core_config_t * config, const char * file);
+int stop_core_server();
+int core_stats(core_stats_t * stats);
 int start_node_client(core_t * core, unsigned int id, char * ip, int port, char * key, char * iv);
 int stop_node_client(core_t * core);
 
 int publish(core_t * core, char * channel, char * message);
+int publish_retained(core_t * core, char * channel, char * message);
 int subscribe(core_t * core, char * channel, void (*callback)(char *));
+int subscribe_from(core_t * core, char * channel, void (*callback)(char *), uint32_t sequence);
+uint32_t last_sequence(core_t * core, char * channel);
+
+int transfer(core_t * core, char * channel, const char * data, size_t size, uint32_t * id);
+int transfer_resume(core_t * core, char * channel, const char * data, size_t size, uint32_t id);
+int subscribe_transfer(core_t * core, char * channel, void (*callback)(const char *, size_t));
 
 #endif // REACTANT_NETWORK_H
@@ -9,6 +9,7 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
@@ -16,8 +17,18 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
 #include <openssl/sha.h>
 #include "exsrc_aes.h"
 
@@ -80,16 +91,101 @@ void debug_control(control_t);
 void debug_output(const char *, ...);
 
 
+/*******************************************************************************
+ *  Category:   Object pool
+ *  Description:    Implements a thread-safe pool of fixed-size objects. Memory
+ *                  is carved from slabs of many objects at once and freed
+ *                  objects are reused, so steady-state allocation does not
+ *                  reach the system allocator. Buffers of varying size are
+ *                  pooled the same way, one object pool per size class.
+ ******************************************************************************/
+// Pool object type
+typedef struct _pool_t
+{
+    size_t object_size;     // Bytes per object, rounded up for alignment
+    size_t slab_objects;    // Objects carved from each slab
+
+    void * free_list;   // Singly-linked list of free objects
+    void ** slabs;      // Every slab allocated by the pool
+    size_t slab_count;
+
+    size_t allocations;     // Objects handed out over the pool's lifetime
+    size_t in_use;          // Objects handed out and not yet returned
+    size_t peak;            // Most objects in use at once
+
+    pthread_mutex_t lock;   // Mutex used to enable threadsafe allocation
+
+} pool_t;
+
+// Pool counters; slabs only grows when a request reaches the system allocator,
+// so a path is allocation-free while the slab count holds still across it
+typedef struct _pool_stats_t
+{
+    size_t slabs;
+    size_t allocations;
+    size_t in_use;
+    size_t peak;
+
+} pool_stats_t;
+
+// Pool status
+extern char * _pool_status_message[];
+#define pool_check(function) error_check(function, _pool_status_message)
+
+typedef enum _pool_status_t
+{
+    POOL_NO_MEMORY = _EI,   // A new slab could not be allocated
+    POOL_TOO_LARGE,         // A buffer larger than the largest class was requested
+
+} pool_status_t;
+
+// Pool functions
+int pool_construct(pool_t * pool, size_t object_size, size_t slab_objects);
+int pool_destruct(pool_t * pool);
+
+int pool_alloc(pool_t * pool, void ** object);
+int pool_free(pool_t * pool, void * object);
+int pool_stats(pool_t * pool, pool_stats_t * stats);
+
+// Buffer pool object type; each buffer comes from the pool of the smallest
+// class that holds it, every class twice the size of the one before
+typedef struct _buffer_pool_t
+{
+    size_t smallest;    // Bytes per buffer of the first class
+    size_t classes;
+    pool_t * pools;     // One object pool per class
+
+} buffer_pool_t;
+
+// Buffer pool functions
+int buffer_pool_construct(buffer_pool_t * pool, size_t smallest, size_t largest, size_t slab_bytes);
+int buffer_pool_destruct(buffer_pool_t * pool);
+
+int buffer_alloc(buffer_pool_t * pool, size_t size, void ** buffer);
+int buffer_resize(buffer_pool_t * pool, void ** buffer, size_t size);
+int buffer_free(buffer_pool_t * pool, void * buffer);
+size_t buffer_capacity(void * buffer);
+int buffer_pool_stats(buffer_pool_t * pool, pool_stats_t * stats);
+
+
 /*******************************************************************************
  *  Category:   Hash table
  *  Description:    Implements a simple, generic hash table "class"
  ******************************************************************************/
+// Constant definitions
+#define HT_LOAD_FACTOR (0.75f)      // Default data objects per bucket before growing
+#define HT_MIGRATE_STEP (4)         // Buckets moved per insert or remove while growing
+#define HT_SLAB (64)                // Data objects carved from each slab
+#define HT_FNV_BASIS (2166136261u)  // FNV-1a 32-bit offset basis
+#define HT_FNV_PRIME (16777619u)    // FNV-1a 32-bit prime
+
 // Hash table data type
 typedef struct _hash_data_t
 {
     void * key;
     void * value;
 
+    uint32_t _hash;
     struct _hash_data_t * _next;
 
 } hash_data_t;
@@ -101,10 +197,19 @@ typedef struct _hash_table_t
     uint8_t (*_compare)(void *, void *);
 
     uint32_t size;
+    uint32_t count;
+    float load_factor;
 
     uint32_t _key_size;
     uint32_t _value_size;
+    uint32_t _value_offset; // Offset of the value within a data object
     hash_data_t ** _array;
+    pool_t _entries;        // Data objects, each followed by its key and value
+
+    // Array being migrated while the table grows
+    hash_data_t ** _previous;
+    uint32_t _previous_size;
+    uint32_t _migrated;
 
 } hash_table_t;
 
@@ -116,13 +221,17 @@ typedef enum _ht_status_t
 {
     HT_DNE = _EI,   // Key does not exist
     HT_DUPLICATE,   // Key already exists in hash table
+    HT_FULL,        // No free slot could be made for the key
 
 } ht_status_t;
 
 // Hash table functions
+uint32_t ht_fnv1a(const void * data, size_t length);
+
 int ht_construct(hash_table_t * hash_table, uint32_t size, uint32_t key_size, uint32_t value_size, \
                  uint32_t (*hash)(void *), uint8_t (*compare)(void *, void *));
 int ht_destruct(hash_table_t * hash_table);
+int ht_load_factor(hash_table_t * hash_table, float load_factor);
 
 int ht_search(hash_table_t * hash_table, hash_data_t * hash_data, void * key);
 int ht_insert(hash_table_t * hash_table, void * key, void * value);
@@ -130,6 +239,58 @@ int ht_remove(hash_table_t * hash_table, void * key);
 int ht_traverse(hash_table_t * hash_table, void * (*visit)(void *, void *));
 
 
+/*******************************************************************************
+ *  Category:   Open hash table
+ *  Description:    Implements an open-addressing (Robin Hood) variant of the
+ *                  hash table. Probing scans small slots holding cached hashes;
+ *                  keys and values are stored inline in one dense array. Shares
+ *                  the hash table status codes
+ ******************************************************************************/
+// Constant definitions
+#define OT_LOAD_FACTOR (0.85f)  // Default fraction of occupied slots before growing
+
+// Open hash table slot
+typedef struct _ot_slot_t
+{
+    uint32_t hash;
+    uint32_t probe;     // Distance from the home slot plus one; zero when empty
+    uint32_t entry;     // Index of the key and value in the entry array
+
+} ot_slot_t;
+
+// Open hash table object type
+typedef struct _open_table_t
+{
+    uint32_t (*_hash)(void *);
+    uint8_t (*_compare)(void *, void *);
+
+    uint32_t size;
+    uint32_t count;
+    float load_factor;
+
+    uint32_t _key_size;
+    uint32_t _value_size;
+    uint32_t _value_offset; // Offset of the value within an entry
+    uint32_t _stride;       // Bytes per entry
+
+    ot_slot_t * _slots;
+    char * _entries;        // Key and value pairs, in insertion order until removal
+    uint32_t * _hashes;     // Hash of each entry
+
+} open_table_t;
+
+// Open hash table functions
+int ot_construct(open_table_t * open_table, uint32_t size, uint32_t key_size, uint32_t value_size, \
+                 uint32_t (*hash)(void *), uint8_t (*compare)(void *, void *));
+int ot_destruct(open_table_t * open_table);
+int ot_load_factor(open_table_t * open_table, float load_factor);
+
+int ot_search(open_table_t * open_table, hash_data_t * hash_data, void * key);
+int ot_insert(open_table_t * open_table, void * key, void * value);
+int ot_remove(open_table_t * open_table, void * key);
+int ot_traverse(open_table_t * open_table, void * (*visit)(void *, void *));
+
+
 /*******************************************************************************
  *  Category:   Registry queue
  *  Description:    Implements a simple queue. Intended for use with storing
@@ -178,6 +339,142 @@ int dequeue(queue_t * queue, void ** item);
 int dequeue_blocking(queue_t * queue, void ** item);
 
 
+/*******************************************************************************
+ *  Category:   Topic trie
+ *  Description:    Implements a trie of hierarchical topic patterns. Topics
+ *                  are split into levels by '/'; in a pattern, a '+' level
+ *                  matches any single level and a final '#' level matches any
+ *                  number of remaining levels. Matching a topic visits every
+ *                  stored pattern that matches it, in time proportional to the
+ *                  topic's depth rather than the number of patterns.
+ ******************************************************************************/
+// Constant definitions
+#define TOPIC_SEPARATOR '/'
+#define TOPIC_SINGLE '+'    // Matches exactly one level
+#define TOPIC_MULTI '#'     // Matches the parent level and every level below it
+#define TOPIC_SYSTEM '$'    // Topics starting with this are not matched by leading wildcards
+
+// Trie node type
+typedef struct _trie_node_t
+{
+    char * level;   // Name of the level this node stands for
+    void * value;   // Value stored for the pattern ending here, if any
+
+    struct _trie_node_t ** children;    // Named child levels, sorted by name
+    uint32_t size;
+    uint32_t capacity;
+
+    struct _trie_node_t * single;   // Child for a '+' level
+    struct _trie_node_t * multi;    // Child for a '#' level
+    struct _trie_node_t * parent;
+
+} trie_node_t;
+
+// Trie object type
+typedef struct _trie_t
+{
+    trie_node_t root;
+    uint32_t count;     // Patterns holding a value
+
+} trie_t;
+
+// Trie status
+extern char * _trie_status_message[];
+#define trie_check(function) error_check(function, _trie_status_message)
+
+typedef enum _trie_status_t
+{
+    TRIE_DNE = _EI,     // Pattern does not exist
+    TRIE_INVALID,       // Wildcard used other than as a whole level, or '#' not last
+
+} trie_status_t;
+
+// Trie functions
+int topic_wildcard(const char * pattern);
+int topic_match(const char * pattern, const char * topic);
+
+int trie_construct(trie_t * trie);
+int trie_destruct(trie_t * trie, void (*release)(void *));
+
+int trie_insert(trie_t * trie, const char * pattern, void * value);
+int trie_search(trie_t * trie, const char * pattern, void ** value);
+int trie_remove(trie_t * trie, const char * pattern);
+int trie_match(trie_t * trie, const char * topic, void (*visit)(void *, void *), void * user);
+
+
+/*******************************************************************************
+ *  Category:   Append log
+ *  Description:    Implements a durable, append-only log of records kept in
+ *                  numbered segment files. Appends are handed to a writer
+ *                  thread that writes them in batches with one fsync per
+ *                  batch; segments roll by size and are retired by total size
+ *                  or age. Reading maps segments into memory, so records are
+ *                  visited in place without being copied. A record's position
+ *                  counts the bytes logged before it across all segments, so
+ *                  a reader can resume where it stopped.
+ ******************************************************************************/
+// Constant definitions
+#define LOG_HEADER (8)      // [record size][record hash], both big-endian
+#define LOG_SUFFIX ".log"
+
+// Log segment type
+typedef struct _log_segment_t
+{
+    uint64_t number;
+    uint64_t base;          // Log position of the segment's first byte
+
+} log_segment_t;
+
+// Log object type
+typedef struct _log_t
+{
+    char * directory;
+    size_t segment_size;    // Bytes written to a segment before it is sealed
+    size_t retain_bytes;    // Sealed segments are deleted past this total; 0 keeps any size
+    time_t retain_age;      // Sealed segments are deleted past this age in seconds; 0 keeps any age
+
+    log_segment_t * segments;   // Oldest first; the last one is written to
+    size_t segment_count;
+    int fd;                 // Descriptor of the segment being written
+    size_t active_size;     // Bytes of the segment being written that are durable
+
+    char * pending;         // Records appended since the writer last woke
+    size_t pending_size;
+    size_t pending_capacity;
+    uint64_t appended;      // Log position after the last record appended
+    uint64_t synced;        // Log position up to which records are durable
+    int error;              // Sticky status of a failed write or sync; appends and flushes return it from then on
+    size_t readers;         // Traversals in progress; no segment is retired while there are any
+    char retire_deferred;   // Retirement came due during a traversal and runs when the last one ends
+
+    pthread_t writer;
+    pthread_mutex_t lock;   // Guards everything above
+    pthread_cond_t ready;   // Signalled when records are pending
+    pthread_cond_t done;    // Signalled when a batch is durable
+    char stopping;
+
+} log_t;
+
+// Log status
+extern char * _log_status_message[];
+#define log_check(function) error_check(function, _log_status_message)
+
+typedef enum _log_status_t
+{
+    LOG_IO = _EI,   // A segment file could not be opened or written
+
+} log_status_t;
+
+// Log functions
+int log_construct(log_t * log, const char * directory, size_t segment_size, size_t retain_bytes, time_t retain_age);
+int log_destruct(log_t * log);
+
+int log_append(log_t * log, const void * record, size_t size, uint64_t * position);
+int log_flush(log_t * log);
+int log_start(log_t * log, uint64_t * position);
+int log_traverse(log_t * log, uint64_t * position, int (*visit)(const char *, size_t, uint64_t, void *), void * user);
+
+
 /*******************************************************************************
  *  Category:   Message protocol
  *  Description:    Implements helper functions for using the Reactant message
@@ -185,6 +482,8 @@ int dequeue_blocking(queue_t * queue, void ** item);
  ******************************************************************************/
 // Constant definitions
 #define MESSAGE_LENGTH (288)
+#define MESSAGE_PREFIX (4)  // Length of a variable message, sent ahead of it
+#define MESSAGE_LIMIT (16 * 1024 * 1024)    // Largest variable message accepted
 
 // Macro definitions
 #define CAPTURE_BYTE(i, n) (((i) & (0xFF << (8 * (n)))) >> (8 * (n)))
@@ -201,21 +500,92 @@ typedef struct _message_t
 
 } message_t;
 
+#define AES_ROUNDS (14)     // AES-256 rounds; the schedule holds one more round key
+#define CRYPTO_INTERLEAVE (8)   // Blocks decrypted at once by the hardware implementations
+#define UNPACK_BATCH (16)       // Messages message_unpack_many() decrypts in one pass
+
+#define AEAD_NONCE (12)    // Bytes of the nonce of a sealed message; a prefix and a count of messages sealed
+#define AEAD_TAG (16)      // Bytes of the tag of a sealed message
+#define AEAD_RESERVED (4)  // Zero bytes completing the nonce and tag to the size of a hash; authenticated
+#define AEAD_SALT (16)     // Random bytes each sender hashes into the key it seals with, so no two senders share one
+#define AEAD_LABEL "Reactant AEAD"  // Hashed with the key and salt into the AEAD key
+
+// AEAD ciphers a session may seal messages with, instead of AES-CBC and a SHA-256 hash
+typedef enum _crypto_aead_t
+{
+    CRYPTO_AEAD_NONE,           // AES-256-CBC with a SHA-256 hash of the plaintext
+    CRYPTO_AES_256_GCM,         // AES-256-GCM; fastest with AES and carry-less multiply instructions
+    CRYPTO_CHACHA20_POLY1305,   // ChaCha20-Poly1305; fastest without them
+
+} crypto_aead_t;
+
+// Crypto session object type; holds the expanded round keys of one key and IV
+typedef struct _crypto_session_t
+{
+    struct AES_ctx context;
+    uint8_t inverse[AES_keyExpSize];    // Round keys of the equivalent inverse cipher, for hardware decryption
+
+    crypto_aead_t aead;         // Cipher messages are sealed with; CRYPTO_AEAD_NONE for AES-CBC
+    int legacy_hash;            // Fixed messages hash up to their first zero byte, as builds before whole hashes did
+    uint8_t sealing[SHA256_DIGEST_LENGTH];  // AEAD key of messages sealed, from the key and this end's salt
+    uint8_t opening[SHA256_DIGEST_LENGTH];  // AEAD key of messages opened, from the key and the other end's salt
+    uint64_t sealing_keying;    // Unique to each key taken, so each thread's cipher context knows when to take it; 0 for none
+    uint64_t opening_keying;
+    uint32_t prefix;            // Leading nonce bytes; sessions sealing with the same key each take their own
+    uint64_t sealed;            // Messages sealed since the key was taken; the rest of the nonce
+
+} crypto_session_t;
+
+// Cipher implementations; each produces the same ciphertext
+typedef enum _crypto_backend_t
+{
+    CRYPTO_PORTABLE,    // Portable C implementation; byte-wise, or T-table when built with AES_TTABLE
+    CRYPTO_AESNI,       // x86 AES-NI instructions
+    CRYPTO_ARMV8,       // ARMv8 Cryptography Extension
+
+} crypto_backend_t;
+
  // Message status
 extern char * _message_status_message[];
 #define message_check(function) error_check(function, _message_status_message)
 
 typedef enum _message_status_t
 {
-    MESSAGE_NO_AUTH = _EI, // Message hash does not match
+    MESSAGE_NO_AUTH = _EI, // Message hash or tag does not match
+    MESSAGE_INVALID,       // Variable message length is not valid
+    MESSAGE_UNSUPPORTED,   // Cipher implementation is not supported by this CPU
 
 } message_status_t;
 
+// Crypto session functions
+int crypto_session_construct(crypto_session_t * session, const char * key, const char * iv);
+int crypto_session_destruct(crypto_session_t * session);
+int crypto_session_seal(crypto_session_t * session, const char * key, crypto_aead_t aead, const uint8_t * sealing, const uint8_t * opening);
+int crypto_random(void * buffer, size_t size);
+crypto_aead_t crypto_aead_preferred(void);
+crypto_backend_t crypto_backend(void);
+int crypto_backend_select(crypto_backend_t backend);
+int crypto_cbc_encrypt(const crypto_session_t * session, uint8_t * buffer, size_t length);
+int crypto_cbc_decrypt(const crypto_session_t * session, uint8_t * buffer, size_t length);
+int crypto_cbc_decrypt_many(const crypto_session_t * session, uint8_t * const * buffers, size_t count, size_t length);
+
 // Message functions
 int message_initialize(message_t * message);
 int message_pack(message_t * message, const char * key, const char * iv);
 int message_unpack(message_t * message, const char * key, const char * iv);
+int message_pack_session(message_t * message, const crypto_session_t * session);
+int message_unpack_session(message_t * message, const crypto_session_t * session);
+int message_unpack_many(message_t * messages, int * status, size_t count, const crypto_session_t * session);
 int message_debug_hex(char * message);
-unsigned char * message_hash(char * message);
+
+size_t message_variable_size(size_t payload_size);
+int message_pack_variable(message_t * message, const char * payload, size_t payload_size, char * output, const char * key, const char * iv);
+int message_unpack_variable(message_t * message, char * input, size_t size, char ** payload, const char * key, const char * iv);
+int message_peek_variable(message_t * message, const char * input, size_t size, const char * key, const char * iv);
+int message_pack_variable_session(message_t * message, const char * payload, size_t payload_size, char * output, const crypto_session_t * session);
+int message_unpack_variable_session(message_t * message, char * input, size_t size, char ** payload, const crypto_session_t * session);
+int message_peek_variable_session(message_t * message, const char * input, size_t size, const crypto_session_t * session);
+int message_hash(const void * data, size_t size, unsigned char * hash);
+int message_hash_compare(const void * lhs, const void * rhs);
 
 #endif // REACTANT_UTIL_H
@@ -6,6 +6,9 @@
 
 #include <openssl/crypto.h>
 #include <openssl/sha.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 #include "exsrc_aes.h"
 
 #define GREEN   "\x1B[32m"
@@ -26,6 +29,16 @@ int test_aes_cb(WINDOW *window);
 int test_sha_cb(WINDOW *window);
 int test_message_cb(WINDOW *window);
 int test_channels_cb(WINDOW *window);
+int test_hash_table_cb(WINDOW *window);
+int test_open_table_cb(WINDOW *window);
+int test_table_benchmark_cb(WINDOW *window);
+int test_aes_benchmark_cb(WINDOW *window);
+int test_topics_cb(WINDOW *window);
+int test_log_cb(WINDOW *window);
+int test_variable_message_cb(WINDOW *window);
+int test_pool_cb(WINDOW *window);
+int test_core_pools_cb(WINDOW *window);
+int test_core_benchmark_cb(WINDOW *window);
 
 int test_spi();
 int test_i2c();
@@ -37,6 +50,16 @@ int test_aes();
 int test_sha();
 int test_message();
 int test_channels();
+int test_hash_table();
+int test_open_table();
+int test_table_benchmark();
+int test_aes_benchmark();
+int test_topics();
+int test_log();
+int test_variable_message();
+int test_pool();
+int test_core_pools();
+int test_core_benchmark();
 
 void spi_test();
 void i2c_test();
@@ -455,6 +455,121 @@ static void InvCipher(state_t* state,uint8_t* RoundKey)
 }
 
 
+#if defined(CBC) && (CBC == 1)
+// The T-table cipher folds SubBytes, ShiftRows and MixColumns of one column into
+// four 32-bit lookups per column per round. Each state column is packed big-endian,
+// so the round keys are used in their existing byte layout. One table is kept per
+// direction and rotated for the other three rows, which keeps them in 2KB of cache.
+static uint32_t Te[256];
+static uint32_t Td[256];
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define LOAD32(p)  (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | ((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3])
+#define STORE32(p, v) do { (p)[0] = (uint8_t)((v) >> 24); (p)[1] = (uint8_t)((v) >> 16); (p)[2] = (uint8_t)((v) >> 8); (p)[3] = (uint8_t)(v); } while (0)
+
+// The tables are filled once, before main, from the S-boxes above.
+__attribute__((constructor))
+static void TableInit(void)
+{
+  unsigned i;
+  uint8_t s, r;
+  for (i = 0; i < 256; ++i)
+  {
+    s = getSBoxValue(i);
+    r = getSBoxInvert(i);
+    Te[i] = ((uint32_t)xtime(s) << 24) | ((uint32_t)s << 16) | ((uint32_t)s << 8) | (uint32_t)(xtime(s) ^ s);
+    Td[i] = ((uint32_t)Multiply(r, 0x0e) << 24) | ((uint32_t)Multiply(r, 0x09) << 16) | ((uint32_t)Multiply(r, 0x0d) << 8) | (uint32_t)Multiply(r, 0x0b);
+  }
+}
+
+// Encrypts one block with the round keys of the forward cipher.
+static void TableCipher(uint8_t* buf, const uint8_t* RoundKey)
+{
+  uint8_t round;
+  uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+
+  s0 = LOAD32(buf +  0) ^ LOAD32(RoundKey +  0);
+  s1 = LOAD32(buf +  4) ^ LOAD32(RoundKey +  4);
+  s2 = LOAD32(buf +  8) ^ LOAD32(RoundKey +  8);
+  s3 = LOAD32(buf + 12) ^ LOAD32(RoundKey + 12);
+
+  for (round = 1; round < Nr; ++round)
+  {
+    RoundKey += AES_BLOCKLEN;
+    t0 = Te[s0 >> 24] ^ ROTR(Te[(s1 >> 16) & 0xff], 8) ^ ROTR(Te[(s2 >> 8) & 0xff], 16) ^ ROTR(Te[s3 & 0xff], 24) ^ LOAD32(RoundKey +  0);
+    t1 = Te[s1 >> 24] ^ ROTR(Te[(s2 >> 16) & 0xff], 8) ^ ROTR(Te[(s3 >> 8) & 0xff], 16) ^ ROTR(Te[s0 & 0xff], 24) ^ LOAD32(RoundKey +  4);
+    t2 = Te[s2 >> 24] ^ ROTR(Te[(s3 >> 16) & 0xff], 8) ^ ROTR(Te[(s0 >> 8) & 0xff], 16) ^ ROTR(Te[s1 & 0xff], 24) ^ LOAD32(RoundKey +  8);
+    t3 = Te[s3 >> 24] ^ ROTR(Te[(s0 >> 16) & 0xff], 8) ^ ROTR(Te[(s1 >> 8) & 0xff], 16) ^ ROTR(Te[s2 & 0xff], 24) ^ LOAD32(RoundKey + 12);
+    s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+  }
+
+  // The last round has no MixColumns, so it substitutes through the S-box directly.
+  RoundKey += AES_BLOCKLEN;
+  t0 = ((uint32_t)sbox[s0 >> 24] << 24) | ((uint32_t)sbox[(s1 >> 16) & 0xff] << 16) | ((uint32_t)sbox[(s2 >> 8) & 0xff] << 8) | sbox[s3 & 0xff];
+  t1 = ((uint32_t)sbox[s1 >> 24] << 24) | ((uint32_t)sbox[(s2 >> 16) & 0xff] << 16) | ((uint32_t)sbox[(s3 >> 8) & 0xff] << 8) | sbox[s0 & 0xff];
+  t2 = ((uint32_t)sbox[s2 >> 24] << 24) | ((uint32_t)sbox[(s3 >> 16) & 0xff] << 16) | ((uint32_t)sbox[(s0 >> 8) & 0xff] << 8) | sbox[s1 & 0xff];
+  t3 = ((uint32_t)sbox[s3 >> 24] << 24) | ((uint32_t)sbox[(s0 >> 16) & 0xff] << 16) | ((uint32_t)sbox[(s1 >> 8) & 0xff] << 8) | sbox[s2 & 0xff];
+  STORE32(buf +  0, t0 ^ LOAD32(RoundKey +  0));
+  STORE32(buf +  4, t1 ^ LOAD32(RoundKey +  4));
+  STORE32(buf +  8, t2 ^ LOAD32(RoundKey +  8));
+  STORE32(buf + 12, t3 ^ LOAD32(RoundKey + 12));
+}
+
+// The equivalent inverse cipher runs the rounds in the order of the forward cipher,
+// so its round keys are reversed and, apart from the first and last, InvMixColumn'd.
+// Td[sbox[x]] is InvMixColumns applied to a lone byte x.
+static void TableInvKeys(uint32_t* InvKey, const uint8_t* RoundKey)
+{
+  uint8_t round, i;
+  uint32_t w;
+  for (round = 0; round <= Nr; ++round)
+  {
+    for (i = 0; i < Nb; ++i)
+    {
+      w = LOAD32(RoundKey + (Nr - round) * AES_BLOCKLEN + i * 4);
+      if (round > 0 && round < Nr)
+      {
+        w = Td[sbox[w >> 24]] ^ ROTR(Td[sbox[(w >> 16) & 0xff]], 8) ^ ROTR(Td[sbox[(w >> 8) & 0xff]], 16) ^ ROTR(Td[sbox[w & 0xff]], 24);
+      }
+      InvKey[round * Nb + i] = w;
+    }
+  }
+}
+
+// Decrypts one block with the round keys from TableInvKeys().
+static void TableInvCipher(uint8_t* buf, const uint32_t* InvKey)
+{
+  uint8_t round;
+  uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+
+  s0 = LOAD32(buf +  0) ^ InvKey[0];
+  s1 = LOAD32(buf +  4) ^ InvKey[1];
+  s2 = LOAD32(buf +  8) ^ InvKey[2];
+  s3 = LOAD32(buf + 12) ^ InvKey[3];
+
+  for (round = 1; round < Nr; ++round)
+  {
+    InvKey += Nb;
+    t0 = Td[s0 >> 24] ^ ROTR(Td[(s3 >> 16) & 0xff], 8) ^ ROTR(Td[(s2 >> 8) & 0xff], 16) ^ ROTR(Td[s1 & 0xff], 24) ^ InvKey[0];
+    t1 = Td[s1 >> 24] ^ ROTR(Td[(s0 >> 16) & 0xff], 8) ^ ROTR(Td[(s3 >> 8) & 0xff], 16) ^ ROTR(Td[s2 & 0xff], 24) ^ InvKey[1];
+    t2 = Td[s2 >> 24] ^ ROTR(Td[(s1 >> 16) & 0xff], 8) ^ ROTR(Td[(s0 >> 8) & 0xff], 16) ^ ROTR(Td[s3 & 0xff], 24) ^ InvKey[2];
+    t3 = Td[s3 >> 24] ^ ROTR(Td[(s2 >> 16) & 0xff], 8) ^ ROTR(Td[(s1 >> 8) & 0xff], 16) ^ ROTR(Td[s0 & 0xff], 24) ^ InvKey[3];
+    s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+  }
+
+  InvKey += Nb;
+  t0 = ((uint32_t)rsbox[s0 >> 24] << 24) | ((uint32_t)rsbox[(s3 >> 16) & 0xff] << 16) | ((uint32_t)rsbox[(s2 >> 8) & 0xff] << 8) | rsbox[s1 & 0xff];
+  t1 = ((uint32_t)rsbox[s1 >> 24] << 24) | ((uint32_t)rsbox[(s0 >> 16) & 0xff] << 16) | ((uint32_t)rsbox[(s3 >> 8) & 0xff] << 8) | rsbox[s2 & 0xff];
+  t2 = ((uint32_t)rsbox[s2 >> 24] << 24) | ((uint32_t)rsbox[(s1 >> 16) & 0xff] << 16) | ((uint32_t)rsbox[(s0 >> 8) & 0xff] << 8) | rsbox[s3 & 0xff];
+  t3 = ((uint32_t)rsbox[s3 >> 24] << 24) | ((uint32_t)rsbox[(s2 >> 16) & 0xff] << 16) | ((uint32_t)rsbox[(s1 >> 8) & 0xff] << 8) | rsbox[s0 & 0xff];
+  STORE32(buf +  0, t0 ^ InvKey[0]);
+  STORE32(buf +  4, t1 ^ InvKey[1]);
+  STORE32(buf +  8, t2 ^ InvKey[2]);
+  STORE32(buf + 12, t3 ^ InvKey[3]);
+}
+#endif // #if defined(CBC) && (CBC == 1)
+
+
 /*****************************************************************************/
 /* Public functions:                                                         */
 /*****************************************************************************/
@@ -492,7 +607,7 @@ static void XorWithIv(uint8_t* buf, uint8_t* Iv)
   }
 }
 
-void AES_CBC_encrypt_buffer(struct AES_ctx *ctx,uint8_t* buf, uint32_t length)
+void AES_CBC_encrypt_buffer_reference(struct AES_ctx *ctx,uint8_t* buf, uint32_t length)
 {
   uintptr_t i;
   uint8_t *Iv = ctx->Iv;
@@ -508,7 +623,7 @@ void AES_CBC_encrypt_buffer(struct AES_ctx *ctx,uint8_t* buf, uint32_t length)
   memcpy(ctx->Iv, Iv, AES_BLOCKLEN);
 }
 
-void AES_CBC_decrypt_buffer(struct AES_ctx* ctx, uint8_t* buf,  uint32_t length)
+void AES_CBC_decrypt_buffer_reference(struct AES_ctx* ctx, uint8_t* buf,  uint32_t length)
 {
   uintptr_t i;
   uint8_t storeNextIv[AES_BLOCKLEN];
@@ -523,6 +638,55 @@ void AES_CBC_decrypt_buffer(struct AES_ctx* ctx, uint8_t* buf,  uint32_t length)
 
 }
 
+void AES_CBC_encrypt_buffer_ttable(struct AES_ctx *ctx, uint8_t* buf, uint32_t length)
+{
+  uintptr_t i;
+  uint8_t *Iv = ctx->Iv;
+  for (i = 0; i < length; i += AES_BLOCKLEN)
+  {
+    XorWithIv(buf, Iv);
+    TableCipher(buf, ctx->RoundKey);
+    Iv = buf;
+    buf += AES_BLOCKLEN;
+  }
+  /* store Iv in ctx for next call */
+  memcpy(ctx->Iv, Iv, AES_BLOCKLEN);
+}
+
+void AES_CBC_decrypt_buffer_ttable(struct AES_ctx* ctx, uint8_t* buf, uint32_t length)
+{
+  uintptr_t i;
+  uint32_t InvKey[Nb * (Nr + 1)];
+  uint8_t storeNextIv[AES_BLOCKLEN];
+  TableInvKeys(InvKey, ctx->RoundKey);
+  for (i = 0; i < length; i += AES_BLOCKLEN)
+  {
+    memcpy(storeNextIv, buf, AES_BLOCKLEN);
+    TableInvCipher(buf, InvKey);
+    XorWithIv(buf, ctx->Iv);
+    memcpy(ctx->Iv, storeNextIv, AES_BLOCKLEN);
+    buf += AES_BLOCKLEN;
+  }
+}
+
+void AES_CBC_encrypt_buffer(struct AES_ctx *ctx, uint8_t* buf, uint32_t length)
+{
+#if defined(AES_TTABLE) && (AES_TTABLE == 1)
+  AES_CBC_encrypt_buffer_ttable(ctx, buf, length);
+#else
+  AES_CBC_encrypt_buffer_reference(ctx, buf, length);
+#endif
+}
+
+void AES_CBC_decrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, uint32_t length)
+{
+#if defined(AES_TTABLE) && (AES_TTABLE == 1)
+  AES_CBC_decrypt_buffer_ttable(ctx, buf, length);
+#else
+  AES_CBC_decrypt_buffer_reference(ctx, buf, length);
+#endif
+}
+
 #endif // #if defined(CBC) && (CBC == 1)
 
 
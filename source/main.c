@@ -146,6 +146,16 @@ void main_menu() {
     add_panel_button(panels[2], create_button("SHA256", test_sha_cb));
     add_panel_button(panels[2], create_button("Message", test_message_cb));
     add_panel_button(panels[2], create_button("Channels", test_channels_cb));
+    add_panel_button(panels[2], create_button("Hash table", test_hash_table_cb));
+    add_panel_button(panels[2], create_button("Open hash table", test_open_table_cb));
+    add_panel_button(panels[2], create_button("Table benchmark", test_table_benchmark_cb));
+    add_panel_button(panels[2], create_button("AES benchmark", test_aes_benchmark_cb));
+    add_panel_button(panels[2], create_button("Topics", test_topics_cb));
+    add_panel_button(panels[2], create_button("Append log", test_log_cb));
+    add_panel_button(panels[2], create_button("Variable message", test_variable_message_cb));
+    add_panel_button(panels[2], create_button("Object pool", test_pool_cb));
+    add_panel_button(panels[2], create_button("Core pools", test_core_pools_cb));
+    add_panel_button(panels[2], create_button("Core benchmark", test_core_benchmark_cb));
 
     panels[0]->selected = 1;
     panels[0]->items[0]->selected = 1;
@@ -171,8 +181,11 @@ void core_integration_test() {
         return;
     }
 
+    core_config_t core_config;
+    core_config_load(&core_config, CONF_INI);
+
     debug_control(ENABLE);
-    start_core_server(config.port, config.key, config.iv);
+    start_core_server_config(config.port, config.key, config.iv, &core_config);
 }
 
 void node_integration_test() {
@@ -1,17 +1,28 @@
 #include "reactant_network.h"
 
 // Global constant definitions
-const int LISTEN_QUEUE = 16;
-const int TABLE_SIZE = 10;
+const int LISTEN_QUEUE = SOMAXCONN;
+const int TABLE_SIZE = 16;
+const int HELLO_TIMEOUT = 500;
 
 static char _sublisten_init = 0;
+static subpack_t _sublisten_pack;
+static pthread_t _sublisten_thread;
+
+static pthread_mutex_t _core_lock = PTHREAD_MUTEX_INITIALIZER;
+static router_t * _core_router = NULL;  // Router of the Core running in this process, if any
 
 static int _send_to_core(core_t * core, char * message, int size) {
     int bytes;
 
     if (core && message) {
         if (core->sock) {
-            if ((bytes = write(core->sock, message, size)) != size) {
+            // Frames written by other threads never land in the middle of the message
+            pthread_mutex_lock(&core->send_lock);
+            bytes = write(core->sock, message, size);
+            pthread_mutex_unlock(&core->send_lock);
+
+            if (bytes != size) {
                 switch (errno) {
                     case EPIPE:
                         // Connection to Core was lost
@@ -38,112 +49,633 @@ static int _send_to_core(core_t * core, char * message, int size) {
     return 0;
 }
 
-static int _send_to_node(node_t * node, char * message, int size) {
+static int _receive_from_core(core_t * core, char * message, int size) {
     int bytes;
+    int received = 0;
 
-    if (node && message) {
-        if (node->sock) {
-            if ((bytes = write(node->sock, message, size)) != size) {
-                switch (errno) {
-                    case EPIPE:
-                        // Connection to Node was lost
-                        debug_output("Connection to Node [%x] has been lost!\n", node->node_id);
-                        break;
-
-                    default:
-                        // Unknown
-                        debug_output("An unknown error occurred while attempting to write to Node [%x]!\n", node->node_id);
-                }
-                return 1;
-            }
+    // Relayed frames may arrive split across several reads
+    while (received < size) {
+        if ((bytes = read(core->sock, message + received, size - received)) > 0) {
+            received += bytes;
+        } else if (bytes < 0 && errno == EINTR) {
+            continue;
         } else {
-            // Connection to Node was never established
-            debug_output("Connection to Node [%x] has not yet been established!\n", node->node_id);
+            debug_output("Connection to the Core has been lost!\n");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void _length_join(char * prefix, uint32_t length) {
+    // Length of a variable frame, ahead of it in the clear
+    for (int i = 0; i < MESSAGE_PREFIX; ++i) {
+        prefix[i] = (char) CAPTURE_BYTE(length, 3 - i);
+    }
+}
+
+static uint32_t _length_split(const char * prefix) {
+    uint32_t length = 0;
+
+    for (int i = 0; i < MESSAGE_PREFIX; ++i) {
+        length = (length << 8) | (unsigned char) prefix[i];
+    }
+    return length;
+}
+
+static void _word_join(char * output, uint32_t word) {
+    // Numbers inside binary payloads are big-endian, as the frame header's
+    for (int i = 0; i < 4; ++i) {
+        output[i] = (char) CAPTURE_BYTE(word, 3 - i);
+    }
+}
+
+static uint32_t _word_split(const char * input) {
+    uint32_t word = 0;
+
+    for (int i = 0; i < 4; ++i) {
+        word = (word << 8) | (unsigned char) input[i];
+    }
+    return word;
+}
+
+static int _send_message(core_t * core, message_t * message) {
+    char frame[MESSAGE_PREFIX + MESSAGE_LENGTH];
+
+    // Connections with variable frames precede every frame with its length
+    if (core->protocol >= PROTOCOL_VARIABLE) {
+        _length_join(frame, MESSAGE_LENGTH);
+        memcpy(frame + MESSAGE_PREFIX, message->message_string, MESSAGE_LENGTH);
+        return _send_to_core(core, frame, sizeof(frame));
+    }
+    return _send_to_core(core, message->message_string, MESSAGE_LENGTH);
+}
+
+static int _receive_message(core_t * core, message_t * message, char ** payload, size_t * capacity, char ** buffer) {
+    char prefix[MESSAGE_PREFIX];
+    uint32_t size = MESSAGE_LENGTH;
+    int rval;
+
+    *payload = NULL;
+    *capacity = sizeof(message->payload);
+    *buffer = NULL;
+    message_initialize(message);
+
+    if (core->protocol >= PROTOCOL_VARIABLE) {
+        if (_receive_from_core(core, prefix, MESSAGE_PREFIX)) {
+            return 1;
+        }
+        size = _length_split(prefix);
+    }
+
+    if (size == MESSAGE_LENGTH) {
+        if (_receive_from_core(core, message->message_string, MESSAGE_LENGTH)) {
             return 1;
         }
+        rval = message_unpack_session(message, &core->session);
+        *payload = message->payload;
     } else {
-        // Invalid parameters
-        debug_output("<_send_to_node> Invalid parameter(s)!\n");
+        // Longer frames are read into a pooled buffer, returned by the caller once the message is delivered
+        if (size > MESSAGE_LIMIT || buffer_alloc(&core->buffers, size, (void **) buffer) != SUCCESS) {
+            debug_output("Cannot receive frame of length [%u]!\n", size);
+            return 1;
+        }
+        if (_receive_from_core(core, *buffer, size)) {
+            buffer_free(&core->buffers, *buffer);
+            *buffer = NULL;
+            return 1;
+        }
+        rval = message_unpack_variable_session(message, *buffer, size, payload, &core->session);
+        *capacity = size - 6 - SHA256_DIGEST_LENGTH;
+    }
+
+    if (rval != SUCCESS) {
+        debug_output("Message authentication failed!\n");
+        if (*buffer) {
+            buffer_free(&core->buffers, *buffer);
+            *buffer = NULL;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static int _receive_fragments(core_t * core, message_t * message, char * body, char ** assembly) {
+    message_t fragment;
+    char * payload;
+    char * buffer;
+    size_t size = strnlen(body, FRAGMENT_PAYLOAD);
+    size_t capacity;
+    size_t length;
+    unsigned short remaining = (unsigned short) message->bytes_remaining;
+    int rval = 0;
+
+    // bytes_remaining sizes the buffer up front, unless it saturated
+    if (buffer_alloc(&core->buffers, size + remaining + 1, (void **) assembly) != SUCCESS) {
+        return -1;
+    }
+    memcpy(*assembly, body, size);
+
+    // Connections that fragment only carry fixed frames, so no buffer is taken per fragment
+    while (remaining) {
+        if ((rval = _receive_message(core, &fragment, &payload, &capacity, &buffer))) {
+            break;
+        }
+        if (fragment.source_id != FRAME_FRAGMENT) {
+            debug_output("Fragmented message interrupted!\n");
+            rval = -1;
+            break;
+        }
+
+        remaining = (unsigned short) fragment.bytes_remaining;
+        length = strnlen(payload, FRAGMENT_PAYLOAD);
+        if (size + length + 1 > MESSAGE_LIMIT || buffer_resize(&core->buffers, (void **) assembly, size + length + remaining + 1) != SUCCESS) {
+            debug_output("Fragmented message exceeds [%d] bytes!\n", MESSAGE_LIMIT);
+            rval = -1;
+            break;
+        }
+        memcpy(*assembly + size, payload, length);
+        size += length;
+    }
+
+    if (rval) {
+        buffer_free(&core->buffers, *assembly);
+        *assembly = NULL;
+        return rval;
+    }
+    (*assembly)[size] = 0;
+    return 0;
+}
+
+static int _fragment_count(size_t size) {
+    return (int) ((size + FRAGMENT_PAYLOAD - 1) / FRAGMENT_PAYLOAD);
+}
+
+static void _fragment_pack(char * output, message_t * head, char * payload, size_t size, const crypto_session_t * session) {
+    message_t message;
+    size_t offset = 0;
+    size_t length;
+
+    // The first frame carries the flags of the message; the others only continue its payload
+    for (int i = 0; offset < size; ++i) {
+        message_initialize(&message);
+        message.source_id = (i ? 0 : head->source_id) | FRAME_FRAGMENT;
+
+        length = (size - offset < FRAGMENT_PAYLOAD) ? size - offset : FRAGMENT_PAYLOAD;
+        memcpy(message.payload, payload + offset, length);
+        offset += length;
+        message.bytes_remaining = (size - offset < FRAGMENT_SATURATED) ? (short) (size - offset) : FRAGMENT_SATURATED;
+
+        message_pack_session(&message, session);
+        memcpy(output + i * MESSAGE_LENGTH, message.message_string, MESSAGE_LENGTH);
+    }
+}
+
+static void _combined_join(char * payload, char * channel, char * body) {
+    // [channel length][channel][body], terminated by the zeroed remainder of the payload
+    payload[0] = (char) strlen(channel);
+    memcpy(payload + 1, channel, strlen(channel));
+    strcpy(payload + 1 + strlen(channel), body);
+}
+
+static int _combined_split(char * payload, char * channel, char ** body) {
+    int length = (unsigned char) payload[0];
+
+    if (length == 0 || length + 1 >= 250) {
         return 1;
     }
+    memcpy(channel, payload + 1, length);
+    channel[length] = 0;
+    *body = payload + 1 + length;
     return 0;
 }
 
-static uint32_t _hash_channel(void * name) {
-    char * str = (char *) name;
-    int hash = 0;
+static void _interned_join(char * payload, uint32_t id, char * text) {
+    // [channel ID][text], terminated by the zeroed remainder of the payload
+    for (int i = 0; i < 4; ++i) {
+        payload[i] = (char) CAPTURE_BYTE(id, 3 - i);
+    }
+    strcpy(payload + 4, text);
+}
+
+static uint32_t _interned_split(char * payload, char ** text) {
+    uint32_t id = 0;
+
+    for (int i = 0; i < 4; ++i) {
+        id = (id << 8) | (unsigned char) payload[i];
+    }
+    *text = payload + 4;
+    return id;
+}
+
+static int _negotiate(core_t * core) {
+    message_t message;
+    struct pollfd readable;
+    uint8_t salt[AEAD_SALT];
+    int received = 0;
+    int version;
+    int bytes;
+
+    // Offer our protocol version; a Core predating negotiation only sees a subscription to PROTOCOL_CHANNEL
+    message_initialize(&message);
+    message.bytes_remaining = PROTOCOL_VERSION;
+    message.source_id = FRAME_HELLO;
+    strcpy(message.payload, PROTOCOL_CHANNEL);
+
+    // The salt the Core keys our sealed frames with; without one there is nothing to seal with
+    if (crypto_random(salt, sizeof(salt)) == SUCCESS) {
+        memcpy(message.payload + sizeof(PROTOCOL_CHANNEL) + 1, salt, sizeof(salt));
+    } else {
+        message.bytes_remaining = PROTOCOL_HASHED;
+    }
+    message_pack_session(&message, &core->session);
+
+    if (_send_to_core(core, message.message_string, MESSAGE_LENGTH)) {
+        return PROTOCOL_LEGACY;
+    }
+
+    // Only a Core that supports negotiation answers
+    message_initialize(&message);
+    readable.fd = core->sock;
+    readable.events = POLLIN;
+    while (received < MESSAGE_LENGTH && poll(&readable, 1, HELLO_TIMEOUT) > 0) {
+        if ((bytes = read(core->sock, message.message_string + received, MESSAGE_LENGTH - received)) <= 0) {
+            break;
+        }
+        received += bytes;
+    }
 
-    for (int i = 0; i < strlen(str); ++i) {
-        hash ^= str[i];
-        hash += str[i];
+    if (received == MESSAGE_LENGTH && message_unpack_session(&message, &core->session) == SUCCESS && (message.source_id & FRAME_HELLO)) {
+        debug_output("Core agreed to protocol version [%d]!\n", message.bytes_remaining);
+        version = (message.bytes_remaining < PROTOCOL_VERSION) ? message.bytes_remaining : PROTOCOL_VERSION;
+
+        // Every frame from here on is hashed whole, or sealed with the cipher the Core chose; the Core already seals its side
+        // with its own salt, and opens ours with the one we offered
+        core->session.legacy_hash = (version < PROTOCOL_HASHED);
+        if (version == PROTOCOL_SEALED && crypto_session_seal(&core->session, core->key, (crypto_aead_t) message.payload[sizeof(PROTOCOL_CHANNEL)],
+                                                              salt, (uint8_t *) message.payload + sizeof(PROTOCOL_CHANNEL) + 1) != SUCCESS) {
+            debug_output("Could not seal frames with cipher [%d], no protocol version left to speak!\n", message.payload[sizeof(PROTOCOL_CHANNEL)]);
+            return 0;
+        }
+        return version;
     }
-    return (hash % 10);
+
+    debug_output("Core did not negotiate, using protocol version [%d]!\n", PROTOCOL_LEGACY);
+    return PROTOCOL_LEGACY;
+}
+
+static uint32_t _hash_channel(void * name) {
+    // The table reduces the full hash to a bucket itself
+    return ht_fnv1a(name, strnlen((char *) name, 250));
 }
 
 static uint8_t _compare_channel(void * lhs, void * rhs) {
     return (strcmp((char *) lhs, (char *) rhs) == 0);
 }
 
+static uint32_t _channel_id(core_t * core, char * channel) {
+    hash_data_t search;
+    char name[250] = { 0 };
+    uint32_t id = 0;
+
+    strncpy(name, channel, sizeof(name) - 1);
+
+    pthread_mutex_lock(&core->channel_lock);
+    if (ht_search(&core->channels, &search, name) == SUCCESS) {
+        id = *(uint32_t *) search.value;
+    }
+    pthread_mutex_unlock(&core->channel_lock);
+    return id;
+}
+
+static void _channel_learn(subpack_t * pack, uint32_t id, char * channel) {
+    core_t * core = pack->core;
+    char name[250] = { 0 };
+    char ** names = core->names;
+    uint32_t * sequences = core->sequences;
+    uint32_t size;
+
+    strncpy(name, channel, sizeof(name) - 1);
+
+    // Later publishes to the channel may send the ID alone
+    pthread_mutex_lock(&core->channel_lock);
+    ht_insert(&core->channels, name, &id);
+
+    // Relays by ID are matched against wildcard subscriptions by name
+    if (id >= core->names_size) {
+        size = (id + 1) * 2;
+        if (buffer_resize(&core->buffers, (void **) &names, size * sizeof(char *)) == SUCCESS) {
+            memset(names + core->names_size, 0, (size - core->names_size) * sizeof(char *));
+            core->names = names;
+        }
+        if (core->names == names && buffer_resize(&core->buffers, (void **) &sequences, size * sizeof(uint32_t)) == SUCCESS) {
+            memset(sequences + core->names_size, 0, (size - core->names_size) * sizeof(uint32_t));
+            core->sequences = sequences;
+            core->names_size = size;
+        }
+    }
+    if (id < core->names_size && !core->names[id] && buffer_alloc(&core->buffers, strlen(name) + 1, (void **) &core->names[id]) == SUCCESS) {
+        strcpy(core->names[id], name);
+    }
+    pthread_mutex_unlock(&core->channel_lock);
+
+    // Relays to the channel may arrive with the ID alone
+    pthread_mutex_lock(pack->lock);
+    for (int i = 0; i < pack->size; ++i) {
+        if (strcmp(pack->subs[i].channel, name) == 0) {
+            pack->subs[i].id = id;
+        }
+    }
+    pthread_mutex_unlock(pack->lock);
+}
+
+static void _transfer_answer(core_t * core, char kind, uint32_t id, uint32_t next) {
+    pthread_mutex_lock(&core->transfer_lock);
+    if (core->transferring && kind == TRANSFER_ACCEPT && !core->transfer_answered) {
+        // The sender goes on from the first chunk the Core still needs
+        core->transfer_answered = 1;
+        core->transfer_id = id;
+        core->transfer_next = next;
+    } else if (core->transferring && kind == TRANSFER_ACK && core->transfer_answered && id == core->transfer_id && next > core->transfer_next) {
+        core->transfer_next = next;
+    }
+    pthread_cond_broadcast(&core->transfer_ready);
+    pthread_mutex_unlock(&core->transfer_lock);
+}
+
+static void _transfer_discard(subpack_t * pack, transfer_t * receipt) {
+    if (receipt->data) {
+        buffer_free(&pack->core->buffers, receipt->data);
+    }
+    if (receipt->received) {
+        buffer_free(&pack->core->buffers, receipt->received);
+    }
+    memset(receipt, 0, sizeof(*receipt));
+}
+
+static transfer_t * _transfer_find(subpack_t * pack, uint32_t id) {
+    for (int i = 0; i < TRANSFER_RECEIVING && id; ++i) {
+        if (pack->transfers[i].id == id) {
+            return &pack->transfers[i];
+        }
+    }
+    return NULL;
+}
+
+static int _transfer_wanted(subpack_t * pack, char * channel) {
+    int wanted = 0;
+
+    pthread_mutex_lock(pack->lock);
+    for (int i = 0; i < pack->size && !wanted; ++i) {
+        wanted = pack->subs[i].transfer && topic_match(pack->subs[i].channel, channel);
+    }
+    pthread_mutex_unlock(pack->lock);
+    return wanted;
+}
+
+static void _transfer_begin(subpack_t * pack, char * payload, size_t capacity) {
+    transfer_t * receipt;
+    char channel[250] = { 0 };
+    uint32_t id = _word_split(payload + 1);
+    uint32_t chunks = _word_split(payload + 5);
+    uint32_t chunk_size = _word_split(payload + 9);
+    uint32_t size = _word_split(payload + 13);
+
+    strncpy(channel, payload + TRANSFER_BEGIN_HEADER, (capacity - TRANSFER_BEGIN_HEADER < sizeof(channel) - 1) ? capacity - TRANSFER_BEGIN_HEADER : sizeof(channel) - 1);
+
+    // A resumed transfer is announced again; what was received of it is kept
+    if (_transfer_find(pack, id) || !_transfer_wanted(pack, channel)) {
+        return;
+    }
+    if (id == 0 || chunk_size == 0 || size == 0 || chunks != (uint32_t) (((uint64_t) size + chunk_size - 1) / chunk_size)) {
+        debug_output("Invalid transfer announced on channel [%s]!\n", channel);
+        return;
+    }
+
+    // Take a free slot, otherwise give up on the oldest transfer
+    receipt = &pack->transfers[0];
+    for (int i = 0; i < TRANSFER_RECEIVING && receipt->id; ++i) {
+        if (pack->transfers[i].id == 0 || pack->transfers[i].id < receipt->id) {
+            receipt = &pack->transfers[i];
+        }
+    }
+    if (receipt->id) {
+        debug_output("Transfer [%u] abandoned incomplete!\n", receipt->id);
+        _transfer_discard(pack, receipt);
+    }
+
+    if (buffer_alloc(&pack->core->buffers, size, (void **) &receipt->data) != SUCCESS
+    ||  buffer_alloc(&pack->core->buffers, (chunks + 7) / 8, (void **) &receipt->received) != SUCCESS) {
+        debug_output("Cannot receive transfer of [%u] bytes!\n", size);
+        _transfer_discard(pack, receipt);
+        return;
+    }
+    memset(receipt->received, 0, (chunks + 7) / 8);
+    receipt->id = id;
+    strcpy(receipt->channel, channel);
+    receipt->chunks = chunks;
+    receipt->chunk_size = chunk_size;
+    receipt->size = size;
+    memcpy(receipt->hash, payload + 17, SHA256_DIGEST_LENGTH);
+
+    debug_output("Receiving transfer [%u] of [%u] bytes on channel [%s]!\n", id, size, channel);
+}
+
+static void _transfer_data(subpack_t * pack, char * payload, size_t capacity) {
+    transfer_t * receipt;
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    uint32_t index = _word_split(payload + 5);
+    uint32_t length = _word_split(payload + 9);
+    uint64_t offset;
+
+    if ((receipt = _transfer_find(pack, _word_split(payload + 1))) == NULL) {
+        // Announced before this Node subscribed, or abandoned
+        return;
+    }
+
+    // Every chunk but the last is full
+    offset = (uint64_t) index * receipt->chunk_size;
+    if (index >= receipt->chunks || length > capacity - TRANSFER_HEADER
+    ||  length != ((index + 1 < receipt->chunks) ? receipt->chunk_size : receipt->size - offset)) {
+        debug_output("Invalid chunk [%u] of transfer [%u]!\n", index, receipt->id);
+        return;
+    }
+    if (ht_fnv1a(payload + TRANSFER_HEADER, length) != _word_split(payload + 13)) {
+        debug_output("Chunk [%u] of transfer [%u] failed its checksum!\n", index, receipt->id);
+        return;
+    }
+
+    if (!(receipt->received[index / 8] & (1 << (index % 8)))) {
+        memcpy(receipt->data + offset, payload + TRANSFER_HEADER, length);
+        receipt->received[index / 8] |= 1 << (index % 8);
+        receipt->count += 1;
+    }
+    if (receipt->count < receipt->chunks) {
+        return;
+    }
+
+    // Complete; the whole transfer is checked before it is delivered
+    message_hash(receipt->data, receipt->size, hash);
+    if (message_hash_compare(hash, receipt->hash) != 0) {
+        debug_output("Transfer [%u] failed its checksum!\n", receipt->id);
+    } else {
+        debug_output("Transfer [%u] of [%u] bytes received on channel [%s]!\n", receipt->id, receipt->size, receipt->channel);
+
+        pthread_mutex_lock(pack->lock);
+        for (int i = 0; i < pack->size; ++i) {
+            if (pack->subs[i].transfer && topic_match(pack->subs[i].channel, receipt->channel)) {
+                pack->subs[i].transfer(receipt->data, receipt->size);
+            }
+        }
+        pthread_mutex_unlock(pack->lock);
+    }
+    _transfer_discard(pack, receipt);
+}
+
+static void _transfer_receive(subpack_t * pack, char * payload, size_t capacity) {
+    // Every kind carries at least [kind][ID][word]
+    if (capacity < 9) {
+        return;
+    }
+
+    switch (payload[0]) {
+    case TRANSFER_ACCEPT:
+    case TRANSFER_ACK:
+        _transfer_answer(pack->core, payload[0], _word_split(payload + 1), _word_split(payload + 5));
+        break;
+    case TRANSFER_BEGIN:
+        if (capacity > TRANSFER_BEGIN_HEADER) {
+            _transfer_begin(pack, payload, capacity);
+        }
+        break;
+    case TRANSFER_DATA:
+        if (capacity >= TRANSFER_HEADER) {
+            _transfer_data(pack, payload, capacity);
+        }
+        break;
+    default:
+        debug_output("Unknown transfer frame [%d]!\n", payload[0]);
+        break;
+    }
+}
+
 static void * _subscription_listener(void *_pack) {
     subpack_t * pack = (subpack_t *) _pack;
+    core_t * core = pack->core;
 
     message_t message;
-    char buffer[MESSAGE_LENGTH];
     char channel[250];
-    int bytes = 0;
+    char * payload;
+    size_t capacity;
+    char * buffer = NULL;
+    char * assembly = NULL;
+    char * body;
+    char combined;
+    uint32_t sequence;
+    uint32_t id;
     char found;
+    int rval;
 
     // Wait for and handle incoming relayed messages
     while (1) {
-        // Clear buffers
-        memset(buffer, 0, sizeof(buffer));
+        // Clear buffers; those of long messages go back to the pool for the next one
         memset(channel, 0, sizeof(channel));
+        if (assembly) {
+            buffer_free(&core->buffers, assembly);
+            assembly = NULL;
+        }
+        if (buffer) {
+            buffer_free(&core->buffers, buffer);
+            buffer = NULL;
+        }
         found = 0;
 
-        const char * key = pack->core->key;
-        const char * iv = pack->core->iv;
-
         //// GET CHANNEL /////////////////////////////////////////////////////////////////
-        if ((bytes = read(pack->core->sock, buffer, sizeof(buffer))) != sizeof(buffer)) {
-            debug_output("Invalid channel read, rval: [%d]!\n", bytes);
+        if ((rval = _receive_message(core, &message, &payload, &capacity, &buffer)) > 0) {
+            break;
+        } else if (rval < 0) {
             continue;
         }
-        message_initialize(&message);
-        memcpy(message.message_string, buffer, MESSAGE_LENGTH);
-        // Generate message struct from message
-        if (message_unpack(&message, key, iv) == MESSAGE_NO_AUTH)
-        {
-            debug_output("Message authentication failed!\n");
+
+        if (message.source_id & FRAME_HELLO) {
+            // Late negotiation reply; nothing to deliver
+            continue;
+        } else if (message.source_id & FRAME_CHANNEL) {
+            // The Core assigned an ID to a channel
+            id = _interned_split(payload, &body);
+            _channel_learn(pack, id, body);
+            continue;
+        } else if (message.source_id & FRAME_TRANSFER) {
+            // Transfer frames are binary; the frame, not a terminator, bounds them
+            _transfer_receive(pack, payload, capacity);
+            continue;
+        } else if (message.source_id == FRAME_FRAGMENT) {
+            // Continues a message that was already abandoned
+            continue;
+        }
+
+        combined = (message.source_id & FRAME_PUBLISH) != 0;
+        id = 0;
+        if (!combined) {
+            strncpy(channel, payload, sizeof(channel) - 1);
+        } else if (message.source_id & FRAME_INTERNED) {
+            // Only the channel ID was relayed; its name was announced before
+            id = _interned_split(payload, &body);
+            sequence = (message.source_id & FRAME_SEQUENCE) ? _interned_split(body, &body) : 0;
+
+            pthread_mutex_lock(&core->channel_lock);
+            if (id < core->names_size && core->names[id]) {
+                strcpy(channel, core->names[id]);
+
+                // Where to resume from should the subscription be replayed
+                if (sequence) {
+                    core->sequences[id] = sequence;
+                }
+            }
+            pthread_mutex_unlock(&core->channel_lock);
+        } else if (_combined_split(payload, channel, &body)) {
+            // Channel and payload arrived in one frame, but it is malformed
+            debug_output("Invalid combined frame!\n");
             continue;
         }
 
-        strcpy(channel, message.payload);
+        if (combined && (message.source_id & FRAME_FRAGMENT)) {
+            // The rest of the message follows in the frames after this one
+            if ((rval = _receive_fragments(core, &message, body, &assembly)) > 0) {
+                break;
+            } else if (rval < 0) {
+                continue;
+            }
+            body = assembly;
+        }
         //////////////////////////////////////////////////////////////////////////////////
 
         //// GET PAYLOAD /////////////////////////////////////////////////////////////////
-        if ((bytes = read(pack->core->sock, buffer, sizeof(buffer))) != sizeof(buffer)) {
-            debug_output("Invalid payload read, rval: [%d]!\n", bytes);
-            continue;
-        }
-        message_initialize(&message);
-        memcpy(message.message_string, buffer, MESSAGE_LENGTH);
-        // Generate message struct from message
-        if (message_unpack(&message, key, iv) == MESSAGE_NO_AUTH) {
-            debug_output("Message authentication failed!\n");
-            continue;
+        if (!combined) {
+            if (buffer) {
+                buffer_free(&core->buffers, buffer);
+                buffer = NULL;
+            }
+            if ((rval = _receive_message(core, &message, &payload, &capacity, &buffer)) > 0) {
+                break;
+            } else if (rval < 0) {
+                continue;
+            }
+            body = payload;
         }
         //////////////////////////////////////////////////////////////////////////////////
 
         pthread_mutex_lock(pack->lock);
 
-        debug_output("Looking for channel [%s]!\n", channel);
+        debug_output("Looking for channel [%s][%u]!\n", channel, id);
 
-        // Invoke callback function for the received channel
+        // Invoke callback function of every subscription matching the received channel
         for (int i = 0; i < pack->size; ++i) {
-            if (strcmp(pack->subs[i].channel, channel) == 0) {
+            if (!pack->subs[i].callback) {
+                continue;
+            } else if ((id && pack->subs[i].id == id) || topic_match(pack->subs[i].channel, channel)) {
                 found = 1;
-                pack->subs[i].callback(message.payload);
-                break;
+                pack->subs[i].callback(body);
             }
         }
 
@@ -152,9 +684,44 @@ static void * _subscription_listener(void *_pack) {
         }
         pthread_mutex_unlock(pack->lock);
     }
+
+    if (assembly) {
+        buffer_free(&core->buffers, assembly);
+    }
+    if (buffer) {
+        buffer_free(&core->buffers, buffer);
+    }
+
+    // A transfer being sent has lost the Core; wake the sender rather than let it time out
+    pthread_mutex_lock(&core->transfer_lock);
+    core->transfer_answered = 1;
+    core->transfer_id = 0;
+    pthread_cond_broadcast(&core->transfer_ready);
+    pthread_mutex_unlock(&core->transfer_lock);
     return NULL;
 }
 
+static int _sublisten_start(core_t * core) {
+    subpack_t * pack = &_sublisten_pack;
+
+    pack->core = core;
+    pack->size = 0;
+    pack->subs = NULL;
+    memset(pack->transfers, 0, sizeof(pack->transfers));
+    pack->lock = calloc(1, sizeof(pthread_mutex_t));
+    pthread_mutex_init(pack->lock, NULL);
+
+    if (pthread_create(&_sublisten_thread, NULL, &_subscription_listener, (void *) pack)) {
+        debug_output("Could not create listener thread!\n");
+        pthread_mutex_destroy(pack->lock);
+        free(pack->lock);
+        return 1;
+    }
+
+    _sublisten_init = 1;
+    return 0;
+}
+
 unsigned long get_interface()
 {
     struct ifaddrs *if_addr, *ifa;
@@ -236,7 +803,7 @@ static void * _network_traverse(void * v_key, void * v_value) {
 
     debug_output("Channel [%s] devices:\n", key);
     for (int i = 0; i < array->size; ++i) {
-        debug_output("%d. %x \t", i + 1, array->nodes[i].node_id);
+        debug_output("%d. %x \t", i + 1, array->nodes[i].connection->node_id);
         if ((i + 1) % 5 == 0) {
             debug_output("\n");
         }
@@ -276,50 +843,27 @@ int discover_server(int port) {
     return 0;
 }
 
-int start_core_server(int port, char *key, char *iv) {
-    int rval;
-
-    hash_table_t table;
-    ht_construct(&table, TABLE_SIZE, 250,       sizeof(channel_t), &_hash_channel, &_compare_channel);
-    //           table   10          key size   value size         hash function   compare function
-
-    message_t message;
-    hash_data_t search;
-    channel_t  * channel_target;
-    //fds * fd_list;
-    int max_fd;
-    fd_set active_fds;
-    fd_set read_fds;
-
+static int _core_listen(int port) {
     int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    int handle = 0;
-    int client_size = sizeof(struct sockaddr);
-
-    char buffer[MESSAGE_LENGTH];
-    char desbuf[MESSAGE_LENGTH];
-    int bytes = 0;
-
-    char channel[250];
-
-    char mode;
-    char found;
-
     int yes = 1;
 
-    struct sockaddr_in server_addr, client_addr;
+    struct sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons((uint16_t) port);
     server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
     memset(server_addr.sin_zero, 0, sizeof(server_addr.sin_zero));
 
-    // Ignore SIGPIPE signals
-    signal(SIGPIPE, SIG_IGN);
-
-    debug_output("\n");
+    if (sock < 0) {
+        debug_output("Could not create socket!\n");
+        return -1;
+    }
 
-    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) < 0) {
+    // SO_REUSEPORT lets every shard bind its own listener; the kernel balances accepts between them
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) < 0
+    ||  setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) < 0) {
         debug_output("Could not set socket options!\n");
-        return 1;
+        close(sock);
+        return -1;
     } else {
         debug_output("Socket options set!\n");
     }
@@ -328,7 +872,7 @@ int start_core_server(int port, char *key, char *iv) {
     if (bind(sock, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
         debug_output("Could not bind to %d:%d!\n", ntohl(server_addr.sin_addr.s_addr), ntohs(server_addr.sin_port));
         close(sock);
-        return 1;
+        return -1;
     } else {
         debug_output("Server bind to %d:%d successful!\n", ntohl(server_addr.sin_addr.s_addr), ntohs(server_addr.sin_port));
     }
@@ -337,246 +881,2629 @@ int start_core_server(int port, char *key, char *iv) {
     if (listen(sock, LISTEN_QUEUE) < 0) {
         debug_output("Could not listen for incoming connections!\n");
         close(sock);
-        return 1;
+        return -1;
     } else {
         debug_output("Listening for incoming connections!\n");
     }
 
-    FD_ZERO(&active_fds);
-    FD_SET(sock, &active_fds);
-    max_fd = sock;
+    // Accepts are drained until EAGAIN, so the listener must not block
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
 
-    debug_output("Core initialized, awaiting connections...\n");
+    return sock;
+}
 
-    while(1) {
-        // Clear buffers
-        memset(buffer, 0, sizeof(buffer));
-        memset(desbuf, 0, sizeof(desbuf));
-        memset(channel, 0, sizeof(channel));
+static int _channel_search(router_t * router, hash_data_t * search, char * channel) {
+    return (router->kind == TABLE_OPEN) ? ot_search(&router->open, search, channel) : ht_search(&router->table, search, channel);
+}
 
-        debug_output("\n");
+static int _channel_insert(router_t * router, char * channel, uint32_t * id) {
+    return (router->kind == TABLE_OPEN) ? ot_insert(&router->open, channel, id) : ht_insert(&router->table, channel, id);
+}
 
-        // Wait for incoming connections
-        read_fds = active_fds;
-        if ((rval = select(max_fd + 1, &read_fds, NULL, NULL, NULL)) < 0) {
-            debug_output("Failed to select incoming IO!: [%d]\n", errno);
-            continue;
+static void _channel_traverse(router_t * router) {
+    for (uint32_t id = 1; id <= router->channel_count; ++id) {
+        if (router->channels[id]->size) {
+            _network_traverse(router->channels[id]->name, router->channels[id]);
         }
-        for (int s = 0; s < max_fd + 1; ++s) {
-            if (FD_ISSET(s, &read_fds)) {
-                if (s == sock) {
-                    // Incoming new connection
-                    if ((handle = accept(sock, (struct sockaddr *) &client_addr, (socklen_t *) &client_size)) < 0) {
-                        debug_output("Failed to accept incoming connection!\n");
-                        continue;
-                    } else {
-                        FD_SET(handle, &active_fds);
-                        if (handle > max_fd) {
-                            max_fd = handle;
-                        }
-                        debug_output("Acquired new connection!\n");
-                    }
-                } else {
-                    debug_output("Acquired old connection!\n");
-                    handle = s;
-                }
-
-                // Read incoming message
-                if ((bytes = read(handle, buffer, sizeof(buffer))) != sizeof(buffer)) {
-                    if (bytes) {
-                        debug_output("Invalid initial read, rval: [%d][%d]!\n", bytes, errno);
-                    } else {
-                        // Read 0 bytes; Node terminated connection
-                        debug_output("Node terminated connection!\n");
+    }
+}
 
-                        FD_CLR(handle, &active_fds);
-                        close(handle);
-                    }
-                    continue;
-                }
+static channel_t * _channel_find(router_t * router, char * channel) {
+    hash_data_t search;
 
-                // Generate message struct from message
-                message_initialize(&message);
-                memcpy(message.message_string, buffer, MESSAGE_LENGTH);
-                if (message_unpack(&message, key, iv) == MESSAGE_NO_AUTH) {
-                    debug_output("Message authentication failed!\n");
-                    continue;
-                }
-                memcpy(desbuf, buffer, sizeof(desbuf));
-                memcpy(channel, message.payload, sizeof(channel));
-
-                switch (message.source_id) {
-                case 0:
-                    // Message is a "Publish" message
-                    debug_output("Publish message received!\n");
-
-                    // Read payload message
-                    if ((bytes = read(handle, buffer, sizeof(buffer))) != sizeof(buffer)) {
-                        debug_output("Invalid payload read, rval: [%d][%d]!\n", bytes, errno);
-                        continue;
-                    }
+    // Caller holds the router lock
+    if (_channel_search(router, &search, channel) == SUCCESS) {
+        return router->channels[*(uint32_t *) search.value];
+    }
+    return NULL;
+}
 
-                    // Generate message struct from message
-                    message_initialize(&message);
-                    memcpy(message.message_string, buffer, MESSAGE_LENGTH);
-                    if (message_unpack(&message, key, iv) == MESSAGE_NO_AUTH) {
-                        debug_output("Message authentication failed!");
-                        continue;
-                    }
-                    debug_output("Publishing message [%s] to channel [%s]!\n", message.payload, channel);
-
-                    // Find channel in table
-                    if (ht_search(&table, &search, channel) == HT_DNE) {
-                        // Channel hasn't been created yet; no devices are subscribed to the target channel
-                        debug_output("No devices are subscribed to channel [%s]!\n", channel);
-                    } else {
-                        // Relay message to all devices subscribed to the target channel
-                        channel_target = (channel_t *) search.value;
-                        found = 0;
-
-                        debug_output("Relaying message from channel [%s] to [%d] devices!\n", channel, channel_target->size);
-
-                        for (int i = 0; i < channel_target->size && !found; ++i) {
-                            if (_send_to_node(&(channel_target->nodes[i]), desbuf, MESSAGE_LENGTH)
-                            ||  _send_to_node(&(channel_target->nodes[i]), buffer, MESSAGE_LENGTH)) {
-                                // Message failed to send
-                                debug_output("Failed to relay message from channel [%s] to device [%x]!\n", channel, channel_target->nodes[i].node_id);
-
-                                // Remove device from array
-                                if (channel_target->size == 1) {
-                                    // Device is the only subscribed device
-                                    free(channel_target->nodes[0].addr);
-                                    free(channel_target->nodes);
-                                    ht_remove(&table, channel);
-                                    found = 1;
-                                    debug_output("Channel [%s] has no subscribers. Removed!\n", channel);
-                                } else {
-                                    // Device is not the only subscribed device
-                                    // Free Node elements
-                                    free(channel_target->nodes[i].addr);
-                                    // Patch array
-                                    for (int j = i; j < channel_target->size - 1; ++j) {
-                                        channel_target->nodes[i] = channel_target->nodes[i + 1];
-                                    }
-                                    // Free element
-                                    channel_target->nodes = realloc(channel_target->nodes, (channel_target->size - 1) * sizeof(node_t));
-                                    channel_target->size -= 1;
-                                }
-                                ht_traverse(&table, &_network_traverse);
-                            } else {
-                                debug_output("Message published to channel [%s] relayed to device [%x]!\n", channel, channel_target->nodes[i].node_id);
-                            }
-                        }
-                    }
-                    break;
-                default:
-                    // Message is a "Subscribe" message
-                    debug_output("Subscribe message received!\n");
-
-                    mode = (message.source_id & 0x7FFF) >> 15; // Subscribe = 0, unsubscribe = 1
-                    message.source_id &= 0x7FFF; // Ignore MSB of source_id field
-
-                    if ((rval = ht_search(&table, &search, channel)) == HT_DNE) {
-                        // Channel doesn't yet exist in table
-                        if (!mode) {
-                            // Subscribe
-                            channel_target = calloc(1, sizeof(channel_t));
-                            channel_target->size = 1;
-
-                            channel_target->nodes = calloc(1, sizeof(node_t));
-
-                            channel_target->nodes[0].addr = calloc(1, sizeof(struct sockaddr_in));
-                            *(channel_target->nodes[0].addr) = client_addr;
-                            channel_target->nodes[0].sock = handle;
-                            channel_target->nodes[0].node_id = message.source_id;
-
-                            ht_insert(&table, channel, channel_target);
-                            free(channel_target);
-
-                            debug_output("Channel [%s] created and device [%x] subscribed!\n", channel, message.source_id);
-                            ht_traverse(&table, &_network_traverse);
-                        } else {
-                            // Unsubscribe
-                            debug_output("Device [%x] cannot unsubscribe from channel [%s], channel does not exist!\n", message.source_id, channel);
-                        }
-                    } else if (rval == SUCCESS) {
-                        // Channel exists in table
-                        if(!mode) {
-                            // Subscribe
-                            channel_target = (channel_t *) search.value;
-                            found = 0;
-
-                            // If device already exists, update address
-                            for (int i = 0; i < channel_target->size; ++i) {
-                                if (channel_target->nodes[i].node_id == message.source_id) {
-                                    found = 1;
-
-                                    *(channel_target->nodes[i].addr) = client_addr;
-                                    channel_target->nodes[i].sock = handle;
-
-                                    debug_output("Device [%x] subscription to channel [%s] updated!\n", message.source_id, channel);
-                                    ht_traverse(&table, &_network_traverse);
-                                    break;
-                                }
-                            }
-
-                            if (!found) {
-                                // Device does not yet exist in array of subscribers
-                                channel_target->nodes = realloc(channel_target->nodes, (channel_target->size + 1) * sizeof(node_t));
-
-                                channel_target->nodes[channel_target->size].addr = calloc(1, sizeof(struct sockaddr_in));
-                                *(channel_target->nodes[channel_target->size].addr) = client_addr;
-                                channel_target->nodes[channel_target->size].sock = handle;
-                                channel_target->nodes[channel_target->size].node_id = message.source_id;
-
-                                channel_target->size += 1;
-
-                                debug_output("Device [%x] subscribed to channel [%s]!\n", message.source_id, channel);
-                                ht_traverse(&table, &_network_traverse);
-                            }
-                        } else {
-                            // Unsubscribe
-                            channel_target = (channel_t *) search.value;
-
-                            // Find index of subscribed device and remove it from array
-                            for (int i = 0; i < channel_target->size; ++i) {
-                                if (channel_target->nodes[i].node_id == message.source_id) {
-                                    if (channel_target->size == 1) {
-                                        // Device is the only subscribed device
-                                        free(channel_target->nodes[0].addr);
-                                        free(channel_target->nodes);
-                                        ht_remove(&table, channel);
-
-                                        debug_output("Channel [%s] has no subscribers. Removed!\n", channel);
-                                    } else {
-                                        // Device is not the only subscribed device
-                                        // Free Node elements
-                                        free(channel_target->nodes[i].addr);
-
-                                        // Patch array
-                                        for (int j = i; j < channel_target->size - 1; ++j) {
-                                            channel_target->nodes[i] = channel_target->nodes[i + 1];
-                                        }
-
-                                        // Free element
-                                        channel_target->nodes = realloc(channel_target->nodes, (channel_target->size - 1) * sizeof(node_t));
-                                        channel_target->size -= 1;
-                                    }
-                                    break;
-                                }
-                            }
-                            debug_output("Device [%x] unsubscribed to channel [%s]!\n", message.source_id, channel);
-                        }
-                    } else {
-                        debug_output("An unknown error occurred when handling Subscription message: [%d]!\n", rval);
-                        break;
+static channel_t * _channel_lookup(router_t * router, uint32_t id) {
+    // Caller holds the router lock
+    if (id > 0 && id <= router->channel_count) {
+        return router->channels[id];
+    }
+    return NULL;
+}
+
+static channel_t * _channel_intern(router_t * router, char * channel) {
+    channel_t * channel_target;
+    channel_t ** channels;
+    uint32_t capacity;
+
+    // Caller holds the router lock for writing
+    if ((channel_target = _channel_find(router, channel))) {
+        return channel_target;
+    }
+
+    // Channels are kept for the life of the Core, so an ID never changes meaning
+    if (router->channel_count + 1 >= router->channel_capacity) {
+        capacity = router->channel_capacity ? router->channel_capacity * 2 : TABLE_SIZE;
+        channels = router->channels;
+        if (buffer_resize(&router->lists, (void **) &channels, capacity * sizeof(channel_t *)) != SUCCESS) {
+            return NULL;
+        }
+        router->channels = channels;
+        router->channel_capacity = capacity;
+    }
+
+    if (pool_alloc(&router->channel_pool, (void **) &channel_target) != SUCCESS) {
+        return NULL;
+    }
+    memset(channel_target, 0, sizeof(channel_t));
+    pthread_mutex_init(&channel_target->lock, NULL);
+    channel_target->id = router->channel_count + 1;
+
+    // Names may be read in place from a log record, so nothing past the terminator is touched
+    strncpy(channel_target->name, channel, sizeof(channel_target->name) - 1);
+
+    if (_channel_insert(router, channel_target->name, &channel_target->id) != SUCCESS) {
+        pthread_mutex_destroy(&channel_target->lock);
+        pool_free(&router->channel_pool, channel_target);
+        return NULL;
+    }
+    router->channels[channel_target->id] = channel_target;
+    router->channel_count += 1;
+
+    debug_output("Channel [%s] interned as [%u]!\n", channel_target->name, channel_target->id);
+    return channel_target;
+}
+
+static void _router_stats(router_t * router, core_stats_t * stats) {
+    pool_stats(&router->frames, &stats->frames);
+    buffer_pool_stats(&router->buffers, &stats->buffers);
+    buffer_pool_stats(&router->payloads, &stats->payloads);
+    pool_stats(&router->channel_pool, &stats->channels);
+    pool_stats(&router->connection_pool, &stats->connections);
+    buffer_pool_stats(&router->lists, &stats->lists);
+}
+
+static void _router_report(router_t * router) {
+    core_stats_t stats;
+
+    // Steady-state routing is allocation-free while no pool takes another slab from the system
+    _router_stats(router, &stats);
+
+    debug_output("Pool slabs: frames [%zu], buffers [%zu], payloads [%zu], channels [%zu], connections [%zu], lists [%zu]\n",
+                 stats.frames.slabs, stats.buffers.slabs, stats.payloads.slabs, stats.channels.slabs, stats.connections.slabs, stats.lists.slabs);
+    debug_output("Pool objects in use: frames [%zu/%zu], buffers [%zu/%zu], payloads [%zu], channels [%zu], connections [%zu], lists [%zu]\n",
+                 stats.frames.in_use, stats.frames.peak, stats.buffers.in_use, stats.buffers.peak, stats.payloads.in_use,
+                 stats.channels.in_use, stats.connections.in_use, stats.lists.in_use);
+}
+
+static void _connection_watch(connection_t * connection) {
+    struct epoll_event event;
+
+    // Only ask for writability while queued output is waiting on a full socket, or a replay on room to page into
+    event.events = EPOLLIN | EPOLLRDHUP | ((connection->writing || connection->backlog_count) ? EPOLLOUT : 0);
+    event.data.ptr = connection;
+    epoll_ctl(connection->epoll_fd, EPOLL_CTL_MOD, connection->sock, &event);
+}
+
+static int _connection_family(connection_t * connection) {
+    // Family of the connection's frames in the frame caches: hashed up to the first zero byte, hashed whole, or sealed
+    if (connection->protocol >= PROTOCOL_SEALED) {
+        return 2;
+    }
+    return (connection->protocol >= PROTOCOL_HASHED) ? 1 : 0;
+}
+
+static const crypto_session_t * _connection_session(shard_t * shard, connection_t * connection) {
+    // Frames are hashed whole or sealed only once agreed; the negotiation itself is hashed as earlier builds hash it
+    if (connection->protocol >= PROTOCOL_SEALED) {
+        return &shard->sealed;
+    }
+    return (connection->protocol >= PROTOCOL_HASHED) ? &shard->hashed : &shard->session;
+}
+
+static const crypto_session_t * _connection_opener(shard_t * shard, connection_t * connection) {
+    // Sealed frames from the Node are keyed with its own salt; the shard's session only seals
+    if (connection->protocol >= PROTOCOL_SEALED) {
+        return &connection->sealed;
+    }
+    return _connection_session(shard, connection);
+}
+
+static frame_t * _frame_alloc(router_t * router, int size) {
+    frame_t * frame;
+
+    if (pool_alloc(&router->frames, (void **) &frame) != SUCCESS) {
+        return NULL;
+    }
+
+    // Messages too large for the frame's own storage take a pooled buffer
+    frame->buffers = NULL;
+    frame->data = frame->storage;
+    if (MESSAGE_PREFIX + size > (int) sizeof(frame->storage)) {
+        if (buffer_alloc(&router->buffers, MESSAGE_PREFIX + size, (void **) &frame->data) != SUCCESS) {
+            pool_free(&router->frames, frame);
+            return NULL;
+        }
+        frame->buffers = &router->buffers;
+    }
+
+    // The only copy of the message; subscriber queues share it by reference
+    frame->references = 1;
+    frame->pool = &router->frames;
+    frame->size = size;
+    _length_join(frame->data, size);
+
+    return frame;
+}
+
+static frame_t * _frame_create(router_t * router, char * first, char * second) {
+    frame_t * frame;
+
+    if ((frame = _frame_alloc(router, second ? 2 * MESSAGE_LENGTH : MESSAGE_LENGTH)) == NULL) {
+        return NULL;
+    }
+
+    memcpy(frame->data + MESSAGE_PREFIX, first, MESSAGE_LENGTH);
+    if (second) {
+        memcpy(frame->data + MESSAGE_PREFIX + MESSAGE_LENGTH, second, MESSAGE_LENGTH);
+    }
+
+    return frame;
+}
+
+static frame_t * _frame_large(shard_t * shard, const crypto_session_t * session, int version, channel_t * channel_target, char * payload, uint32_t sequence) {
+    router_t * router = shard->router;
+    message_t message;
+    frame_t * frame = NULL;
+    char * joined;
+    size_t size = channel_target->id ? 8 + strlen(payload) : 1 + strlen(channel_target->name) + strlen(payload);
+
+    // Carried as by PROTOCOL_SEQUENCED; only channels that can be announced have a usable ID, the others go as combined
+    if (4 + strlen(channel_target->name) >= sizeof(message.payload)
+    ||  message_variable_size(size) - MESSAGE_PREFIX > MESSAGE_LIMIT
+    ||  buffer_alloc(&router->buffers, size + 1, (void **) &joined) != SUCCESS) {
+        return NULL;
+    }
+
+    message_initialize(&message);
+    if (channel_target->id) {
+        message.source_id = FRAME_PUBLISH | FRAME_INTERNED | FRAME_SEQUENCE;
+        _interned_join(joined, channel_target->id, "");
+        _interned_join(joined + 4, sequence, payload);
+    } else {
+        message.source_id = FRAME_PUBLISH;
+        _combined_join(joined, channel_target->name, payload);
+    }
+
+    if (version == PROTOCOL_VARIABLE) {
+        // One frame as long as the message
+        if ((frame = _frame_alloc(router, message_variable_size(size) - MESSAGE_PREFIX))) {
+            message_pack_variable_session(&message, joined, size, frame->data, session);
+        }
+    } else if ((frame = _frame_alloc(router, _fragment_count(size) * MESSAGE_LENGTH))) {
+        // Fixed frames, the message continuing from one to the next
+        _fragment_pack(frame->data + MESSAGE_PREFIX, &message, joined, size, session);
+    }
+
+    buffer_free(&router->buffers, joined);
+    return frame;
+}
+
+static frame_t * _frame_build(shard_t * shard, const crypto_session_t * session, int version, channel_t * channel_target, char * payload, uint32_t sequence) {
+    message_t designation;
+    message_t message;
+
+    message_initialize(&message);
+    message.bytes_remaining = strlen(payload);
+
+    switch (version) {
+    case PROTOCOL_VARIABLE:
+    case PROTOCOL_FRAGMENTED:
+        // Messages that fit one frame share the PROTOCOL_SEQUENCED one; see _frame_select()
+        return _frame_large(shard, session, version, channel_target, payload, sequence);
+    case PROTOCOL_SEQUENCED:
+        // As interned, with the channel sequence number ahead of the payload
+        if (8 + strlen(payload) >= sizeof(message.payload) || 4 + strlen(channel_target->name) >= sizeof(message.payload)) {
+            return NULL;
+        }
+        message.source_id = FRAME_PUBLISH | FRAME_INTERNED | FRAME_SEQUENCE;
+        _interned_join(message.payload, channel_target->id, "");
+        _interned_join(message.payload + 4, sequence, payload);
+        break;
+    case PROTOCOL_INTERNED:
+        // Channel ID and payload in one frame; only channels that can be announced have a usable ID
+        if (4 + strlen(payload) >= sizeof(message.payload) || 4 + strlen(channel_target->name) >= sizeof(message.payload)) {
+            return NULL;
+        }
+        message.source_id = FRAME_PUBLISH | FRAME_INTERNED;
+        _interned_join(message.payload, channel_target->id, payload);
+        break;
+    case PROTOCOL_COMBINED:
+        // Channel and payload in one frame, when both fit
+        if (1 + strlen(channel_target->name) + strlen(payload) >= sizeof(message.payload)) {
+            return NULL;
+        }
+        message.source_id = FRAME_PUBLISH;
+        _combined_join(message.payload, channel_target->name, payload);
+        break;
+    default:
+        // Separate channel and payload frames, as sent by publish() without negotiation
+        if (strlen(payload) >= sizeof(message.payload)) {
+            return NULL;
+        }
+        message_initialize(&designation);
+        designation.bytes_remaining = strlen(channel_target->name);
+        strcpy(designation.payload, channel_target->name);
+        message_pack_session(&designation, session);
+
+        strcpy(message.payload, payload);
+        message_pack_session(&message, session);
+
+        return _frame_create(shard->router, designation.message_string, message.message_string);
+    }
+
+    message_pack_session(&message, session);
+    return _frame_create(shard->router, message.message_string, NULL);
+}
+
+static void _frame_retain(frame_t * frame) {
+    __atomic_add_fetch(&frame->references, 1, __ATOMIC_RELAXED);
+}
+
+static void _frame_release(frame_t * frame) {
+    // Queues on different shards release independently; the last one returns the frame
+    if (__atomic_sub_fetch(&frame->references, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (frame->buffers) {
+            buffer_free(frame->buffers, frame->data);
+        }
+        pool_free(frame->pool, frame);
+    }
+}
+
+static outbound_t * _connection_slot(connection_t * connection, int index) {
+    return &(connection->output[(connection->output_head + index) % connection->output_capacity]);
+}
+
+static int _connection_start(connection_t * connection) {
+    // Connections with fixed frames are sent the frames alone, without their length
+    return (connection->protocol >= PROTOCOL_VARIABLE) ? 0 : MESSAGE_PREFIX;
+}
+
+static int _outbound_size(outbound_t * slot) {
+    return MESSAGE_PREFIX + slot->frame->size - slot->start;
+}
+
+static int _connection_grow(router_t * router, connection_t * connection, int limit) {
+    outbound_t * output;
+    int capacity = connection->output_capacity ? connection->output_capacity * 2 : OUTPUT_INITIAL;
+
+    if (capacity > limit) {
+        capacity = limit;
+    }
+    if (capacity <= connection->output_capacity) {
+        return 1;
+    }
+
+    // Unroll the ring into the new array so the head is at index 0
+    if (buffer_alloc(&router->lists, capacity * sizeof(outbound_t), (void **) &output) != SUCCESS) {
+        return 1;
+    }
+    for (int i = 0; i < connection->output_count; ++i) {
+        output[i] = *_connection_slot(connection, i);
+    }
+    if (connection->output) {
+        buffer_free(&router->lists, connection->output);
+    }
+
+    connection->output = output;
+    connection->output_capacity = capacity;
+    connection->output_head = 0;
+    return 0;
+}
+
+static int _connection_flush(connection_t * connection) {
+    struct iovec iov[OUTPUT_IOV];
+    outbound_t * slot;
+    ssize_t bytes;
+    int count;
+
+    // Caller holds the connection lock
+    while (connection->output_count) {
+        // Gather as many queued messages as one writev() accepts
+        count = (connection->output_count < OUTPUT_IOV) ? connection->output_count : OUTPUT_IOV;
+        for (int i = 0; i < count; ++i) {
+            slot = _connection_slot(connection, i);
+            iov[i].iov_base = slot->frame->data + slot->start + (i ? 0 : connection->output_offset);
+            iov[i].iov_len = _outbound_size(slot) - (i ? 0 : connection->output_offset);
+        }
+
+        if ((bytes = writev(connection->sock, iov, count)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            debug_output("Failed to write to connection, rval: [%d][%d]!\n", (int) bytes, errno);
+            return -1;
+        }
+
+        // Retire every fully written message; remember how far into the next one the socket got
+        bytes += connection->output_offset;
+        while (connection->output_count && bytes >= _outbound_size(slot = _connection_slot(connection, 0))) {
+            bytes -= _outbound_size(slot);
+            _frame_release(slot->frame);
+            connection->output_head = (connection->output_head + 1) % connection->output_capacity;
+            connection->output_count -= 1;
+        }
+        connection->output_offset = (int) bytes;
+    }
+    return 0;
+}
+
+static void _connection_kick(connection_t * connection) {
+    int rval;
+
+    // Caller holds the connection lock; write immediately unless the socket is already known to be full
+    if (!connection->writing && !connection->closing && connection->output_count) {
+        if ((rval = _connection_flush(connection)) > 0) {
+            connection->writing = 1;
+            _connection_watch(connection);
+        } else if (rval < 0) {
+            connection->closing = 1;
+            shutdown(connection->sock, SHUT_RDWR);
+        }
+    }
+}
+
+static int _connection_send(router_t * router, connection_t * connection, const void * tag, frame_t * frame) {
+    outbound_t * slot = NULL;
+
+    pthread_mutex_lock(&connection->lock);
+
+    if (!connection->closing) {
+        if (connection->output_count < router->high_water
+        &&  (connection->output_count < connection->output_capacity || !_connection_grow(router, connection, router->high_water))) {
+            // Room below the high-water mark; append
+            slot = _connection_slot(connection, connection->output_count);
+            connection->output_count += 1;
+        } else {
+            // Slow consumer, or a queue that could not grow; handled alike
+            switch (router->overflow) {
+            case OVERFLOW_CONFLATE:
+                // Replace the newest unsent message of the same channel; untagged control frames are never replaced
+                for (int i = connection->output_count - 1; i >= (connection->output_offset ? 1 : 0) && !slot && tag; --i) {
+                    if (_connection_slot(connection, i)->tag == tag) {
+                        slot = _connection_slot(connection, i);
+                        _frame_release(slot->frame);
                     }
-                    break;
                 }
+
+                // Otherwise make room by discarding the oldest unsent message
+                if (!slot && connection->output_count && connection->output_offset == 0 && _connection_slot(connection, 0)->tag) {
+                    _frame_release(_connection_slot(connection, 0)->frame);
+                    connection->output_head = (connection->output_head + 1) % connection->output_capacity;
+                    slot = _connection_slot(connection, connection->output_count - 1);
+                }
+                connection->dropped += 1;
+                break;
+            case OVERFLOW_DISCONNECT:
+                // The owning shard closes the connection once it sees the shutdown
+                debug_output("Disconnecting slow consumer [%s]!\n", inet_ntoa(connection->addr.sin_addr));
+                connection->closing = 1;
+                shutdown(connection->sock, SHUT_RDWR);
+                break;
+            default:
+                connection->dropped += 1;
+                break;
+            }
+        }
+
+        if (slot) {
+            slot->tag = tag;
+            slot->frame = frame;
+            slot->start = _connection_start(connection);
+            _frame_retain(frame);
+            connection->delivered += 1;
+        }
+        _connection_kick(connection);
+    }
+
+    pthread_mutex_unlock(&connection->lock);
+    return (slot == NULL);
+}
+
+static int _connection_send_many(router_t * router, connection_t * connection, const void * tag, frame_t ** frames, int count) {
+    int needed;
+
+    pthread_mutex_lock(&connection->lock);
+
+    // A replay is queued whole, past the high-water mark if need be; it is bounded by the history size
+    needed = connection->output_count + count;
+    while (connection->output_capacity < needed) {
+        if (_connection_grow(router, connection, needed)) {
+            break;
+        }
+    }
+
+    if (!connection->closing && connection->output_capacity >= needed) {
+        for (int i = 0; i < count; ++i) {
+            _connection_slot(connection, connection->output_count)->tag = tag;
+            _connection_slot(connection, connection->output_count)->frame = frames[i];
+            _connection_slot(connection, connection->output_count)->start = _connection_start(connection);
+            _frame_retain(frames[i]);
+            connection->output_count += 1;
+        }
+        connection->delivered += count;
+        _connection_kick(connection);
+        count = 0;
+    }
+
+    pthread_mutex_unlock(&connection->lock);
+    return (count != 0);
+}
+
+static void _connection_release(router_t * router, connection_t * connection) {
+    // The last reference returns the connection; by then its owning shard has closed it and no relay can queue to it
+    if (__atomic_sub_fetch(&connection->references, 1, __ATOMIC_ACQ_REL) == 0) {
+        for (int i = 0; i < connection->output_count; ++i) {
+            _frame_release(_connection_slot(connection, i)->frame);
+        }
+        pthread_mutex_destroy(&connection->lock);
+        if (connection->output) {
+            buffer_free(&router->lists, connection->output);
+        }
+        if (connection->announced) {
+            buffer_free(&router->lists, connection->announced);
+        }
+        if (connection->subscriptions) {
+            buffer_free(&router->lists, connection->subscriptions);
+        }
+        if (connection->backlogs) {
+            buffer_free(&router->lists, connection->backlogs);
+        }
+        crypto_session_destruct(&connection->sealed);
+        pool_free(&router->connection_pool, connection);
+    }
+}
+
+static int _connection_announce(shard_t * shard, connection_t * connection, channel_t * channel_target, frame_t ** announcements) {
+    frame_t ** announcement = &announcements[_connection_family(connection)];
+    message_t message;
+    uint8_t * announced;
+    uint32_t size;
+    uint32_t byte = channel_target->id / 8;
+    uint8_t bit = 1 << (channel_target->id % 8);
+    int rval = 0;
+
+    // Caller holds the channel lock; publishes to other channels may mark the same bitmap meanwhile
+    pthread_mutex_lock(&connection->lock);
+    if (byte < connection->announced_size && (connection->announced[byte] & bit)) {
+        rval = -1;
+    } else if (byte >= connection->announced_size) {
+        size = (byte + 1) * 2;
+        announced = connection->announced;
+        if (buffer_resize(&shard->router->lists, (void **) &announced, size) != SUCCESS) {
+            rval = 1;
+        } else {
+            memset(announced + connection->announced_size, 0, size - connection->announced_size);
+            connection->announced = announced;
+            connection->announced_size = size;
+        }
+    }
+    pthread_mutex_unlock(&connection->lock);
+    if (rval) {
+        return (rval > 0);
+    }
+
+    // One announcement frame of each encoding is shared by every connection learning the channel in this publish
+    if (*announcement == NULL) {
+        message_initialize(&message);
+        message.bytes_remaining = strlen(channel_target->name);
+        message.source_id = FRAME_CHANNEL;
+        _interned_join(message.payload, channel_target->id, channel_target->name);
+        message_pack_session(&message, _connection_session(shard, connection));
+
+        if ((*announcement = _frame_create(shard->router, message.message_string, NULL)) == NULL) {
+            return 1;
+        }
+    }
+
+    // The Node only knows the ID once the announcement is actually queued
+    if (_connection_send(shard->router, connection, NULL, *announcement)) {
+        return 1;
+    }
+    pthread_mutex_lock(&connection->lock);
+    connection->announced[byte] |= bit;
+    pthread_mutex_unlock(&connection->lock);
+    return 0;
+}
+
+static frame_t * _frame_select(shard_t * shard, connection_t * connection, channel_t * channel_target, frame_t ** frames, char * payload, uint32_t sequence, frame_t ** announcement) {
+    const crypto_session_t * session = _connection_session(shard, connection);
+    frame_t * frame = NULL;
+    int family = _connection_family(connection);
+
+    // Connections hashing whole frames or sealing them take the variable encodings from slots of their own
+    frames += FRAME_ENCODINGS * family;
+
+    // Use the newest encoding the device understands that can carry the message
+    for (int version = family ? PROTOCOL_VARIABLE : connection->protocol; version >= PROTOCOL_LEGACY && !frame; --version) {
+        // Connections with variable frames take nothing spread across several frames
+        if (connection->protocol >= PROTOCOL_VARIABLE && (version == PROTOCOL_FRAGMENTED || version == PROTOCOL_LEGACY)) {
+            continue;
+        }
+        if (version >= PROTOCOL_INTERNED && !channel_target->id) {
+            // A channel without an ID cannot be announced, so it is named in every frame
+            if (version <= PROTOCOL_SEQUENCED) {
+                continue;
+            }
+        } else if (version >= PROTOCOL_INTERNED && _connection_announce(shard, connection, channel_target, announcement)) {
+            continue;
+        }
+
+        // Build each version once; every subscriber queue of the same version references the same frame
+        if (!frames[version] && version > PROTOCOL_SEQUENCED && channel_target->id && 8 + strnlen(payload, FRAGMENT_PAYLOAD) <= FRAGMENT_PAYLOAD) {
+            // Messages that fit one frame are carried alike from PROTOCOL_SEQUENCED on
+            if (!frames[PROTOCOL_SEQUENCED]) {
+                frames[PROTOCOL_SEQUENCED] = _frame_build(shard, session, PROTOCOL_SEQUENCED, channel_target, payload, sequence);
+            }
+            if ((frames[version] = frames[PROTOCOL_SEQUENCED])) {
+                _frame_retain(frames[version]);
+            }
+        } else if (!frames[version]) {
+            frames[version] = _frame_build(shard, session, version, channel_target, payload, sequence);
+        }
+        frame = frames[version];
+    }
+    return frame;
+}
+
+static void _channel_retain(router_t * router, relay_t * relay, char retain) {
+    channel_t * channel_target = relay->channel;
+    int version;
+
+    // Caller holds the channel lock; a retained publish replaces the previous one, an empty one only clears it
+    if (!retain) {
+        return;
+    }
+    for (version = PROTOCOL_LEGACY; version < FRAME_FORMATS; ++version) {
+        if (channel_target->replay[version]) {
+            _frame_release(channel_target->replay[version]);
+            channel_target->replay[version] = NULL;
+        }
+    }
+    if (channel_target->retained) {
+        buffer_free(&router->payloads, channel_target->retained);
+        channel_target->retained = NULL;
+    }
+
+    if (relay->payload[0] && buffer_alloc(&router->payloads, strlen(relay->payload) + 1, (void **) &channel_target->retained) == SUCCESS) {
+        strcpy(channel_target->retained, relay->payload);
+        channel_target->retained_sequence = relay->sequence;
+
+        // Keep the frames already built for subscribers; others are built on the first replay
+        for (version = PROTOCOL_LEGACY; version < FRAME_FORMATS; ++version) {
+            if ((channel_target->replay[version] = relay->frames[version])) {
+                _frame_retain(relay->frames[version]);
+            }
+        }
+        debug_output("Channel [%s] retained message [%s]!\n", channel_target->name, channel_target->retained);
+    }
+}
+
+static void _channel_replay(shard_t * shard, connection_t * connection, channel_t * channel_target) {
+    frame_t * announcement[FRAME_FAMILIES] = { NULL };
+    frame_t * frame;
+
+    // Caller holds the router and channel locks
+    if (!channel_target->retained) {
+        return;
+    }
+
+    // Only the newest message is kept, so it may be conflated with the next live one
+    if ((frame = _frame_select(shard, connection, channel_target, channel_target->replay, channel_target->retained, channel_target->retained_sequence, announcement))) {
+        _connection_send(shard->router, connection, (const void *) (uintptr_t) channel_target->id, frame);
+        debug_output("Retained message of channel [%s] replayed!\n", channel_target->name);
+    }
+    for (int i = 0; i < FRAME_FAMILIES; ++i) {
+        if (announcement[i]) {
+            _frame_release(announcement[i]);
+        }
+    }
+}
+
+static void _history_clear(router_t * router, history_t * entry) {
+    for (int version = PROTOCOL_LEGACY; version < FRAME_FORMATS; ++version) {
+        if (entry->frames[version]) {
+            _frame_release(entry->frames[version]);
+        }
+    }
+    buffer_free(&router->payloads, entry->payload);
+    memset(entry, 0, sizeof(history_t));
+}
+
+static void _channel_record(router_t * router, relay_t * relay) {
+    channel_t * channel_target = relay->channel;
+    history_t * entry;
+    size_t bytes = strlen(relay->payload);
+
+    // Caller holds the channel lock; the ring is only allocated for channels that are published to
+    if (router->history <= 0) {
+        return;
+    }
+    if (!channel_target->history) {
+        if (buffer_alloc(&router->lists, router->history * sizeof(history_t), (void **) &channel_target->history) != SUCCESS) {
+            return;
+        }
+        memset(channel_target->history, 0, router->history * sizeof(history_t));
+    }
+
+    // Evict the oldest publishes until the new one fits both bounds
+    while (channel_target->history_count && (channel_target->history_count == (uint32_t) router->history
+    ||     (router->history_bytes && channel_target->history_bytes + bytes > router->history_bytes))) {
+        entry = &channel_target->history[channel_target->history_head];
+        channel_target->history_bytes -= strlen(entry->payload);
+        _history_clear(router, entry);
+
+        channel_target->history_head = (channel_target->history_head + 1) % router->history;
+        channel_target->history_count -= 1;
+    }
+
+    entry = &channel_target->history[(channel_target->history_head + channel_target->history_count) % router->history];
+    if (buffer_alloc(&router->payloads, bytes + 1, (void **) &entry->payload) != SUCCESS) {
+        return;
+    }
+    memcpy(entry->payload, relay->payload, bytes + 1);
+    entry->sequence = relay->sequence;
+
+    // Keep the frames already built for live subscribers; others are built on the first replay
+    for (int version = PROTOCOL_LEGACY; version < FRAME_FORMATS; ++version) {
+        if ((entry->frames[version] = relay->frames[version])) {
+            _frame_retain(relay->frames[version]);
+        }
+    }
+    channel_target->history_count += 1;
+    channel_target->history_bytes += bytes;
+}
+
+static size_t _record_join(char * record, char flags, uint32_t sequence, char * channel, char * payload) {
+    size_t channel_size = strnlen(channel, 249);
+    size_t payload_size = strlen(payload);
+
+    // [flags][sequence][channel][payload], each string with its terminator so it can be read in place
+    record[0] = flags;
+    _interned_join(record + 1, sequence, "");
+    memcpy(record + 5, channel, channel_size);
+    record[5 + channel_size] = 0;
+    memcpy(record + 6 + channel_size, payload, payload_size);
+    record[6 + channel_size + payload_size] = 0;
+
+    return 7 + channel_size + payload_size;
+}
+
+static int _record_split(const char * record, size_t size, char * flags, uint32_t * sequence, const char ** channel, const char ** payload) {
+    const char * end = record + size;
+    char * text;
+
+    if (size < 7 || !memchr(record + 5, 0, size - 5)) {
+        return 1;
+    }
+    *flags = record[0];
+    *sequence = _interned_split((char *) record + 1, &text);
+    *channel = text;
+    *payload = *channel + strlen(*channel) + 1;
+
+    return (*payload >= end || !memchr(*payload, 0, end - *payload));
+}
+
+static void _channel_checkpoint(router_t * router, channel_t * channel_target, uint32_t sequence, uint64_t position) {
+    checkpoint_t * checkpoints = channel_target->checkpoints;
+    uint32_t retired = 0;
+    uint32_t capacity;
+    uint64_t start;
+
+    // Caller holds the channel lock; the index is sparse, so a replay reads at most CHECKPOINT_INTERVAL of the channel's records early
+    if (channel_target->checkpoint_count && sequence - checkpoints[channel_target->checkpoint_count - 1].sequence < CHECKPOINT_INTERVAL) {
+        return;
+    }
+
+    if (channel_target->checkpoint_count == channel_target->checkpoint_capacity) {
+        // Checkpoints into retired segments are dropped before the index grows
+        if (log_start(&router->log, &start) == SUCCESS) {
+            while (retired < channel_target->checkpoint_count && checkpoints[retired].position < start) {
+                ++retired;
+            }
+        }
+        if (retired) {
+            memmove(checkpoints, checkpoints + retired, (channel_target->checkpoint_count - retired) * sizeof(checkpoint_t));
+            channel_target->checkpoint_count -= retired;
+        }
+        if (channel_target->checkpoint_count == channel_target->checkpoint_capacity) {
+            capacity = channel_target->checkpoint_capacity ? channel_target->checkpoint_capacity * 2 : OUTPUT_INITIAL;
+            if (buffer_resize(&router->lists, (void **) &checkpoints, capacity * sizeof(checkpoint_t)) != SUCCESS) {
+                return;
+            }
+            channel_target->checkpoints = checkpoints;
+            channel_target->checkpoint_capacity = capacity;
+        }
+    }
+
+    checkpoints[channel_target->checkpoint_count].sequence = sequence;
+    checkpoints[channel_target->checkpoint_count].position = position;
+    channel_target->checkpoint_count += 1;
+}
+
+static uint64_t _channel_position(channel_t * channel_target, uint32_t from) {
+    uint32_t low = 0;
+    uint32_t high = channel_target->checkpoint_count;
+    uint32_t middle;
+
+    // Caller holds the channel lock; reading starts at the last checkpoint at or before the sequence, else at the oldest record
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if ((int32_t) (channel_target->checkpoints[middle].sequence - from) <= 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low ? channel_target->checkpoints[low - 1].position : 0;
+}
+
+static void _channel_persist(router_t * router, relay_t * relay, char retain) {
+    char * record;
+    uint64_t position;
+
+    // Caller holds the channel lock, so each channel's records reach the log in sequence order
+    if (buffer_alloc(&router->buffers, 7 + strlen(relay->channel->name) + strlen(relay->payload), (void **) &record) != SUCCESS
+    ||  log_append(&router->log, record, _record_join(record, retain ? RECORD_RETAIN : 0, relay->sequence, relay->channel->name, relay->payload), &position) != SUCCESS) {
+        debug_output("Could not log message of channel [%s]!\n", relay->channel->name);
+    } else {
+        _channel_checkpoint(router, relay->channel, relay->sequence, position);
+    }
+    if (record) {
+        buffer_free(&router->buffers, record);
+    }
+}
+
+static int _channel_recover(const char * record, size_t size, uint64_t position, void * _router) {
+    router_t * router = (router_t *) _router;
+    relay_t relay = { 0 };
+    const char * channel;
+    const char * payload;
+    char flags;
+
+    // Replaying the log restores sequence numbers, retained messages and history
+    if (_record_split(record, size, &flags, &relay.sequence, &channel, &payload) == 0
+    &&  (relay.channel = _channel_intern(router, (char *) channel))) {
+        relay.payload = (char *) payload;
+        relay.channel->sequence = relay.sequence;
+
+        _channel_retain(router, &relay, (flags & RECORD_RETAIN) != 0);
+        _channel_record(router, &relay);
+        _channel_checkpoint(router, relay.channel, relay.sequence, position);
+    }
+    return 0;
+}
+
+static int _replay_push(replay_t * replay, frame_t * frame) {
+    frame_t ** frames;
+    int capacity;
+
+    if (replay->count == replay->capacity) {
+        capacity = replay->capacity ? replay->capacity * 2 : OUTPUT_INITIAL;
+        frames = replay->frames;
+        if (buffer_resize(&replay->shard->router->lists, (void **) &frames, capacity * sizeof(frame_t *)) != SUCCESS) {
+            return 1;
+        }
+        replay->frames = frames;
+        replay->capacity = capacity;
+    }
+    replay->frames[replay->count++] = frame;
+    return 0;
+}
+
+static int _replay_visit(const char * record, size_t size, uint64_t position, void * _replay) {
+    replay_t * replay = (replay_t *) _replay;
+    frame_t * frames[FRAME_FORMATS] = { NULL };
+    frame_t * frame;
+    const char * channel;
+    const char * payload;
+    uint32_t sequence;
+    char flags;
+
+    // A page ends after its frames, or after reading its share of other channels' records
+    replay->scanned += 1;
+    replay->stopped = replay->limit && replay->scanned >= REPLAY_SCAN;
+
+    // Sequence numbers only grow, so their difference orders them even across wrap-around
+    if (_record_split(record, size, &flags, &sequence, &channel, &payload)
+    ||  strcmp(channel, replay->channel->name) != 0
+    ||  (int32_t) (sequence - replay->from) < 0
+    ||  (replay->bounded && (int32_t) (sequence - replay->until) >= 0)) {
+        return replay->stopped;
+    }
+    replay->next = sequence + 1;
+
+    // The payload is read straight from the mapped segment; only the selected frame is kept
+    if ((frame = _frame_select(replay->shard, replay->connection, replay->channel, frames, (char *) payload, sequence, replay->announcement))) {
+        _frame_retain(frame);
+    }
+    for (int version = PROTOCOL_LEGACY; version < FRAME_FORMATS; ++version) {
+        if (frames[version]) {
+            _frame_release(frames[version]);
+        }
+    }
+    if (frame && _replay_push(replay, frame)) {
+        _frame_release(frame);
+        return replay->stopped;
+    }
+    replay->stopped |= (replay->limit && replay->count >= replay->limit);
+    return replay->stopped;
+}
+
+static void _replay_ring(replay_t * replay) {
+    router_t * router = replay->shard->router;
+    channel_t * channel_target = replay->channel;
+    history_t * entry;
+    frame_t * frame;
+
+    // Caller holds the channel lock; ring frames are shared with the ring, so they are pushed after those owned
+    replay->owned = replay->count;
+    for (uint32_t i = 0; i < channel_target->history_count; ++i) {
+        entry = &channel_target->history[(channel_target->history_head + i) % router->history];
+
+        if ((int32_t) (entry->sequence - replay->from) >= 0
+        &&  (frame = _frame_select(replay->shard, replay->connection, channel_target, entry->frames, entry->payload, entry->sequence, replay->announcement))) {
+            _replay_push(replay, frame);
+        }
+    }
+}
+
+static void _replay_queue(replay_t * replay) {
+    router_t * router = replay->shard->router;
+
+    // Queued at once, ahead of any live relay; a replay is bounded by the history size or a page of the log
+    if (replay->count && _connection_send_many(router, replay->connection, (const void *) (uintptr_t) replay->channel->id, replay->frames, replay->count)) {
+        debug_output("Could not replay history of channel [%s]!\n", replay->channel->name);
+    } else {
+        debug_output("Replayed [%d] messages of channel [%s] from [%u]!\n", replay->count, replay->channel->name, replay->from);
+    }
+
+    for (int i = 0; i < replay->owned; ++i) {
+        _frame_release(replay->frames[i]);
+    }
+    if (replay->frames) {
+        buffer_free(&router->lists, replay->frames);
+    }
+    for (int i = 0; i < FRAME_FAMILIES; ++i) {
+        if (replay->announcement[i]) {
+            _frame_release(replay->announcement[i]);
+        }
+    }
+}
+
+static int _backlog_find(connection_t * connection, channel_t * channel_target) {
+    // Caller holds the connection lock
+    for (int i = 0; i < connection->backlog_count; ++i) {
+        if (connection->backlogs[i].channel == channel_target) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int _backlog_holds(connection_t * connection, channel_t * channel_target) {
+    int rval;
+
+    // Backlogs only open and close under their channel's lock, which the relay holds; most connections have none
+    if (!__atomic_load_n(&connection->backlog_count, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    pthread_mutex_lock(&connection->lock);
+    rval = (_backlog_find(connection, channel_target) >= 0);
+    pthread_mutex_unlock(&connection->lock);
+    return rval;
+}
+
+static int _backlog_open(router_t * router, connection_t * connection, channel_t * channel_target, uint32_t from) {
+    backlog_t * backlogs;
+    int capacity;
+    int rval = 0;
+
+    // Caller holds the channel lock; a replay of the channel already under way carries on instead
+    pthread_mutex_lock(&connection->lock);
+    if (_backlog_find(connection, channel_target) < 0) {
+        if (connection->backlog_count == connection->backlog_capacity) {
+            capacity = connection->backlog_capacity ? connection->backlog_capacity * 2 : OUTPUT_INITIAL;
+            backlogs = connection->backlogs;
+            if (buffer_resize(&router->lists, (void **) &backlogs, capacity * sizeof(backlog_t)) != SUCCESS) {
+                rval = 1;
+            } else {
+                connection->backlogs = backlogs;
+                connection->backlog_capacity = capacity;
+            }
+        }
+        if (!rval) {
+            connection->backlogs[connection->backlog_count].channel = channel_target;
+            connection->backlogs[connection->backlog_count].next = from;
+            connection->backlogs[connection->backlog_count].position = _channel_position(channel_target, from);
+            __atomic_store_n(&connection->backlog_count, connection->backlog_count + 1, __ATOMIC_RELAXED);
+
+            // The owning shard pages the log in as the socket takes it
+            if (!connection->closing) {
+                _connection_watch(connection);
+            }
+        }
+    }
+    pthread_mutex_unlock(&connection->lock);
+    return rval;
+}
+
+static void _backlog_remove(connection_t * connection, int index) {
+    // Caller holds the channel and connection locks; live relays of the channel reach the connection again from here on
+    memmove(&connection->backlogs[index], &connection->backlogs[index + 1], (connection->backlog_count - index - 1) * sizeof(backlog_t));
+    __atomic_store_n(&connection->backlog_count, connection->backlog_count - 1, __ATOMIC_RELAXED);
+    if (!connection->closing) {
+        _connection_watch(connection);
+    }
+}
+
+static void _backlog_finish(shard_t * shard, connection_t * connection) {
+    router_t * router = shard->router;
+    backlog_t * backlog = &connection->backlogs[0];
+    channel_t * channel_target = backlog->channel;
+    replay_t replay = { 0 };
+
+    replay.shard = shard;
+    replay.connection = connection;
+    replay.channel = channel_target;
+    replay.from = backlog->next;
+
+    // Nothing is published to the channel meanwhile; what the ring no longer holds is read from the log once durable
+    pthread_mutex_lock(&channel_target->lock);
+    if (channel_target->history_count) {
+        replay.until = channel_target->history[channel_target->history_head].sequence;
+        replay.bounded = 1;
+    }
+    if (!(replay.bounded && (int32_t) (replay.until - replay.from) <= 0) && (int32_t) (channel_target->sequence - replay.from) >= 0) {
+        log_flush(&router->log);
+        log_traverse(&router->log, &backlog->position, &_replay_visit, &replay);
+    }
+    _replay_ring(&replay);
+    _replay_queue(&replay);
+
+    pthread_mutex_lock(&connection->lock);
+    _backlog_remove(connection, 0);
+    pthread_mutex_unlock(&connection->lock);
+    pthread_mutex_unlock(&channel_target->lock);
+
+    debug_output("Replay of channel [%s] caught up!\n", channel_target->name);
+}
+
+static void _backlog_page(shard_t * shard, connection_t * connection) {
+    router_t * router = shard->router;
+    backlog_t * backlog = &connection->backlogs[0];
+    replay_t replay = { 0 };
+
+    // Only the owning shard changes the backlogs, so the oldest is read without the connection lock
+    replay.shard = shard;
+    replay.connection = connection;
+    replay.channel = backlog->channel;
+    replay.from = backlog->next;
+    replay.next = backlog->next;
+    replay.limit = (router->high_water / 2 < REPLAY_BATCH) ? router->high_water / 2 + 1 : REPLAY_BATCH;
+
+    // The log is read without the router or channel lock; publishes carry on and a later page reads them
+    log_traverse(&router->log, &backlog->position, &_replay_visit, &replay);
+    backlog->next = replay.next;
+    replay.owned = replay.count;
+    _replay_queue(&replay);
+
+    // A page reaching the durable end of the log leaves only what the channel lock holds back
+    if (!replay.stopped) {
+        _backlog_finish(shard, connection);
+    }
+}
+
+static void _channel_history(shard_t * shard, connection_t * connection, channel_t * channel_target, uint32_t from) {
+    router_t * router = shard->router;
+    replay_t replay = { 0 };
+
+    // Caller holds the router and channel locks
+    replay.shard = shard;
+    replay.connection = connection;
+    replay.channel = channel_target;
+    replay.from = from;
+
+    // Messages older than the ring still holds are paged in from the durable log, outside the locks
+    if (channel_target->history_count) {
+        replay.until = channel_target->history[channel_target->history_head].sequence;
+        replay.bounded = 1;
+    }
+    if (router->logging && !(replay.bounded && (int32_t) (replay.until - from) <= 0) && (int32_t) (channel_target->sequence - from) >= 0) {
+        if (_backlog_open(router, connection, channel_target, from)) {
+            debug_output("Could not replay history of channel [%s]!\n", channel_target->name);
+        } else {
+            debug_output("Replaying channel [%s] from [%u] out of the log!\n", channel_target->name, from);
+        }
+        return;
+    }
+
+    _replay_ring(&replay);
+    _replay_queue(&replay);
+}
+
+static channel_t * _pattern_find(router_t * router, char * pattern) {
+    void * value;
+
+    // Caller holds the router lock
+    if (trie_search(&router->patterns, pattern, &value) == SUCCESS) {
+        return (channel_t *) value;
+    }
+    return NULL;
+}
+
+static channel_t * _pattern_intern(router_t * router, char * pattern) {
+    channel_t * channel_target;
+
+    // Caller holds the router lock
+    if ((channel_target = _pattern_find(router, pattern))) {
+        return channel_target;
+    }
+
+    // Patterns are never relayed by name, so they take no channel ID
+    if (pool_alloc(&router->channel_pool, (void **) &channel_target) != SUCCESS) {
+        return NULL;
+    }
+    memset(channel_target, 0, sizeof(channel_t));
+    strncpy(channel_target->name, pattern, sizeof(channel_target->name) - 1);
+
+    if (trie_insert(&router->patterns, channel_target->name, channel_target) != SUCCESS) {
+        pool_free(&router->channel_pool, channel_target);
+        return NULL;
+    }
+
+    debug_output("Pattern [%s] created!\n", channel_target->name);
+    return channel_target;
+}
+
+static void _pattern_release(router_t * router, channel_t * channel_target) {
+    // Caller holds the router lock; unlike channels, patterns hold no ID and are removed once unused
+    trie_remove(&router->patterns, channel_target->name);
+    pool_free(&router->channel_pool, channel_target);
+}
+
+static int _membership_add(router_t * router, connection_t * connection, channel_t * channel_target, int index) {
+    membership_t * subscriptions = connection->subscriptions;
+    int capacity;
+
+    // Caller holds the router lock
+    if (connection->subscription_count == connection->subscription_capacity) {
+        capacity = connection->subscription_capacity ? connection->subscription_capacity * 2 : OUTPUT_INITIAL;
+        if (buffer_resize(&router->lists, (void **) &subscriptions, capacity * sizeof(membership_t)) != SUCCESS) {
+            return -1;
+        }
+        connection->subscriptions = subscriptions;
+        connection->subscription_capacity = capacity;
+    }
+    connection->subscriptions[connection->subscription_count].channel = channel_target;
+    connection->subscriptions[connection->subscription_count].index = index;
+    return connection->subscription_count++;
+}
+
+static void _membership_remove(connection_t * connection, int slot) {
+    membership_t * moved;
+
+    // Caller holds the router lock; the last listing takes the place of the one removed
+    connection->subscriptions[slot] = connection->subscriptions[--connection->subscription_count];
+    if (slot < connection->subscription_count) {
+        moved = &connection->subscriptions[slot];
+        moved->channel->nodes[moved->index].slot = slot;
+    }
+}
+
+static void _channel_join(router_t * router, channel_t * channel_target, connection_t * connection, int node_id) {
+    node_t * nodes;
+    int capacity;
+    int slot;
+
+    // Caller holds the router lock
+    connection->node_id = node_id;
+
+    // If device already exists, update its connection; the listing moves with it
+    for (int i = 0; i < channel_target->size; ++i) {
+        if (channel_target->nodes[i].connection == connection) {
+            return;
+        } else if (channel_target->nodes[i].connection->node_id == node_id) {
+            // An entry is only kept while its connection lists it, so it never outlives the connection
+            if ((slot = _membership_add(router, connection, channel_target, i)) < 0) {
+                return;
+            }
+            _membership_remove(channel_target->nodes[i].connection, channel_target->nodes[i].slot);
+            channel_target->nodes[i].connection = connection;
+            channel_target->nodes[i].slot = slot;
+
+            debug_output("Device [%x] subscription to channel [%s] updated!\n", node_id, channel_target->name);
+            _channel_traverse(router);
+            return;
+        }
+    }
+
+    // Device does not yet exist in array of subscribers; grow it by doubling
+    if (channel_target->size == channel_target->capacity) {
+        capacity = channel_target->capacity ? channel_target->capacity * 2 : OUTPUT_INITIAL;
+        nodes = channel_target->nodes;
+        if (buffer_resize(&router->lists, (void **) &nodes, capacity * sizeof(node_t)) != SUCCESS) {
+            debug_output("Device [%x] could not subscribe to channel [%s]!\n", node_id, channel_target->name);
+            return;
+        }
+        channel_target->nodes = nodes;
+        channel_target->capacity = capacity;
+    }
+
+    if ((slot = _membership_add(router, connection, channel_target, channel_target->size)) < 0) {
+        debug_output("Device [%x] could not subscribe to channel [%s]!\n", node_id, channel_target->name);
+        return;
+    }
+    channel_target->nodes[channel_target->size].connection = connection;
+    channel_target->nodes[channel_target->size].slot = slot;
+    channel_target->size += 1;
+
+    debug_output("Device [%x] subscribed to channel [%s]!\n", node_id, channel_target->name);
+    _channel_traverse(router);
+}
+
+static void _channel_leave(router_t * router, channel_t * channel_target, int index) {
+    node_t * moved;
+
+    // Caller holds the router lock; the device's connection stops listing the channel
+    _membership_remove(channel_target->nodes[index].connection, channel_target->nodes[index].slot);
+
+    // The last device takes the place of the one removed
+    channel_target->nodes[index] = channel_target->nodes[--channel_target->size];
+    if (index < channel_target->size) {
+        moved = &channel_target->nodes[index];
+        moved->connection->subscriptions[moved->slot].index = index;
+    }
+
+    if (channel_target->size == 0) {
+        // No subscribed devices are left; the channel keeps its ID
+        buffer_free(&router->lists, channel_target->nodes);
+        channel_target->nodes = NULL;
+        channel_target->capacity = 0;
+
+        debug_output("Channel [%s] has no subscribers!\n", channel_target->name);
+    }
+}
+
+static int _relay_target(relay_t * relay, connection_t * connection) {
+    shard_t * shard = relay->shard;
+    connection_t ** targets = shard->targets;
+    int capacity;
+
+    // Caller holds the router lock; the shard's array is reused by each of its publishes
+    if (relay->target_count == shard->target_capacity) {
+        capacity = shard->target_capacity ? shard->target_capacity * 2 : OUTPUT_INITIAL;
+        if (buffer_resize(&shard->router->lists, (void **) &targets, capacity * sizeof(connection_t *)) != SUCCESS) {
+            return 1;
+        }
+        shard->targets = targets;
+        shard->target_capacity = capacity;
+    }
+    relay->targets = shard->targets;
+
+    // Held so the connection outlives the lock; closing it only unregisters it
+    __atomic_add_fetch(&connection->references, 1, __ATOMIC_RELAXED);
+    relay->targets[relay->target_count++] = connection;
+    return 0;
+}
+
+static void _relay_gather(relay_t * relay, channel_t * channel_target) {
+    connection_t * connection;
+
+    // Caller holds the router lock; a closing connection drops its entries first, so every one is live
+    for (int i = 0; i < channel_target->size; ++i) {
+        connection = channel_target->nodes[i].connection;
+
+        // A connection still replaying the channel from the log gets the message from the replay, after the older ones
+        if (_backlog_holds(connection, relay->channel)) {
+            continue;
+        }
+        if (_relay_target(relay, connection)) {
+            debug_output("Could not relay message of channel [%s] to device [%x]!\n", relay->channel->name, connection->node_id);
+        }
+    }
+}
+
+static void _pattern_gather(void * value, void * relay) {
+    channel_t * channel_target = (channel_t *) value;
+
+    // Patterns left without subscribers are only removed on unsubscribe, never while matching
+    if (channel_target->size) {
+        _relay_gather((relay_t *) relay, channel_target);
+    }
+}
+
+static int _target_compare(const void * first, const void * second) {
+    uintptr_t a = (uintptr_t) *(connection_t * const *) first;
+    uintptr_t b = (uintptr_t) *(connection_t * const *) second;
+
+    return (a > b) - (a < b);
+}
+
+static void _relay_unique(relay_t * relay) {
+    int count = 0;
+
+    // A connection matching several subscriptions is sent the message once; the extra holds are dropped
+    qsort(relay->targets, relay->target_count, sizeof(connection_t *), &_target_compare);
+    for (int i = 0; i < relay->target_count; ++i) {
+        if (count && relay->targets[count - 1] == relay->targets[i]) {
+            _connection_release(relay->shard->router, relay->targets[i]);
+        } else {
+            relay->targets[count++] = relay->targets[i];
+        }
+    }
+    relay->target_count = count;
+}
+
+static void _channel_relay(relay_t * relay) {
+    shard_t * shard = relay->shard;
+    router_t * router = shard->router;
+    connection_t * connection;
+    frame_t * frame;
+
+    // Caller holds the channel lock, not the router lock; frames are packed and queued to the subscribers gathered
+    debug_output("Relaying message from channel [%s] to [%d] devices!\n", relay->channel->name, relay->target_count);
+
+    for (int i = 0; i < relay->target_count; ++i) {
+        connection = relay->targets[i];
+
+        // The message as received is relayed unchanged to devices of the publisher's version
+        if (relay->first && !relay->frames[relay->format]) {
+            relay->frames[relay->format] = _frame_create(router, relay->first, relay->second);
+        }
+        frame = _frame_select(shard, connection, relay->channel, relay->frames, relay->payload, relay->sequence, relay->announcement);
+
+        // Queue on the device connection; a full socket never blocks the publisher
+        if (frame) {
+            _connection_send(router, connection, (const void *) (uintptr_t) relay->channel->id, frame);
+        }
+        debug_output("Message published to channel [%s] relayed to device [%x]!\n", relay->channel->name, connection->node_id);
+    }
+}
+
+static void _core_publish(shard_t * shard, connection_t * publisher, char * channel, uint32_t id, char * payload, int format, char retain, char * first, char * second) {
+    router_t * router = shard->router;
+    relay_t relay = { 0 };
+    channel_t * channel_target;
+    channel_t transient;
+    int version;
+
+    // Publishes only read the routing state, so those of every shard look it up side by side
+    pthread_rwlock_rdlock(&router->lock);
+    publisher->published += 1;
+
+    // Find channel; it is only interned by a subscribe or to hold a retained or logged message, as IDs are never reclaimed.
+    // One nobody subscribed to may still match patterns, so it is relayed as a transient channel without an ID
+    if (id) {
+        channel_target = _channel_lookup(router, id);
+    } else if ((channel_target = _channel_find(router, channel)) == NULL && (retain || router->logging)) {
+        // Interning changes the tables; channels are never freed, so the one interned outlives the write lock
+        pthread_rwlock_unlock(&router->lock);
+        pthread_rwlock_wrlock(&router->lock);
+        channel_target = _channel_intern(router, channel);
+        pthread_rwlock_unlock(&router->lock);
+        pthread_rwlock_rdlock(&router->lock);
+    } else if (channel_target == NULL && router->patterns.count) {
+        memset(&transient, 0, sizeof(transient));
+        strncpy(transient.name, channel, sizeof(transient.name) - 1);
+        channel_target = &transient;
+    }
+
+    if (channel_target == NULL) {
+        // No devices are subscribed to the target channel
+        pthread_rwlock_unlock(&router->lock);
+        debug_output("No devices are subscribed to channel [%s][%u]!\n", channel, id);
+        return;
+    }
+
+    relay.shard = shard;
+    relay.channel = channel_target;
+    relay.payload = payload;
+    relay.format = format;
+    relay.first = first;
+    relay.second = second;
+
+    // The channel lock keeps its publishes in sequence order through the fan-out; a subscribe waits for it to replay
+    if (channel_target->id) {
+        pthread_mutex_lock(&channel_target->lock);
+    }
+
+    // Gather the devices subscribed to the channel itself and to every matching pattern, then let go of the router
+    _relay_gather(&relay, channel_target);
+    if (router->patterns.count) {
+        trie_match(&router->patterns, channel_target->name, &_pattern_gather, &relay);
+    }
+    if (router->patterns.count && relay.target_count > 1) {
+        _relay_unique(&relay);
+    }
+    pthread_rwlock_unlock(&router->lock);
+
+    relay.sequence = channel_target->id ? ++channel_target->sequence : 0;
+    _channel_relay(&relay);
+
+    if (channel_target->id) {
+        // The frame as received is kept even when nobody was subscribed yet
+        if (retain && first && !relay.frames[format]) {
+            relay.frames[format] = _frame_create(router, first, second);
+        }
+        _channel_retain(router, &relay, retain);
+        _channel_record(router, &relay);
+        if (router->logging) {
+            _channel_persist(router, &relay, retain);
+        }
+
+        // Let the publisher refer to the channel by ID from now on
+        if (format % FRAME_ENCODINGS < PROTOCOL_INTERNED && publisher->protocol >= PROTOCOL_INTERNED) {
+            _connection_announce(shard, publisher, channel_target, relay.announcement);
+        }
+        pthread_mutex_unlock(&channel_target->lock);
+    }
+
+    // Let go of the subscribers and drop the publisher's references; queued copies keep the frames alive
+    for (int i = 0; i < relay.target_count; ++i) {
+        _connection_release(router, relay.targets[i]);
+    }
+    for (version = PROTOCOL_LEGACY; version < FRAME_FORMATS; ++version) {
+        if (relay.frames[version]) {
+            _frame_release(relay.frames[version]);
+        }
+    }
+    for (int i = 0; i < FRAME_FAMILIES; ++i) {
+        if (relay.announcement[i]) {
+            _frame_release(relay.announcement[i]);
+        }
+    }
+}
+
+static void _core_subscribe(shard_t * shard, connection_t * connection, message_t * message, char * channel, uint32_t from) {
+    router_t * router = shard->router;
+    channel_t * channel_target;
+    int wildcard;
+    int index;
+    char replay;
+    char mode;
+
+    // Message is a "Subscribe" message
+    debug_output("Subscribe message received!\n");
+
+    mode = (message->source_id & 0x7FFF) >> 15; // Subscribe = 0, unsubscribe = 1
+    replay = (message->source_id & FRAME_REPLAY) != 0;
+    message->source_id &= 0x7FFF; // Ignore MSB of source_id field
+
+    // Channels holding wildcard levels are patterns, matched against each published channel
+    if ((wildcard = topic_wildcard(channel)) == TRIE_INVALID) {
+        debug_output("Device [%x] cannot subscribe to channel [%s], wildcards must be whole levels!\n", message->source_id, channel);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&router->lock);
+
+    if(!mode) {
+        // Subscribe; the channel is created on first use
+        if ((channel_target = wildcard ? _pattern_intern(router, channel) : _channel_intern(router, channel)) == NULL) {
+            debug_output("Could not create channel [%s]!\n", channel);
+        } else {
+            _channel_join(router, channel_target, connection, message->source_id);
+
+            // Deliver buffered history on request, otherwise the last retained message of every channel covered;
+            // a publish still fanning out finishes first, so its message is replayed rather than relayed
+            if (!wildcard) {
+                pthread_mutex_lock(&channel_target->lock);
+                if (replay) {
+                    _channel_history(shard, connection, channel_target, from);
+                } else {
+                    _channel_replay(shard, connection, channel_target);
+                }
+                pthread_mutex_unlock(&channel_target->lock);
+            } else {
+                for (uint32_t id = 1; id <= router->channel_count; ++id) {
+                    if (topic_match(channel, router->channels[id]->name)) {
+                        pthread_mutex_lock(&router->channels[id]->lock);
+                        _channel_replay(shard, connection, router->channels[id]);
+                        pthread_mutex_unlock(&router->channels[id]->lock);
+                    }
+                }
+            }
+        }
+    } else if ((channel_target = wildcard ? _pattern_find(router, channel) : _channel_find(router, channel)) == NULL) {
+        // Unsubscribe
+        debug_output("Device [%x] cannot unsubscribe from channel [%s], channel does not exist!\n", message->source_id, channel);
+    } else {
+        // Unsubscribe
+        // Find index of subscribed device and remove it from array
+        for (int i = 0; i < channel_target->size; ++i) {
+            if (channel_target->nodes[i].connection->node_id == (int) message->source_id) {
+                // A replay of the channel still reading the log stops with the subscription
+                if (!wildcard && channel_target->nodes[i].connection == connection) {
+                    pthread_mutex_lock(&channel_target->lock);
+                    pthread_mutex_lock(&connection->lock);
+                    if ((index = _backlog_find(connection, channel_target)) >= 0) {
+                        _backlog_remove(connection, index);
+                    }
+                    pthread_mutex_unlock(&connection->lock);
+                    pthread_mutex_unlock(&channel_target->lock);
+                }
+                _channel_leave(router, channel_target, i);
+                break;
+            }
+        }
+        if (wildcard && channel_target->size == 0) {
+            _pattern_release(router, channel_target);
+        }
+        debug_output("Device [%x] unsubscribed to channel [%s]!\n", message->source_id, channel);
+    }
+    pthread_rwlock_unlock(&router->lock);
+}
+
+static stream_t * _stream_find(router_t * router, uint32_t id) {
+    // Caller holds the streams lock
+    for (int i = 0; i < STREAM_LIMIT && id; ++i) {
+        if (router->streams[i].id == id) {
+            return &router->streams[i];
+        }
+    }
+    return NULL;
+}
+
+static void _stream_drop(stream_t * stream) {
+    // Let go of the subscribers the last frame was queued to
+    for (int i = 0; i < stream->target_count; ++i) {
+        _connection_release(stream->router, stream->targets[i]);
+    }
+    stream->target_count = 0;
+}
+
+static void _stream_forget(router_t * router, connection_t * connection) {
+    stream_t * stream;
+
+    // Caller holds the streams lock; a closed subscriber no longer holds any transfer back
+    for (int i = 0; i < STREAM_LIMIT; ++i) {
+        stream = &router->streams[i];
+        for (int j = 0; j < stream->target_count; ++j) {
+            if (stream->targets[j] == connection) {
+                stream->targets[j--] = stream->targets[--stream->target_count];
+                _connection_release(router, connection);
+            }
+        }
+    }
+}
+
+static void _stream_close(stream_t * stream) {
+    _stream_drop(stream);
+    if (stream->targets) {
+        buffer_free(&stream->router->lists, stream->targets);
+    }
+    memset(stream, 0, sizeof(*stream));
+}
+
+static void _stream_add(stream_t * stream, channel_t * channel_target) {
+    router_t * router = stream->router;
+    connection_t * connection;
+    connection_t ** targets = stream->targets;
+
+    // Only connections with variable frames take transfers; one matching several subscriptions is sent one copy
+    for (int i = 0; i < channel_target->size; ++i) {
+        connection = channel_target->nodes[i].connection;
+        if (connection->protocol < PROTOCOL_VARIABLE || connection->relayed == router->stamp) {
+            continue;
+        }
+        connection->relayed = router->stamp;
+
+        if (stream->target_count == stream->target_capacity) {
+            if (buffer_resize(&router->lists, (void **) &targets, (stream->target_capacity ? stream->target_capacity * 2 : OUTPUT_INITIAL) * sizeof(connection_t *)) != SUCCESS) {
+                return;
+            }
+            stream->targets = targets;
+            stream->target_capacity = stream->target_capacity ? stream->target_capacity * 2 : OUTPUT_INITIAL;
+        }
+
+        // Held until the next frame gathers them anew, so the congestion check never looks at a reused descriptor
+        __atomic_add_fetch(&connection->references, 1, __ATOMIC_RELAXED);
+        stream->targets[stream->target_count++] = connection;
+    }
+}
+
+static void _stream_pattern(void * value, void * stream) {
+    _stream_add((stream_t *) stream, (channel_t *) value);
+}
+
+static void _stream_relay(shard_t * shard, stream_t * stream, frame_t * received, char * payload, size_t size) {
+    router_t * router = stream->router;
+    channel_t * channel_target;
+    connection_t * connection;
+    frame_t * frames[2] = { NULL };
+    message_t message;
+    int sealed;
+
+    // Caller holds the streams lock and the router lock; subscribers are gathered anew for every frame, as they come and go
+    if (++router->stamp == 0) {
+        router->stamp = 1;
+    }
+    _stream_drop(stream);
+    if ((channel_target = _channel_find(router, stream->channel))) {
+        _stream_add(stream, channel_target);
+    }
+    if (router->patterns.count) {
+        trie_match(&router->patterns, stream->channel, &_stream_pattern, stream);
+    }
+
+    // Queued whatever the high-water mark; the sender's window bounds what a stream holds
+    frames[0] = received;
+    for (int i = 0; i < stream->target_count; ++i) {
+        connection = stream->targets[i];
+
+        // Subscribers of the sender's encoding are sent the frame as received; the other is built once, for the first that needs it
+        sealed = (connection->protocol >= PROTOCOL_SEALED);
+        if (!frames[sealed] && (frames[sealed] = _frame_alloc(router, message_variable_size(size) - MESSAGE_PREFIX))) {
+            message_initialize(&message);
+            message.source_id = FRAME_TRANSFER;
+            message_pack_variable_session(&message, payload, size, frames[sealed]->data, _connection_session(shard, connection));
+        }
+        if (frames[sealed]) {
+            _connection_send_many(router, connection, NULL, &frames[sealed], 1);
+        }
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        if (frames[i] && frames[i] != received) {
+            _frame_release(frames[i]);
+        }
+    }
+}
+
+static void _stream_answer(shard_t * shard, connection_t * connection, char kind, uint32_t id, uint32_t next) {
+    message_t message;
+    frame_t * frame;
+
+    message_initialize(&message);
+    message.bytes_remaining = 9;
+    message.source_id = FRAME_TRANSFER;
+    message.payload[0] = kind;
+    _word_join(message.payload + 1, id);
+    _word_join(message.payload + 5, next);
+    message_pack_session(&message, _connection_session(shard, connection));
+
+    // The sender stalls without its answers, so they are never dropped
+    if ((frame = _frame_create(shard->router, message.message_string, NULL))) {
+        _connection_send_many(shard->router, connection, NULL, &frame, 1);
+        _frame_release(frame);
+    }
+}
+
+static int _stream_congested(stream_t * stream) {
+    connection_t * connection;
+    int congested = 0;
+
+    // Caller holds the streams lock; the subscribers are held, and closed ones already forgotten
+    for (int i = 0; i < stream->target_count && !congested; ++i) {
+        connection = stream->targets[i];
+        pthread_mutex_lock(&connection->lock);
+        congested = !connection->closing && connection->output_count >= stream->router->high_water;
+        pthread_mutex_unlock(&connection->lock);
+    }
+    return congested;
+}
+
+static void _stream_settle(shard_t * shard) {
+    router_t * router = shard->router;
+    stream_t * stream;
+
+    // Caller holds the streams lock and the router lock; acknowledge every stream whose subscribers all have room again
+    router->stalled = 0;
+    for (int i = 0; i < STREAM_LIMIT; ++i) {
+        stream = &router->streams[i];
+        if (stream->id == 0 || stream->acknowledged == stream->next) {
+            continue;
+        }
+        if (_stream_congested(stream)) {
+            router->stalled += 1;
+            continue;
+        }
+
+        stream->acknowledged = stream->next;
+        if (stream->sender) {
+            _stream_answer(shard, stream->sender, TRANSFER_ACK, stream->id, stream->next);
+        }
+        if (stream->next == stream->chunks) {
+            debug_output("Transfer [%u] relayed to channel [%s]!\n", stream->id, stream->channel);
+            _stream_close(stream);
+        }
+    }
+}
+
+static void _stream_begin(shard_t * shard, connection_t * connection, char * payload, size_t capacity) {
+    router_t * router = shard->router;
+    stream_t * stream;
+    char channel[250] = { 0 };
+    uint32_t id = _word_split(payload + 1);
+    uint32_t chunks = _word_split(payload + 5);
+    uint32_t chunk_size = _word_split(payload + 9);
+    uint32_t size = _word_split(payload + 13);
+    size_t length;
+
+    // Caller holds the streams lock and the router lock
+    strncpy(channel, payload + TRANSFER_BEGIN_HEADER, (capacity - TRANSFER_BEGIN_HEADER < sizeof(channel) - 1) ? capacity - TRANSFER_BEGIN_HEADER : sizeof(channel) - 1);
+
+    if ((stream = _stream_find(router, id)) && stream->chunks == chunks) {
+        // Resumed, perhaps on a new connection; the sender goes on from the first chunk not yet relayed
+        debug_output("Transfer [%u] resumed from chunk [%u]!\n", id, stream->next);
+        stream->sender = connection;
+        stream->acknowledged = stream->next;
+        _stream_answer(shard, connection, TRANSFER_ACCEPT, stream->id, stream->next);
+        return;
+    }
+
+    if (channel[0] == 0 || topic_wildcard(channel) != 0 || chunk_size == 0 || chunk_size > MESSAGE_LIMIT / 2 || size == 0
+    ||  chunks != (uint32_t) (((uint64_t) size + chunk_size - 1) / chunk_size)) {
+        debug_output("Invalid transfer to channel [%s] refused!\n", channel);
+        _stream_answer(shard, connection, TRANSFER_ACCEPT, 0, 0);
+        return;
+    }
+
+    // Take a free slot, otherwise the oldest transfer whose sender is gone
+    stream = NULL;
+    for (int i = 0; i < STREAM_LIMIT; ++i) {
+        if (router->streams[i].id == 0) {
+            stream = &router->streams[i];
+            break;
+        } else if (router->streams[i].sender == NULL && (!stream || router->streams[i].id < stream->id)) {
+            stream = &router->streams[i];
+        }
+    }
+    if (stream == NULL) {
+        debug_output("Transfer to channel [%s] refused, [%d] transfers in progress!\n", channel, STREAM_LIMIT);
+        _stream_answer(shard, connection, TRANSFER_ACCEPT, 0, 0);
+        return;
+    }
+    _stream_close(stream);
+
+    // IDs are handed out by the Core, so chunks can be relayed unchanged to every subscriber
+    if (++router->transfers == 0) {
+        router->transfers = 1;
+    }
+    stream->id = router->transfers;
+    stream->router = router;
+    strncpy(stream->channel, channel, sizeof(stream->channel) - 1);
+    stream->sender = connection;
+    stream->chunks = chunks;
+
+    // Subscribers are told of the transfer under the Core's ID
+    _word_join(payload + 1, stream->id);
+    length = TRANSFER_BEGIN_HEADER + strlen(channel) + 1;
+    _stream_relay(shard, stream, NULL, payload, length);
+
+    debug_output("Transfer [%u] of [%u] bytes to channel [%s] begun!\n", stream->id, size, channel);
+    _stream_answer(shard, connection, TRANSFER_ACCEPT, stream->id, 0);
+}
+
+static void _core_transfer(shard_t * shard, connection_t * connection, char * payload, size_t capacity, frame_t * received) {
+    router_t * router = shard->router;
+    stream_t * stream;
+    uint32_t index;
+
+    // Every kind carries at least [kind][ID][word]
+    if (capacity < 9) {
+        return;
+    }
+
+    // Transfers are read-only routing, like publishes, but their own state is serialized
+    pthread_mutex_lock(&router->streams_lock);
+    pthread_rwlock_rdlock(&router->lock);
+
+    switch (payload[0]) {
+    case TRANSFER_BEGIN:
+        if (capacity > TRANSFER_BEGIN_HEADER) {
+            _stream_begin(shard, connection, payload, capacity);
+        }
+        break;
+    case TRANSFER_DATA:
+        index = _word_split(payload + 5);
+        if ((stream = _stream_find(router, _word_split(payload + 1))) == NULL || stream->sender != connection || received == NULL) {
+            debug_output("Chunk of unknown transfer [%u] dropped!\n", _word_split(payload + 1));
+        } else if (index != stream->next) {
+            // The sender resumes from the chunk the Core asks for, so anything else is out of order
+            debug_output("Chunk [%u] of transfer [%u] out of order, expected [%u]!\n", index, stream->id, stream->next);
+        } else {
+            // Subscribers are sent a hashed chunk as it was received; a sealed one is keyed to its sender, so it is sealed again
+            _stream_relay(shard, stream, (connection->protocol >= PROTOCOL_SEALED) ? NULL : received, payload, capacity - 1);
+            stream->next += 1;
+        }
+        break;
+    default:
+        debug_output("Unknown transfer frame [%d]!\n", payload[0]);
+        break;
+    }
+
+    // Acknowledge now, unless a subscriber is already behind; the sender's window then holds it back
+    _stream_settle(shard);
+
+    pthread_rwlock_unlock(&router->lock);
+    pthread_mutex_unlock(&router->streams_lock);
+}
+
+static void _core_hello(shard_t * shard, connection_t * connection, message_t * request) {
+    router_t * router = shard->router;
+    message_t message;
+    frame_t * frame;
+    int version = router->fixed_frames ? PROTOCOL_FRAGMENTED : PROTOCOL_VERSION;
+
+    // Settle on the highest protocol version both ends support
+    version = (request->bytes_remaining < version) ? request->bytes_remaining : version;
+    if (version < PROTOCOL_LEGACY) {
+        version = PROTOCOL_LEGACY;
+    }
+
+    // With nothing to replay, relays need no sequence numbers; later versions carry them regardless
+    if (version == PROTOCOL_SEQUENCED && router->history <= 0 && !router->logging) {
+        version = PROTOCOL_INTERNED;
+    }
+
+    // Frames are only sealed with a cipher to seal them with
+    if (version == PROTOCOL_SEALED && router->aead == CRYPTO_AEAD_NONE) {
+        version = PROTOCOL_HASHED;
+    }
+
+    // The Node's frames are opened with a key of their own, from the salt it offered after the channel
+    if (version == PROTOCOL_SEALED && crypto_session_seal(&connection->sealed, router->key, router->aead, NULL,
+                                                          (uint8_t *) request->payload + sizeof(PROTOCOL_CHANNEL) + 1) != SUCCESS) {
+        version = PROTOCOL_HASHED;
+    }
+    debug_output("Connection negotiated protocol version [%d]!\n", version);
+
+    // The cipher and the Core's salt follow the channel; the reply is encoded as the request was
+    message_initialize(&message);
+    message.bytes_remaining = version;
+    message.source_id = FRAME_HELLO;
+    strcpy(message.payload, PROTOCOL_CHANNEL);
+    message.payload[sizeof(PROTOCOL_CHANNEL)] = (char) router->aead;
+    if (version == PROTOCOL_SEALED) {
+        memcpy(message.payload + sizeof(PROTOCOL_CHANNEL) + 1, router->salt, AEAD_SALT);
+    }
+    message_pack_session(&message, _connection_session(shard, connection));
+
+    // Reply through the outbound queue so it stays ordered with relays; it is queued as a fixed frame whatever was agreed
+    if ((frame = _frame_create(router, message.message_string, NULL))) {
+        _connection_send(router, connection, NULL, frame);
+        _frame_release(frame);
+    }
+    connection->protocol = version;
+}
+
+static void _assembly_release(shard_t * shard, connection_t * connection) {
+    // Also abandons a pending publish
+    if (connection->assembly) {
+        buffer_free(&shard->router->buffers, connection->assembly);
+        connection->assembly = NULL;
+    }
+    connection->assembly_size = 0;
+    connection->assembly_expected = 0;
+    connection->state = CONNECTION_IDLE;
+}
+
+static void _core_assemble(shard_t * shard, connection_t * connection, message_t * message, uint32_t id, char * body) {
+    size_t size = strnlen(body, FRAGMENT_PAYLOAD);
+
+    // bytes_remaining sizes the buffer up front, unless it saturated; the fragments after the first are stray if it fails
+    if (buffer_alloc(&shard->router->buffers, size + (unsigned short) message->bytes_remaining + 1, (void **) &connection->assembly) != SUCCESS) {
+        debug_output("Could not reassemble fragmented publish!\n");
+        return;
+    }
+    memcpy(connection->assembly, body, size);
+    connection->assembly_size = size;
+    connection->assembly_id = id;
+    connection->assembly_retain = (message->source_id & FRAME_RETAIN) != 0;
+    connection->state = CONNECTION_FRAGMENT;
+}
+
+static void _core_fragment(shard_t * shard, connection_t * connection, message_t * message, char * payload) {
+    size_t length = strnlen(payload, FRAGMENT_PAYLOAD);
+    size_t needed = connection->assembly_size + length + (unsigned short) message->bytes_remaining + 1;
+
+    if (needed > MESSAGE_LIMIT || buffer_resize(&shard->router->buffers, (void **) &connection->assembly, needed) != SUCCESS) {
+        debug_output("Fragmented publish exceeds [%d] bytes!\n", MESSAGE_LIMIT);
+        _assembly_release(shard, connection);
+        return;
+    }
+    memcpy(connection->assembly + connection->assembly_size, payload, length);
+    connection->assembly_size += length;
+
+    // The last fragment has nothing after it
+    if (message->bytes_remaining == 0) {
+        connection->assembly[connection->assembly_size] = 0;
+        debug_output("Publishing reassembled message of [%zu] bytes to channel [%s][%u]!\n", connection->assembly_size, connection->channel, connection->assembly_id);
+
+        // Only single frames are relayed unchanged, so the message is built anew for every version
+        if (connection->assembly_id) {
+            _core_publish(shard, connection, NULL, connection->assembly_id, connection->assembly, PROTOCOL_INTERNED, connection->assembly_retain, NULL, NULL);
+        } else {
+            _core_publish(shard, connection, connection->channel, 0, connection->assembly, PROTOCOL_COMBINED, connection->assembly_retain, NULL, NULL);
+        }
+        _assembly_release(shard, connection);
+    }
+}
+
+static void _core_dispatch(shard_t * shard, connection_t * connection, message_t * message, int rval, char * frame, char * payload, size_t capacity, frame_t * received) {
+    uint32_t from = 0;
+    uint32_t id;
+    char * body;
+    int family = FRAME_ENCODINGS * _connection_family(connection);
+
+    if (rval != SUCCESS) {
+        debug_output("Message authentication failed!\n");
+
+        // A rejected frame also abandons the publish it continues
+        _assembly_release(shard, connection);
+        if (received) {
+            _frame_release(received);
+        }
+        return;
+    }
+
+    switch (connection->state) {
+    case CONNECTION_PAYLOAD:
+        // Frame completes the pending "Publish" message
+        connection->state = CONNECTION_IDLE;
+        debug_output("Publishing message [%s] to channel [%s]!\n", message->payload, connection->channel);
+
+        if (frame) {
+            _core_publish(shard, connection, connection->channel, 0, message->payload, PROTOCOL_LEGACY + family, (message->source_id & FRAME_RETAIN) != 0, connection->header, frame);
+        }
+        break;
+    case CONNECTION_FRAGMENT:
+        if (message->source_id == FRAME_FRAGMENT) {
+            // Frame continues the pending fragmented "Publish" message
+            _core_fragment(shard, connection, message, payload);
+            break;
+        }
+
+        // Anything else abandons the fragmented publish and is handled on its own
+        debug_output("Fragmented publish interrupted!\n");
+        _assembly_release(shard, connection);
+        /* fall through */
+    default:
+        if (message->source_id & FRAME_HELLO) {
+            _core_hello(shard, connection, message);
+            break;
+        } else if (message->source_id & FRAME_TRANSFER) {
+            // Message is part of a bulk transfer; binary, so bounded by the frame
+            _core_transfer(shard, connection, payload, capacity, received);
+            break;
+        } else if ((message->source_id & FRAME_PUBLISH) && (message->source_id & FRAME_INTERNED)) {
+            // Message is a "Publish" message naming the channel by its announced ID
+            id = _interned_split(payload, &body);
+            if (message->source_id & FRAME_FRAGMENT) {
+                _core_assemble(shard, connection, message, id, body);
+            } else {
+                debug_output("Publishing message [%s] to channel [%u]!\n", body, id);
+                _core_publish(shard, connection, NULL, id, body, PROTOCOL_INTERNED + family, (message->source_id & FRAME_RETAIN) != 0, frame, NULL);
+            }
+            break;
+        } else if (message->source_id & FRAME_PUBLISH) {
+            // Message is a combined "Publish" message; channel and payload share the frame
+            if (_combined_split(payload, connection->channel, &body)) {
+                debug_output("Invalid combined frame!\n");
+            } else if (message->source_id & FRAME_FRAGMENT) {
+                _core_assemble(shard, connection, message, 0, body);
+            } else {
+                debug_output("Publishing message [%s] to channel [%s]!\n", body, connection->channel);
+                _core_publish(shard, connection, connection->channel, 0, body, PROTOCOL_COMBINED + family, (message->source_id & FRAME_RETAIN) != 0, frame, NULL);
+            }
+            break;
+        } else if (message->source_id & FRAME_FRAGMENT) {
+            // Continues a publish that was already abandoned
+            break;
+        }
+
+        if (message->source_id & FRAME_REPLAY) {
+            // Subscription replaying history; the channel follows the sequence number
+            from = _interned_split(payload, &body);
+            strncpy(connection->channel, body, sizeof(connection->channel) - 5);
+            connection->channel[sizeof(connection->channel) - 5] = 0;
+        } else {
+            strncpy(connection->channel, payload, sizeof(connection->channel) - 1);
+            connection->channel[sizeof(connection->channel) - 1] = 0;
+        }
+
+        if (message->source_id == 0 && frame) {
+            // Message is a "Publish" message; hold the channel frame until its payload frame arrives
+            debug_output("Publish message received!\n");
+
+            memcpy(connection->header, frame, MESSAGE_LENGTH);
+            connection->state = CONNECTION_PAYLOAD;
+        } else if (message->source_id != 0) {
+            _core_subscribe(shard, connection, message, connection->channel, from);
+        }
+        break;
+    }
+
+    if (received) {
+        _frame_release(received);
+    }
+}
+
+static void _core_frame(shard_t * shard, connection_t * connection, char * frame, int size) {
+    const crypto_session_t * session = _connection_opener(shard, connection);
+    message_t message;
+    frame_t * received = NULL;
+    size_t capacity = sizeof(message.payload);
+    char * payload;
+    int rval;
+
+    // Generate message struct from message; a frame of MESSAGE_LENGTH stays encrypted for relaying
+    message_initialize(&message);
+    if (size == MESSAGE_LENGTH) {
+        memcpy(message.message_string, frame, MESSAGE_LENGTH);
+        rval = message_unpack_session(&message, session);
+        payload = message.payload;
+    } else {
+        // Transfer frames are relayed unchanged, so they are copied before longer frames are decrypted in place
+        if (message_peek_variable_session(&message, frame, size, session) == SUCCESS && (message.source_id & FRAME_TRANSFER)
+        &&  (received = _frame_alloc(shard->router, size))) {
+            memcpy(received->data + MESSAGE_PREFIX, frame, size);
+        }
+        rval = message_unpack_variable_session(&message, frame, size, &payload, session);
+        capacity = size - 6 - SHA256_DIGEST_LENGTH;
+        frame = NULL;
+    }
+    _core_dispatch(shard, connection, &message, rval, frame, payload, capacity, received);
+}
+
+static int _input_frame(connection_t * connection, int offset, int * prefix, int * size) {
+    uint32_t length;
+
+    // Returns 1 if a whole frame starts at offset, 0 if more must be read, -1 if its length is invalid
+    *prefix = 0;
+    *size = MESSAGE_LENGTH;
+    if (connection->protocol >= PROTOCOL_VARIABLE) {
+        // Every frame is preceded by its length
+        if (connection->input_size - offset < MESSAGE_PREFIX) {
+            return 0;
+        }
+        if ((length = _length_split(connection->input + offset)) > MESSAGE_LIMIT) {
+            debug_output("Frame of length [%u] exceeds the limit!\n", length);
+            return -1;
+        }
+        *prefix = MESSAGE_PREFIX;
+        *size = (int) length;
+    }
+    return connection->input_size - offset >= *prefix + *size;
+}
+
+static int _core_read(shard_t * shard, connection_t * connection) {
+    message_t messages[INPUT_FRAMES];
+    int status[INPUT_FRAMES];
+    char * frames[INPUT_FRAMES];
+    int ends[INPUT_FRAMES];
+    char * collected;
+    int protocol;
+    int complete;
+    int batched;
+    int bytes;
+    int offset;
+    int prefix;
+    int size;
+    int i;
+
+    // Read as much as the input buffer can hold; any partial frame is kept from the previous read
+    if (connection->assembly_expected) {
+        // A frame longer than the input buffer is read straight into its own
+        bytes = read(connection->sock, connection->assembly + connection->assembly_size, connection->assembly_expected - connection->assembly_size);
+    } else {
+        bytes = read(connection->sock, connection->input + connection->input_size, sizeof(connection->input) - connection->input_size);
+    }
+
+    if (bytes == 0) {
+        // Read 0 bytes; Node terminated connection
+        debug_output("Node terminated connection!\n");
+        return 1;
+    } else if (bytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+        debug_output("Failed to read from connection, rval: [%d][%d]!\n", bytes, errno);
+        return 1;
+    }
+
+    if (connection->assembly_expected) {
+        connection->assembly_size += bytes;
+        if (connection->assembly_size == connection->assembly_expected) {
+            // The buffer is taken back first; handling the frame may start a new collection
+            collected = connection->assembly;
+            size = (int) connection->assembly_expected;
+            connection->assembly = NULL;
+            _assembly_release(shard, connection);
+
+            _core_frame(shard, connection, collected, size);
+            buffer_free(&shard->router->buffers, collected);
+        }
+        return 0;
+    }
+    connection->input_size += bytes;
+
+    // Handle every complete frame now in the buffer; the version agreed may change from one frame to the next
+    offset = 0;
+    while (offset < connection->input_size) {
+        if ((complete = _input_frame(connection, offset, &prefix, &size)) < 0) {
+            return 1;
+        }
+
+        if (prefix + size > (int) sizeof(connection->input)) {
+            // Too long for the input buffer; collect it in a pooled one
+            if (buffer_alloc(&shard->router->buffers, size, (void **) &connection->assembly) != SUCCESS) {
+                debug_output("Could not collect frame of length [%d]!\n", size);
+                return 1;
+            }
+            connection->assembly_size = connection->input_size - offset - prefix;
+            connection->assembly_expected = size;
+            memcpy(connection->assembly, connection->input + offset + prefix, connection->assembly_size);
+
+            offset = connection->input_size;
+            break;
+        }
+        if (!complete) {
+            break;
+        }
+
+        if (size != MESSAGE_LENGTH) {
+            _core_frame(shard, connection, connection->input + offset + prefix, size);
+            offset += prefix + size;
+            continue;
+        }
+
+        // Fixed frames that follow one another are decrypted together, keeping the cipher's pipeline full
+        batched = 0;
+        do {
+            frames[batched] = connection->input + offset + prefix;
+            message_initialize(&messages[batched]);
+            memcpy(messages[batched].message_string, frames[batched], MESSAGE_LENGTH);
+            ends[batched] = (offset += prefix + size);
+        } while (++batched < INPUT_FRAMES && _input_frame(connection, offset, &prefix, &size) > 0 && size == MESSAGE_LENGTH);
+        message_unpack_many(messages, status, batched, _connection_opener(shard, connection));
+
+        // They were split under the version agreed so far; once that changes, the rest are split again
+        protocol = connection->protocol;
+        for (i = 0; i < batched && connection->protocol == protocol; ++i) {
+            _core_dispatch(shard, connection, &messages[i], status[i], frames[i], messages[i].payload, sizeof(messages[i].payload), NULL);
+            offset = ends[i];
+        }
+    }
+
+    // Move the trailing partial frame to the front of the buffer
+    if (offset) {
+        memmove(connection->input, connection->input + offset, connection->input_size - offset);
+        connection->input_size -= offset;
+    }
+    return 0;
+}
+
+static void _core_accept(shard_t * shard, int epoll_fd) {
+    router_t * router = shard->router;
+    connection_t * connection;
+    struct sockaddr_in client_addr;
+    socklen_t client_size;
+    struct epoll_event event;
+    int handle;
+
+    // Drain every pending connection on the non-blocking listener
+    while (1) {
+        client_size = sizeof(client_addr);
+        if ((handle = accept(shard->sock, (struct sockaddr *) &client_addr, &client_size)) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                debug_output("Failed to accept incoming connection!\n");
+            }
+            break;
+        }
+        fcntl(handle, F_SETFL, fcntl(handle, F_GETFL) | O_NONBLOCK);
+
+        if (handle >= router->capacity) {
+            debug_output("Connection limit reached, refusing connection!\n");
+            close(handle);
+            continue;
+        }
+
+        if (pool_alloc(&router->connection_pool, (void **) &connection) != SUCCESS) {
+            debug_output("Could not allocate new connection!\n");
+            close(handle);
+            continue;
+        }
+        memset(connection, 0, sizeof(connection_t));
+        connection->sock = handle;
+        connection->addr = client_addr;
+        connection->state = CONNECTION_IDLE;
+        connection->protocol = PROTOCOL_LEGACY;
+        connection->epoll_fd = epoll_fd;
+        connection->references = 1;
+        pthread_mutex_init(&connection->lock, NULL);
+
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.ptr = connection;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, handle, &event) < 0) {
+            debug_output("Could not register new connection!: [%d]\n", errno);
+            close(handle);
+            pthread_mutex_destroy(&connection->lock);
+            pool_free(&router->connection_pool, connection);
+        } else {
+            // Make the connection reachable for relays from every shard
+            pthread_rwlock_wrlock(&router->lock);
+            router->connections[handle] = connection;
+            pthread_rwlock_unlock(&router->lock);
+
+            debug_output("Acquired new connection!\n");
+        }
+    }
+}
+
+static int _core_write(shard_t * shard, connection_t * connection) {
+    router_t * router = shard->router;
+    char paging;
+    int rval;
+
+    pthread_mutex_lock(&connection->lock);
+
+    // Stop watching for writability once the queue drains
+    if ((rval = _connection_flush(connection)) == 0) {
+        connection->writing = 0;
+        _connection_watch(connection);
+    }
+
+    // A replay reading the log queues its next page once the queue is down to half the high-water mark
+    paging = (rval >= 0 && !connection->closing && connection->backlog_count && connection->output_count <= router->high_water / 2);
+    pthread_mutex_unlock(&connection->lock);
+
+    if (paging) {
+        _backlog_page(shard, connection);
+    }
+
+    // The connection may have been holding back a transfer; its sender goes on once every subscriber has room
+    if (rval >= 0 && __atomic_load_n(&router->stalled, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&router->streams_lock);
+        pthread_rwlock_rdlock(&router->lock);
+        _stream_settle(shard);
+        pthread_rwlock_unlock(&router->lock);
+        pthread_mutex_unlock(&router->streams_lock);
+    }
+    return (rval < 0);
+}
+
+static void _core_close(shard_t * shard, int epoll_fd, connection_t * connection) {
+    router_t * router = shard->router;
+    channel_t * channel_target;
+
+    pthread_mutex_lock(&router->streams_lock);
+    pthread_rwlock_wrlock(&router->lock);
+
+    // Drop its subscriber entries before the descriptor can be reused by a new connection; each removal unlists one
+    debug_output("Connection closed with [%d] subscriptions!\n", connection->subscription_count);
+    while (connection->subscription_count) {
+        channel_target = connection->subscriptions[connection->subscription_count - 1].channel;
+        _channel_leave(router, channel_target, connection->subscriptions[connection->subscription_count - 1].index);
+        if (channel_target->id == 0 && channel_target->size == 0) {
+            _pattern_release(router, channel_target);
+        }
+    }
+
+    // Once unregistered no relay can gather the connection; those that already did hold it until they are done
+    router->connections[connection->sock] = NULL;
+
+    // Transfers it was sending wait to be resumed; those it was holding back go on
+    for (int i = 0; i < STREAM_LIMIT; ++i) {
+        if (router->streams[i].sender == connection) {
+            router->streams[i].sender = NULL;
+        }
+    }
+    _stream_forget(router, connection);
+    if (router->stalled) {
+        _stream_settle(shard);
+    }
+    pthread_rwlock_unlock(&router->lock);
+    pthread_mutex_unlock(&router->streams_lock);
+
+    debug_output("Connection [%s] of device [%x] closed after [%u] publishes and [%u] deliveries!\n", inet_ntoa(connection->addr.sin_addr), connection->node_id, connection->published, connection->delivered);
+    if (connection->dropped) {
+        debug_output("Connection [%s] closed with [%d] messages dropped!\n", inet_ntoa(connection->addr.sin_addr), connection->dropped);
+    }
+
+    // Relays still holding it queue nothing more and never write to the descriptor, which may be reused once closed
+    pthread_mutex_lock(&connection->lock);
+    connection->closing = 1;
+    pthread_mutex_unlock(&connection->lock);
+    _assembly_release(shard, connection);
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->sock, NULL);
+    close(connection->sock);
+
+    // Messages still queued go with the last reference
+    _connection_release(router, connection);
+
+    _router_report(router);
+}
+
+static void * _core_reactor(void * _shard) {
+    shard_t * shard = (shard_t *) _shard;
+    connection_t * connection;
+    int epoll_fd;
+    int ready;
+    struct epoll_event event;
+    struct epoll_event events[MAX_EVENTS];
+
+    // Register the listening socket with a new epoll instance; its event carries no connection
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        debug_output("Could not create epoll instance!: [%d]\n", errno);
+        return NULL;
+    }
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, shard->sock, &event) < 0) {
+        debug_output("Could not register listening socket!: [%d]\n", errno);
+        close(epoll_fd);
+        return NULL;
+    }
+
+    // The wakeup descriptor is never read, so once signalled it stops every reactor
+    event.data.ptr = &shard->router->wakeup;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, shard->router->wakeup, &event);
+
+    debug_output("Core shard [%d] initialized, awaiting connections...\n", shard->id);
+
+    while (!__atomic_load_n(&shard->router->stopping, __ATOMIC_ACQUIRE)) {
+        debug_output("\n");
+
+        // Wait for incoming connections; only ready descriptors are returned
+        if ((ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1)) < 0) {
+            if (errno != EINTR) {
+                debug_output("Failed to wait for incoming IO!: [%d]\n", errno);
+            }
+            continue;
+        }
+        for (int e = 0; e < ready; ++e) {
+            connection = (connection_t *) events[e].data.ptr;
+
+            if (events[e].data.ptr == &shard->router->wakeup) {
+                break;
+            } else if (connection == NULL) {
+                // Incoming new connection
+                _core_accept(shard, epoll_fd);
+            } else if (events[e].events & EPOLLERR) {
+                debug_output("Node connection failed!\n");
+                _core_close(shard, epoll_fd, connection);
+            } else if ((events[e].events & EPOLLOUT) && _core_write(shard, connection)) {
+                _core_close(shard, epoll_fd, connection);
+            } else if ((events[e].events & ~EPOLLOUT) && _core_read(shard, connection)) {
+                _core_close(shard, epoll_fd, connection);
+            }
+        }
+    }
+    close(epoll_fd);
+    return NULL;
+}
+
+void core_config_default(core_config_t * config) {
+    if (config) {
+        config->shards = 1;
+        config->high_water = 64;
+        config->overflow = OVERFLOW_DROP;
+        config->load_factor = HT_LOAD_FACTOR;
+        config->table = TABLE_CHAINED;
+        config->history = 0;
+        config->history_bytes = 0;
+        config->log_directory[0] = 0;
+        config->log_segment = LOG_SEGMENT;
+        config->log_retain_bytes = 0;
+        config->log_retain_age = 0;
+        config->fixed_frames = 0;
+        config->aead = crypto_aead_preferred();
+    }
+}
+
+void core_config_load(core_config_t * config, const char * file) {
+    char overflow[16];
+    char table[16];
+    char frames[16];
+    char aead[32];
+
+    if (config && file) {
+        core_config_default(config);
+
+        config->shards = (int) ini_getl("general", "shards", config->shards, file);
+        config->high_water = (int) ini_getl("general", "high-water", config->high_water, file);
+        config->load_factor = ini_getf("general", "load-factor", config->load_factor, file);
+        config->history = (int) ini_getl("general", "history", config->history, file);
+        config->history_bytes = (int) ini_getl("general", "history-bytes", config->history_bytes, file);
+        ini_gets("general", "log-directory", "", config->log_directory, sizeof(config->log_directory), file);
+        config->log_segment = ini_getl("general", "log-segment", config->log_segment, file);
+        config->log_retain_bytes = ini_getl("general", "log-retain-bytes", config->log_retain_bytes, file);
+        config->log_retain_age = ini_getl("general", "log-retain-age", config->log_retain_age, file);
+
+        ini_gets("general", "overflow", "drop", overflow, sizeof(overflow), file);
+        if (strcmp(overflow, "conflate") == 0) {
+            config->overflow = OVERFLOW_CONFLATE;
+        } else if (strcmp(overflow, "disconnect") == 0) {
+            config->overflow = OVERFLOW_DISCONNECT;
+        } else {
+            config->overflow = OVERFLOW_DROP;
+        }
+
+        ini_gets("general", "table", "chained", table, sizeof(table), file);
+        config->table = (strcmp(table, "open") == 0) ? TABLE_OPEN : TABLE_CHAINED;
+
+        ini_gets("general", "frames", "variable", frames, sizeof(frames), file);
+        config->fixed_frames = (strcmp(frames, "fixed") == 0);
+
+        ini_gets("security", "aead", "auto", aead, sizeof(aead), file);
+        if (strcmp(aead, "aes-256-gcm") == 0) {
+            config->aead = CRYPTO_AES_256_GCM;
+        } else if (strcmp(aead, "chacha20-poly1305") == 0) {
+            config->aead = CRYPTO_CHACHA20_POLY1305;
+        } else if (strcmp(aead, "none") == 0) {
+            config->aead = CRYPTO_AEAD_NONE;
+        } else {
+            config->aead = crypto_aead_preferred();
+        }
+    }
+}
+
+int start_core_server(int port, char * key, char * iv) {
+    return start_core_server_sharded(port, key, iv, 1);
+}
+
+int start_core_server_sharded(int port, char * key, char * iv, int count) {
+    core_config_t config;
+
+    core_config_default(&config);
+    config.shards = count;
+
+    return start_core_server_config(port, key, iv, &config);
+}
+
+int start_core_server_config(int port, char * key, char * iv, core_config_t * config) {
+    router_t router;
+    shard_t * shards;
+    struct rlimit limit;
+    pthread_rwlockattr_t attributes;
+    int count;
+    int rval = 0;
+    int i;
+
+    if (!config) {
+        debug_output("<start_core_server_config> Invalid parameter(s)!\n");
+        return 1;
+    }
+
+    // Default to one reactor per online CPU
+    if ((count = config->shards) <= 0) {
+        count = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        count = (count > 0) ? count : 1;
+    }
+
+    // Ignore SIGPIPE signals
+    signal(SIGPIPE, SIG_IGN);
+
+    // Every Node holds one descriptor; raise the soft limit as far as allowed
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    debug_output("\n");
+
+    router.kind = config->table;
+    if (router.kind == TABLE_OPEN) {
+        ot_construct(&router.open, TABLE_SIZE, 250,      sizeof(uint32_t), &_hash_channel, &_compare_channel);
+        //           table         16          key size  value size        hash function   compare function
+        if (config->load_factor > 0) {
+            ot_load_factor(&router.open, config->load_factor);
+        }
+    } else {
+        ht_construct(&router.table, TABLE_SIZE, 250,       sizeof(uint32_t), &_hash_channel, &_compare_channel);
+        //           table          16          key size   value size        hash function   compare function
+        if (config->load_factor > 0) {
+            ht_load_factor(&router.table, config->load_factor);
+        }
+    }
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&router.lock, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+    pthread_mutex_init(&router.streams_lock, NULL);
+    pool_construct(&router.frames, sizeof(frame_t), FRAME_SLAB);
+    buffer_pool_construct(&router.buffers, BUFFER_SMALLEST, 2 * MESSAGE_LIMIT, BUFFER_SLAB);
+    buffer_pool_construct(&router.payloads, PAYLOAD_SMALLEST, MESSAGE_LIMIT + 1, BUFFER_SLAB);
+    pool_construct(&router.channel_pool, sizeof(channel_t), CHANNEL_SLAB);
+    pool_construct(&router.connection_pool, sizeof(connection_t), CONNECTION_SLAB);
+    buffer_pool_construct(&router.lists, LIST_SMALLEST, MAX_CONNECTIONS * sizeof(node_t), BUFFER_SLAB);
+    router.channels = NULL;
+    router.channel_count = 0;
+    router.channel_capacity = 0;
+    trie_construct(&router.patterns);
+    router.stamp = 0;
+
+    // Connections are looked up by descriptor, so size the lookup by the descriptor limit
+    router.capacity = (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < MAX_CONNECTIONS) ? (int) limit.rlim_cur : MAX_CONNECTIONS;
+    router.connections = calloc(router.capacity, sizeof(connection_t *));
+    router.high_water = (config->high_water > 0) ? config->high_water : 1;
+    router.overflow = config->overflow;
+    router.history = (config->history > 0) ? config->history : 0;
+    router.history_bytes = (config->history_bytes > 0) ? (size_t) config->history_bytes : 0;
+    router.fixed_frames = config->fixed_frames;
+    router.aead = config->aead;
+    router.key = key;
+    if (router.aead != CRYPTO_AEAD_NONE && crypto_random(router.salt, sizeof(router.salt)) != SUCCESS) {
+        debug_output("Could not draw a salt to seal frames with!\n");
+        router.aead = CRYPTO_AEAD_NONE;
+    }
+    router.streams = calloc(STREAM_LIMIT, sizeof(stream_t));
+    router.transfers = 0;
+    router.stalled = 0;
+    router.stopping = 0;
+    router.wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    // Rebuild channels from the durable log before any Node connects
+    router.logging = 0;
+    if (config->log_directory[0]) {
+        if (log_construct(&router.log, config->log_directory, (config->log_segment > 0) ? (size_t) config->log_segment : LOG_SEGMENT,
+                          (config->log_retain_bytes > 0) ? (size_t) config->log_retain_bytes : 0,
+                          (config->log_retain_age > 0) ? (time_t) config->log_retain_age : 0) != SUCCESS) {
+            debug_output("Could not open log in [%s], publishes will not be kept!\n", config->log_directory);
+        } else {
+            router.logging = 1;
+            pthread_rwlock_wrlock(&router.lock);
+            log_traverse(&router.log, NULL, &_channel_recover, &router);
+            pthread_rwlock_unlock(&router.lock);
+            debug_output("Recovered [%u] channels from log [%s]!\n", router.channel_count, config->log_directory);
+        }
+    }
+
+    // Each shard owns a listening socket and its own connection set
+    shards = calloc(count, sizeof(shard_t));
+    for (i = 0; i < count; ++i) {
+        shards[i].id = i;
+        crypto_session_construct(&shards[i].session, key, iv);
+        crypto_session_construct(&shards[i].hashed, key, iv);
+        crypto_session_construct(&shards[i].sealed, key, iv);
+        shards[i].session.legacy_hash = 1;
+        shards[i].router = &router;
+
+        // Connections stay on AES-CBC if the cipher is not available; shards share the key, so each takes its own nonces
+        if (crypto_session_seal(&shards[i].sealed, key, router.aead, router.salt, NULL) != SUCCESS) {
+            debug_output("Could not seal frames with cipher [%d]!\n", router.aead);
+            router.aead = CRYPTO_AEAD_NONE;
+        }
+        shards[i].sealed.prefix = (uint32_t) i;
+
+        if ((shards[i].sock = _core_listen(port)) < 0) {
+            rval = 1;
+            break;
+        }
+    }
+
+    if (rval == 0) {
+        pthread_mutex_lock(&_core_lock);
+        _core_router = &router;
+        pthread_mutex_unlock(&_core_lock);
+
+        // The calling thread runs shard 0
+        for (i = 1; i < count; ++i) {
+            if (pthread_create(&shards[i].thread, NULL, &_core_reactor, (void *) &shards[i])) {
+                debug_output("Could not create reactor thread for shard [%d]!\n", i);
+                close(shards[i].sock);
+                shards[i].sock = -1;
+            }
+        }
+        _core_reactor((void *) &shards[0]);
+
+        // Shard 0 only returns when the Core is stopped, or on a fatal error
+        for (i = 1; i < count; ++i) {
+            if (shards[i].sock >= 0) {
+                pthread_join(shards[i].thread, NULL);
             }
         }
+        rval = !__atomic_load_n(&router.stopping, __ATOMIC_ACQUIRE);
+
+        pthread_mutex_lock(&_core_lock);
+        _core_router = NULL;
+        pthread_mutex_unlock(&_core_lock);
     }
-    return 0;
+
+    for (i = 0; i < count; ++i) {
+        if (shards[i].sock > 0) {
+            close(shards[i].sock);
+        }
+        crypto_session_destruct(&shards[i].session);
+        crypto_session_destruct(&shards[i].hashed);
+        crypto_session_destruct(&shards[i].sealed);
+    }
+    free(shards);
+
+    // Every accepted publish is durable before the channels go away
+    if (router.logging) {
+        log_destruct(&router.log);
+    }
+
+    // Channels, the channel array, patterns, their lists and history rings, frames and payloads go with the slabs of their pools
+    trie_destruct(&router.patterns, NULL);
+    free(router.streams);
+
+    // Connections still open go with their pool too, once their sockets are closed
+    for (i = 0; i < router.capacity; ++i) {
+        if (router.connections[i]) {
+            close(router.connections[i]->sock);
+        }
+    }
+    free(router.connections);
+    close(router.wakeup);
+    pool_destruct(&router.frames);
+    buffer_pool_destruct(&router.buffers);
+    buffer_pool_destruct(&router.payloads);
+    pool_destruct(&router.channel_pool);
+    pool_destruct(&router.connection_pool);
+    buffer_pool_destruct(&router.lists);
+    pthread_rwlock_destroy(&router.lock);
+    pthread_mutex_destroy(&router.streams_lock);
+    if (router.kind == TABLE_OPEN) {
+        ot_destruct(&router.open);
+    } else {
+        ht_destruct(&router.table);
+    }
+
+    return rval;
+}
+
+int stop_core_server() {
+    int rval = 0;
+
+    // Every reactor returns at its next wait; start_core_server_config() then returns 0
+    pthread_mutex_lock(&_core_lock);
+    if (_core_router) {
+        __atomic_store_n(&_core_router->stopping, 1, __ATOMIC_RELEASE);
+        if (eventfd_write(_core_router->wakeup, 1) < 0) {
+            rval = 1;
+        }
+    } else {
+        rval = 1;
+    }
+    pthread_mutex_unlock(&_core_lock);
+    return rval;
+}
+
+int core_stats(core_stats_t * stats) {
+    int rval = 0;
+
+    // Pool counters of the Core running in this process
+    pthread_mutex_lock(&_core_lock);
+    if (_core_router && stats) {
+        _router_stats(_core_router, stats);
+    } else {
+        rval = 1;
+    }
+    pthread_mutex_unlock(&_core_lock);
+    return rval;
 }
 
 int start_node_client(core_t * core, unsigned int id, char * ip, int port, char * key, char * iv) {
@@ -609,6 +3536,25 @@ int start_node_client(core_t * core, unsigned int id, char * ip, int port, char
             core->node_id = id;
             strcpy(core->key, key);
             strcpy(core->iv, iv);
+            crypto_session_construct(&core->session, key, iv);
+            core->session.legacy_hash = 1;
+            ht_construct(&core->channels, TABLE_SIZE, 250, sizeof(uint32_t), &_hash_channel, &_compare_channel);
+            pthread_mutex_init(&core->channel_lock, NULL);
+            pthread_mutex_init(&core->send_lock, NULL);
+            pthread_mutex_init(&core->transfer_lock, NULL);
+            pthread_cond_init(&core->transfer_ready, NULL);
+            buffer_pool_construct(&core->buffers, BUFFER_SMALLEST, 2 * MESSAGE_LIMIT, BUFFER_SLAB);
+
+            // A Core sealing with a cipher this Node cannot use would reject every frame it sends
+            if ((core->protocol = _negotiate(core)) == 0) {
+                stop_node_client(core);
+                return 1;
+            }
+
+            // Channel announcements arrive whether or not this Node subscribes
+            if (core->protocol >= PROTOCOL_INTERNED && _sublisten_init != 1) {
+                _sublisten_start(core);
+            }
         }
     }
     else {
@@ -628,6 +3574,26 @@ int stop_node_client(core_t * core)
             free(core->addr);
         }
 
+        // Wake the listener and wait for it before releasing what it uses
+        if (_sublisten_init == 1)
+        {
+            shutdown(core->sock, SHUT_RDWR);
+            pthread_join(_sublisten_thread, NULL);
+
+            if (_sublisten_pack.subs)
+            {
+                buffer_free(&_sublisten_pack.core->buffers, _sublisten_pack.subs);
+            }
+            for (int i = 0; i < TRANSFER_RECEIVING; ++i)
+            {
+                _transfer_discard(&_sublisten_pack, &_sublisten_pack.transfers[i]);
+            }
+            pthread_mutex_destroy(_sublisten_pack.lock);
+            free(_sublisten_pack.lock);
+
+            _sublisten_init = 0;
+        }
+
         // Close socket
         if(core->sock)
         {
@@ -635,7 +3601,17 @@ int stop_node_client(core_t * core)
             core->sock = 0;
         }
 
-        _sublisten_init = 2;
+        ht_destruct(&core->channels);
+        crypto_session_destruct(&core->session);
+        // Channel names go with the buffer pool
+        core->names = NULL;
+        core->sequences = NULL;
+        core->names_size = 0;
+        pthread_mutex_destroy(&core->channel_lock);
+        pthread_mutex_destroy(&core->send_lock);
+        pthread_mutex_destroy(&core->transfer_lock);
+        pthread_cond_destroy(&core->transfer_ready);
+        buffer_pool_destruct(&core->buffers);
     }
     else
     {
@@ -646,11 +3622,97 @@ int stop_node_client(core_t * core)
     return 0;
 }
 
-int publish(core_t * core, char * channel, char * payload)
+static int _publish_large(core_t * core, char * channel, char * payload, uint32_t flags)
+{
+    message_t message;
+    char * joined = NULL;
+    char * output = NULL;
+    size_t size;
+    uint32_t id;
+    int rval = 1;
+
+    // Refer to the channel by the ID the Core announced, as messages that fit one frame do
+    message_initialize(&message);
+    if ((id = _channel_id(core, channel)))
+    {
+        size = 4 + strlen(payload);
+        message.source_id = FRAME_PUBLISH | FRAME_INTERNED | flags;
+    }
+    else
+    {
+        size = 1 + strlen(channel) + strlen(payload);
+        message.source_id = FRAME_PUBLISH | flags;
+    }
+
+    if (message_variable_size(size) - MESSAGE_PREFIX > MESSAGE_LIMIT)
+    {
+        debug_output("Cannot publish message of length [%zu], the limit is [%d]!\n", strlen(payload), MESSAGE_LIMIT);
+        return 1;
+    }
+
+    if (buffer_alloc(&core->buffers, size + 1, (void **) &joined) == SUCCESS)
+    {
+        if (id)
+        {
+            _interned_join(joined, id, payload);
+        }
+        else
+        {
+            _combined_join(joined, channel, payload);
+        }
+
+        if (core->protocol >= PROTOCOL_VARIABLE)
+        {
+            /*
+             * Send the message in one frame as long as it
+             */
+
+            if (buffer_alloc(&core->buffers, message_variable_size(size), (void **) &output) == SUCCESS)
+            {
+                message_pack_variable_session(&message, joined, size, output, &core->session);
+                rval = _send_to_core(core, output, (int) message_variable_size(size));
+            }
+        }
+        else
+        {
+            /*
+             * Send the message across fixed frames; bytes_remaining tells the Core how much is still to come
+             */
+
+            if (buffer_alloc(&core->buffers, _fragment_count(size) * MESSAGE_LENGTH, (void **) &output) == SUCCESS)
+            {
+                _fragment_pack(output, &message, joined, size, &core->session);
+                rval = _send_to_core(core, output, _fragment_count(size) * MESSAGE_LENGTH);
+            }
+        }
+    }
+
+    if (rval)
+    {
+        debug_output("Message could not be sent to Core!\n");
+    }
+    else
+    {
+        debug_output("Message sent to Core!\n");
+    }
+
+    if (output)
+    {
+        buffer_free(&core->buffers, output);
+    }
+    if (joined)
+    {
+        buffer_free(&core->buffers, joined);
+    }
+
+    return 0;
+}
+
+static int _publish(core_t * core, char * channel, char * payload, uint32_t flags)
 {
     message_t message;
-    const char * key = core->key;
-    const char * iv = core->iv;
+    const crypto_session_t * session = &core->session;
+    uint32_t id;
 
     if (core && channel && payload)
     {
@@ -662,9 +3724,69 @@ int publish(core_t * core, char * channel, char * payload)
 
         if (strlen(payload) >= 250)
         {
-            // TODO: Allow arbitrary message size
-            debug_output("Cannot publish message of length 250 or greater!\n");
-            return 1;
+            if (core->protocol < PROTOCOL_FRAGMENTED)
+            {
+                debug_output("Core cannot take messages of length 250 or greater!\n");
+                return 1;
+            }
+            return _publish_large(core, channel, payload, flags);
+        }
+
+        if (core->protocol >= PROTOCOL_INTERNED && 4 + strlen(payload) < sizeof(message.payload)
+        &&  (id = _channel_id(core, channel)))
+        {
+            /*
+             * Send payload with the channel ID the Core announced
+             */
+
+            // Set up message
+            message_initialize(&message);
+            message.bytes_remaining = strlen(payload);
+            message.source_id = FRAME_PUBLISH | FRAME_INTERNED | flags;
+            _interned_join(message.payload, id, payload);
+
+            // Serialize message
+            message_pack_session(&message, session);
+
+            // Send message
+            if (_send_message(core, &message))
+            {
+                debug_output("Message could not be sent to Core!\n");
+            }
+            else
+            {
+                debug_output("Message sent to Core!\n");
+            }
+
+            return 0;
+        }
+
+        if (core->protocol >= PROTOCOL_COMBINED && 1 + strlen(channel) + strlen(payload) < sizeof(message.payload))
+        {
+            /*
+             * Send combined channel and payload message
+             */
+
+            // Set up message
+            message_initialize(&message);
+            message.bytes_remaining = strlen(payload);
+            message.source_id = FRAME_PUBLISH | flags;
+            _combined_join(message.payload, channel, payload);
+
+            // Serialize message
+            message_pack_session(&message, session);
+
+            // Send message
+            if (_send_message(core, &message))
+            {
+                debug_output("Message could not be sent to Core!\n");
+            }
+            else
+            {
+                debug_output("Message sent to Core!\n");
+            }
+
+            return 0;
         }
 
         /*
@@ -678,10 +3800,10 @@ int publish(core_t * core, char * channel, char * payload)
         strcpy(message.payload, channel);   // Payload
 
         // Serialize message
-        message_pack(&message, key, iv);
+        message_pack_session(&message, session);
 
         // Send message
-        if (_send_to_core(core, message.message_string, MESSAGE_LENGTH))
+        if (_send_message(core, &message))
         {
             debug_output("Channel designation could not be sent to Core!\n");
         }
@@ -697,14 +3819,14 @@ int publish(core_t * core, char * channel, char * payload)
         // Set up message
         message_initialize(&message);
         message.bytes_remaining = strlen(payload);
-        message.source_id = 0;
+        message.source_id = flags;  // Cores that predate the flags ignore the payload frame's source ID
         strcpy(message.payload, payload);
 
         // Serialize message
-        message_pack(&message, key, iv);
+        message_pack_session(&message, session);
 
         // Send message
-        if (_send_to_core(core, message.message_string, MESSAGE_LENGTH))
+        if (_send_message(core, &message))
         {
             debug_output("Message could not be sent to Core!\n");
         }
@@ -724,68 +3846,72 @@ int publish(core_t * core, char * channel, char * payload)
     return 0;
 }
 
-int subscribe(core_t * core, char * channel, void (*callback)(char *))
+int publish(core_t * core, char * channel, char * payload)
+{
+    return _publish(core, channel, payload, 0);
+}
+
+int publish_retained(core_t * core, char * channel, char * payload)
+{
+    // The Core keeps the message and replays it to every later subscriber; an empty payload clears it
+    return _publish(core, channel, payload, FRAME_RETAIN);
+}
+
+static int _subscribe(core_t * core, char * channel, void (*callback)(char *), void (*transfer)(const char *, size_t), char replay, uint32_t sequence)
 {
     message_t message;
-    const char * key = core->key;
-    const char * iv = core->iv;
+    const crypto_session_t * session = &core->session;
 
-    static subpack_t pack;
-    static pthread_t listener;
+    subpack_t * pack = &_sublisten_pack;
 
-    if (core && channel && callback)
+    if (core && channel && (callback || transfer))
     {
         if (strlen(channel) >= 250)
         {
             debug_output("Cannot subscribe to channel name of length 250 or greater!\n");
             return 1;
         }
+        if (topic_wildcard(channel) == TRIE_INVALID)
+        {
+            debug_output("Cannot subscribe to channel [%s], wildcards must be whole levels!\n", channel);
+            return 1;
+        }
+        if (replay && (topic_wildcard(channel) || 4 + strlen(channel) >= sizeof(message.payload)))
+        {
+            debug_output("Cannot replay channel [%s], sequence numbers belong to a single channel!\n", channel);
+            return 1;
+        }
+        if (replay && core->protocol < PROTOCOL_SEQUENCED)
+        {
+            // The subscription still goes ahead, live only
+            debug_output("Core keeps no history, channel [%s] is not replayed!\n", channel);
+            replay = 0;
+        }
 
         /*
          * Set up listener server
          */
 
-        if (_sublisten_init == 0 || _sublisten_init == 2)
+        if (_sublisten_init != 1 && _sublisten_start(core))
         {
-            if (_sublisten_init == 2)
-            {
-                free(pack.subs);
-
-                pthread_mutex_destroy(pack.lock);
-                free(pack.lock);
-
-                pthread_cancel(listener);
-            }
-
-            pack.core = core;
-            pack.size = 1;
-            pack.subs = calloc(1, sizeof(subscription_t));
-            pack.lock = calloc(1, sizeof(pthread_mutex_t));
-
-            strcpy(pack.subs[0].channel, channel);
-            pack.subs[0].callback = callback;
-
-            pthread_mutex_init(pack.lock, NULL);
-
-            if (pthread_create(&listener, NULL, &_subscription_listener, (void *) &pack))
-            {
-                debug_output("Could not create listener thread!\n");
-                return 1;
-            }
-
-            _sublisten_init = 1;
+            return 1;
         }
-        else if (_sublisten_init == 1)
-        {
-            pthread_mutex_lock(pack.lock);
 
-            pack.subs = realloc(pack.subs, (pack.size + 1) * sizeof(subscription_t));
-            strcpy(pack.subs[pack.size].channel, channel);
-            pack.subs[pack.size].callback = callback;
-            pack.size += 1;
+        pthread_mutex_lock(pack->lock);
 
-            pthread_mutex_unlock(pack.lock);
+        if (buffer_resize(&pack->core->buffers, (void **) &pack->subs, (pack->size + 1) * sizeof(subscription_t)) != SUCCESS)
+        {
+            pthread_mutex_unlock(pack->lock);
+            debug_output("Could not subscribe to channel [%s]!\n", channel);
+            return 1;
         }
+        strcpy(pack->subs[pack->size].channel, channel);
+        pack->subs[pack->size].id = _channel_id(core, channel);
+        pack->subs[pack->size].callback = callback;
+        pack->subs[pack->size].transfer = transfer;
+        pack->size += 1;
+
+        pthread_mutex_unlock(pack->lock);
 
         /*
          * Send channel subscription message
@@ -798,12 +3924,19 @@ int subscribe(core_t * core, char * channel, void (*callback)(char *))
         message.source_id &= 0x7FFF;    // Force MSB of ID to 0
         strcpy(message.payload, channel);   // Payload
 
+        if (replay)
+        {
+            // The Core replays what it still holds from the sequence number on, then relays live
+            message.source_id |= FRAME_REPLAY;
+            _interned_join(message.payload, sequence, channel);
+        }
+
         // Serialize message
-        message_pack(&message, key, iv);
+        message_pack_session(&message, session);
         //fprintf(stderr, "%x %x %s\n", message.bytes_remaining, message.source_id, message.payload);
 
         // Send message
-        if(_send_to_core(core, message.message_string, MESSAGE_LENGTH))
+        if(_send_message(core, &message))
         {
             debug_output("Message could not be sent to Core!\n");
         }
@@ -820,3 +3953,234 @@ int subscribe(core_t * core, char * channel, void (*callback)(char *))
 
     return 0;
 }
+
+int subscribe(core_t * core, char * channel, void (*callback)(char *))
+{
+    return _subscribe(core, channel, callback, NULL, 0, 0);
+}
+
+int subscribe_from(core_t * core, char * channel, void (*callback)(char *), uint32_t sequence)
+{
+    return _subscribe(core, channel, callback, NULL, 1, sequence);
+}
+
+uint32_t last_sequence(core_t * core, char * channel)
+{
+    uint32_t sequence = 0;
+    uint32_t id;
+
+    if (core && channel && (id = _channel_id(core, channel)))
+    {
+        // Sequence number of the last relay received on the channel, 0 if none was numbered
+        pthread_mutex_lock(&core->channel_lock);
+        if (id < core->names_size)
+        {
+            sequence = core->sequences[id];
+        }
+        pthread_mutex_unlock(&core->channel_lock);
+    }
+
+    return sequence;
+}
+
+static int _transfer_send(core_t * core, char * payload, size_t size)
+{
+    message_t message;
+    char * output;
+    int rval = 1;
+
+    // Transfer frames are always variable, whatever their length
+    message_initialize(&message);
+    message.source_id = FRAME_TRANSFER;
+
+    if (buffer_alloc(&core->buffers, message_variable_size(size), (void **) &output) == SUCCESS)
+    {
+        message_pack_variable_session(&message, payload, size, output, &core->session);
+        rval = _send_to_core(core, output, (int) message_variable_size(size));
+        buffer_free(&core->buffers, output);
+    }
+
+    return rval;
+}
+
+static int _transfer_wait(core_t * core, uint32_t next)
+{
+    struct timespec deadline;
+
+    // Caller holds the transfer lock; the timeout runs from the last answer, so a slow transfer still progresses
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += TRANSFER_TIMEOUT / 1000;
+    deadline.tv_nsec += (TRANSFER_TIMEOUT % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (!core->transfer_answered || (core->transfer_id && core->transfer_next < next))
+    {
+        if (pthread_cond_timedwait(&core->transfer_ready, &core->transfer_lock, &deadline) == ETIMEDOUT)
+        {
+            debug_output("Core did not answer transfer [%u]!\n", core->transfer_id);
+            return 1;
+        }
+    }
+
+    // Refused, or the connection to the Core was lost
+    return (core->transfer_id == 0);
+}
+
+static int _transfer(core_t * core, char * channel, const char * data, size_t size, uint32_t * id)
+{
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    char * payload = NULL;
+    uint32_t chunks;
+    uint32_t index;
+    uint32_t length;
+    int rval = 1;
+
+    if (core && channel && data && size && id)
+    {
+        if (strlen(channel) >= 250 || topic_wildcard(channel) != 0)
+        {
+            debug_output("Cannot transfer to channel [%s], it must be a single channel!\n", channel);
+            return 1;
+        }
+        if (core->protocol < PROTOCOL_VARIABLE)
+        {
+            debug_output("Core cannot take transfers!\n");
+            return 1;
+        }
+        if (size > UINT32_MAX || size > 2 * MESSAGE_LIMIT)
+        {
+            debug_output("Cannot transfer [%zu] bytes, the limit is [%d]!\n", size, 2 * MESSAGE_LIMIT);
+            return 1;
+        }
+
+        // The Core's answers arrive on the listener
+        if (_sublisten_init != 1 && _sublisten_start(core))
+        {
+            return 1;
+        }
+
+        chunks = (uint32_t) ((size + TRANSFER_CHUNK - 1) / TRANSFER_CHUNK);
+        message_hash(data, size, hash);
+        if (buffer_alloc(&core->buffers, TRANSFER_HEADER + TRANSFER_CHUNK, (void **) &payload) != SUCCESS)
+        {
+            return 1;
+        }
+
+        pthread_mutex_lock(&core->transfer_lock);
+        while (core->transferring)
+        {
+            pthread_cond_wait(&core->transfer_ready, &core->transfer_lock);
+        }
+        core->transferring = 1;
+        core->transfer_answered = 0;
+        core->transfer_id = *id;
+        core->transfer_next = 0;
+        pthread_mutex_unlock(&core->transfer_lock);
+
+        /*
+         * Announce the transfer; the Core answers with its ID and the first chunk it still needs
+         */
+
+        payload[0] = TRANSFER_BEGIN;
+        _word_join(payload + 1, *id);
+        _word_join(payload + 5, chunks);
+        _word_join(payload + 9, TRANSFER_CHUNK);
+        _word_join(payload + 13, (uint32_t) size);
+        memcpy(payload + 17, hash, SHA256_DIGEST_LENGTH);
+        strcpy(payload + TRANSFER_BEGIN_HEADER, channel);
+
+        if (_transfer_send(core, payload, TRANSFER_BEGIN_HEADER + strlen(channel) + 1) == 0)
+        {
+            pthread_mutex_lock(&core->transfer_lock);
+            rval = _transfer_wait(core, 0);
+            *id = core->transfer_id;
+            index = core->transfer_next;
+            pthread_mutex_unlock(&core->transfer_lock);
+
+            /*
+             * Send every chunk from there, at most TRANSFER_WINDOW ahead of the Core's acknowledgements
+             */
+
+            while (rval == 0 && index < chunks)
+            {
+                if (index >= TRANSFER_WINDOW)
+                {
+                    pthread_mutex_lock(&core->transfer_lock);
+                    rval = _transfer_wait(core, index - TRANSFER_WINDOW + 1);
+                    pthread_mutex_unlock(&core->transfer_lock);
+                    if (rval)
+                    {
+                        break;
+                    }
+                }
+
+                length = (index + 1 < chunks) ? TRANSFER_CHUNK : (uint32_t) (size - (size_t) index * TRANSFER_CHUNK);
+                payload[0] = TRANSFER_DATA;
+                _word_join(payload + 1, *id);
+                _word_join(payload + 5, index);
+                _word_join(payload + 9, length);
+                _word_join(payload + 13, ht_fnv1a(data + (size_t) index * TRANSFER_CHUNK, length));
+                memcpy(payload + TRANSFER_HEADER, data + (size_t) index * TRANSFER_CHUNK, length);
+
+                rval = _transfer_send(core, payload, TRANSFER_HEADER + length);
+                index += 1;
+            }
+
+            // Done once the Core has queued every chunk
+            if (rval == 0)
+            {
+                pthread_mutex_lock(&core->transfer_lock);
+                rval = _transfer_wait(core, chunks);
+                pthread_mutex_unlock(&core->transfer_lock);
+            }
+        }
+
+        pthread_mutex_lock(&core->transfer_lock);
+        core->transferring = 0;
+        pthread_cond_broadcast(&core->transfer_ready);
+        pthread_mutex_unlock(&core->transfer_lock);
+
+        buffer_free(&core->buffers, payload);
+
+        if (rval)
+        {
+            debug_output("Transfer [%u] interrupted, it may be resumed!\n", *id);
+        }
+        else
+        {
+            debug_output("Transfer [%u] of [%zu] bytes sent to channel [%s]!\n", *id, size, channel);
+        }
+    }
+
+    return rval;
+}
+
+int transfer(core_t * core, char * channel, const char * data, size_t size, uint32_t * id)
+{
+    // id is set once the Core accepts the transfer, so an interrupted transfer can be resumed with it
+    if (id)
+    {
+        *id = 0;
+    }
+    return _transfer(core, channel, data, size, id);
+}
+
+int transfer_resume(core_t * core, char * channel, const char * data, size_t size, uint32_t id)
+{
+    // The Core picks up from the first chunk it has not relayed; if it no longer knows the ID, the transfer starts over
+    return _transfer(core, channel, data, size, &id);
+}
+
+int subscribe_transfer(core_t * core, char * channel, void (*callback)(const char *, size_t))
+{
+    if (core && core->protocol < PROTOCOL_VARIABLE)
+    {
+        debug_output("Core cannot relay transfers!\n");
+        return 1;
+    }
+    return _subscribe(core, channel, NULL, callback, 0, 0);
+}
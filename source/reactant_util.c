@@ -6,6 +6,15 @@
 
 #include "reactant_util.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <wmmintrin.h>
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#include <arm_neon.h>
+#endif
+
 
 // #############################################################################
 // #                                                                           #
@@ -131,32 +140,157 @@ char * _ht_status_message[] =
 {
     "Key does not exist",
     "Key already exists",
+    "Hash table is full",
 
 };
 
+/*******************************************************************************
+ *  Function:   FNV-1a hash
+ *  Description:    Computes the 32-bit FNV-1a hash of the given bytes
+ ******************************************************************************/
+uint32_t ht_fnv1a(const void * data, size_t length)
+{
+    const unsigned char * bytes = (const unsigned char *) data;
+    uint32_t hash = HT_FNV_BASIS;
+    size_t i;
+
+    for(i = 0; i < length; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= HT_FNV_PRIME;
+    }
+
+    return hash;
+}
+
+/*******************************************************************************
+ *  Function:   Hash table bucket
+ *  Description:    Returns the bucket that holds the given hash; buckets of the
+ *                  previous array that have not been migrated yet still hold
+ *                  their data objects
+ ******************************************************************************/
+static hash_data_t ** _ht_bucket(hash_table_t * hash_table, uint32_t hash)
+{
+    uint32_t index;
+
+    if(hash_table->_previous)
+    {
+        index = hash & (hash_table->_previous_size - 1);
+
+        if(index >= hash_table->_migrated)
+        {
+            return &(hash_table->_previous[index]);
+        }
+    }
+
+    return &(hash_table->_array[hash & (hash_table->size - 1)]);
+}
+
+/*******************************************************************************
+ *  Function:   Hash table migrate
+ *  Description:    Moves up to the given number of buckets from the previous
+ *                  array into the current one, releasing the previous array
+ *                  once it is empty
+ ******************************************************************************/
+static void _ht_migrate(hash_table_t * hash_table, uint32_t buckets)
+{
+    hash_data_t * position, * next;
+    hash_data_t ** target;
+
+    while(hash_table->_previous && buckets--)
+    {
+        // Relink every data object of the next unmigrated bucket
+        position = hash_table->_previous[hash_table->_migrated];
+        hash_table->_previous[hash_table->_migrated] = 0;
+
+        while(position)
+        {
+            next = position->_next;
+
+            target = &(hash_table->_array[position->_hash & (hash_table->size - 1)]);
+            position->_next = *target;
+            *target = position;
+
+            position = next;
+        }
+
+        // Release the previous array once every bucket has been moved
+        if(++hash_table->_migrated == hash_table->_previous_size)
+        {
+            free(hash_table->_previous);
+            hash_table->_previous = 0;
+            hash_table->_previous_size = 0;
+            hash_table->_migrated = 0;
+        }
+    }
+}
+
+/*******************************************************************************
+ *  Function:   Hash table grow
+ *  Description:    Doubles the bucket array once the load factor is exceeded;
+ *                  data objects are moved over by later operations rather than
+ *                  all at once
+ ******************************************************************************/
+static void _ht_grow(hash_table_t * hash_table)
+{
+    hash_data_t ** array;
+
+    if(hash_table->count <= hash_table->load_factor * hash_table->size)
+    {
+        return;
+    }
+
+    // A previous resize must finish before the next one begins
+    _ht_migrate(hash_table, hash_table->_previous_size);
+
+    if((array = calloc(hash_table->size * 2, sizeof(hash_data_t *))))
+    {
+        hash_table->_previous = hash_table->_array;
+        hash_table->_previous_size = hash_table->size;
+        hash_table->_migrated = 0;
+
+        hash_table->_array = array;
+        hash_table->size *= 2;
+    }
+}
+
 /*******************************************************************************
  *  Function:   Hash table constructor
  *  Description:    Acts as the constructor for a hash table object, fills the
- *                  given pointer with the new hash table object
+ *                  given pointer with the new hash table object; the size is
+ *                  rounded up to a power of two
  ******************************************************************************/
 int ht_construct(hash_table_t * hash_table, uint32_t size, uint32_t key_size, uint32_t value_size, \
                  uint32_t (*hash)(void *), uint8_t (*compare)(void *, void *))
 {
+    uint32_t buckets = 1;
+
     // If all given information is valid
     if(hash_table && hash && compare)
     {
         // Clear current hash table
         memset(hash_table, 0, sizeof(hash_table_t));
 
+        // Buckets are selected by masking the hash
+        while(buckets < size)
+        {
+            buckets <<= 1;
+        }
+
         // Allocate array
-        hash_table->_array = calloc(size, sizeof(hash_data_t *));
+        hash_table->_array = calloc(buckets, sizeof(hash_data_t *));
+
+        // Each data object is carved from a slab together with its key and value
+        hash_table->_value_offset = sizeof(hash_data_t) + ((key_size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1));
+        pool_construct(&hash_table->_entries, hash_table->_value_offset + value_size, HT_SLAB);
 
         // Assign methods
         hash_table->_hash = hash;
         hash_table->_compare = compare;
 
         // Assign variables
-        hash_table->size = size;
+        hash_table->size = buckets;
+        hash_table->load_factor = HT_LOAD_FACTOR;
         hash_table->_key_size = key_size;
         hash_table->_value_size = value_size;
     }
@@ -175,52 +309,33 @@ int ht_construct(hash_table_t * hash_table, uint32_t size, uint32_t key_size, ui
  ******************************************************************************/
 int ht_destruct(hash_table_t * hash_table)
 {
-    int i;
-    hash_data_t * position, * previous;
-
     // If given a valid pointer
     if(hash_table)
     {
-        // If hash table has an array of hash data
-        if(hash_table->_array)
-        {
-            // De-allocate all table elements
-            for(i = 0; i < hash_table->size; ++i)
-            {
-                // If there is a hash data object at this index
-                if(hash_table->_array[i])
-                {
-                    // Clear all data in linked list
-                    // Set position to first hash data object in linked list
-                    position = hash_table->_array[i];
+        // De-allocate the arrays; every data object goes with the slabs of the pool
+        free(hash_table->_previous);
+        free(hash_table->_array);
+        pool_destruct(&hash_table->_entries);
+    }
+    else
+    {
+        return ARGUMENT;
+    }
 
-                    // While there are still data objects to remove
-                    while(position)
-                    {
-                        // Increment position
-                        previous = position;
-                        position = position->_next;
-
-                        // De-allocate key in this object
-                        if(previous->key)
-                        {
-                            free(previous->key);
-                        }
-
-                        // De-allocate value in this object
-                        if(previous->value)
-                        {
-                            free(previous->value);
-                        }
-
-                        // De-allocate this object
-                        free(previous);
-                    }
-                }
-            }
-            // De-allocate the array
-            free(hash_table->_array);
-        }
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Hash table load factor
+ *  Description:    Sets the average number of data objects per bucket above
+ *                  which the given hash table grows
+ ******************************************************************************/
+int ht_load_factor(hash_table_t * hash_table, float load_factor)
+{
+    // If all given information is valid
+    if(hash_table && load_factor > 0)
+    {
+        hash_table->load_factor = load_factor;
     }
     else
     {
@@ -238,29 +353,30 @@ int ht_destruct(hash_table_t * hash_table)
  ******************************************************************************/
 int ht_search(hash_table_t * hash_table, hash_data_t * hash_data, void * key)
 {
-    uint32_t key_index;
+    uint32_t hash;
     hash_data_t * position;
     int rval = HT_DNE;
 
     // If all given information is valid
-    if (hash_table && hash_data && hash_table && key)
+    if (hash_table && hash_data && key)
     {
         // Clear current hash data
         memset(hash_data, 0, sizeof(hash_data_t));
 
         // Find where this data object should be based on its key
-        key_index = hash_table->_hash(key);
-        position = hash_table->_array[key_index];
+        hash = hash_table->_hash(key);
+        position = *_ht_bucket(hash_table, hash);
 
         // While there are still data objects at this index
         while (position)
         {
-            // Check if the hash data object at the current position matches the given key
-            if(hash_table->_compare(position->key, key))
+            // Only compare keys whose full hashes match
+            if(position->_hash == hash && hash_table->_compare(position->key, key))
             {
                 // Set given struct equal to found data
                 hash_data->key = position->key;
                 hash_data->value = position->value;
+                hash_data->_hash = hash;
 
                 // Set _next pointer to null
                 // hash_data->_next = 0;    // Already null from previous memset
@@ -286,51 +402,48 @@ int ht_search(hash_table_t * hash_table, hash_data_t * hash_data, void * key)
  ******************************************************************************/
 int ht_insert(hash_table_t * hash_table, void * key, void * value)
 {
-    uint32_t key_index;
+    uint32_t hash;
+    hash_data_t ** bucket;
     hash_data_t * position;
-    hash_data_t search;
 
     // If all given information is valid
     if (hash_table && key && value)
     {
-        // Ensure no duplicate keys are already in the table
-        if (ht_search(hash_table, &search, key) == SUCCESS)
-        {
-            return HT_DUPLICATE;
-        }
+        // Spread the cost of any resize across operations
+        _ht_migrate(hash_table, HT_MIGRATE_STEP);
 
         // Find where this data object should go based on its key
-        key_index = hash_table->_hash(key);
-        position = hash_table->_array[key_index];
-
-        // If there is nothing at this index
-        if (position == 0)
-        {
-            hash_table->_array[key_index] = calloc(1, sizeof(hash_data_t));
+        hash = hash_table->_hash(key);
+        bucket = _ht_bucket(hash_table, hash);
 
-            position = hash_table->_array[key_index];
-        }
-        else
+        // Ensure no duplicate keys are already in the table
+        for (position = *bucket; position; position = position->_next)
         {
-            // Find first null location in the linked list at this index
-            while (position->_next)
+            if (position->_hash == hash && hash_table->_compare(position->key, key))
             {
-                position = position->_next;
+                return HT_DUPLICATE;
             }
+        }
 
-            // Allocate memory for new hash data object
-            position->_next = calloc(1, sizeof(hash_data_t));
-
-            position = position->_next;
+        // Take a new hash data object from the pool and place it at the head of the bucket
+        if (pool_alloc(&hash_table->_entries, (void **) &position) != SUCCESS)
+        {
+            return HT_FULL;
         }
+        position->_hash = hash;
+        position->_next = *bucket;
+        *bucket = position;
 
-        // Allocate key and value
-        position->key = calloc(1, hash_table->_key_size);
-        position->value = calloc(1, hash_table->_value_size);
+        // Key and value are stored after the data object
+        position->key = (char *) position + sizeof(hash_data_t);
+        position->value = (char *) position + hash_table->_value_offset;
 
         // Assign key and value
         memcpy(position->key, key, hash_table->_key_size);
         memcpy(position->value, value, hash_table->_value_size);
+
+        hash_table->count += 1;
+        _ht_grow(hash_table);
     }
     else
     {
@@ -347,16 +460,21 @@ int ht_insert(hash_table_t * hash_table, void * key, void * value)
  ******************************************************************************/
 int ht_remove(hash_table_t * hash_table, void * key)
 {
-    uint32_t key_index;
+    uint32_t hash;
+    hash_data_t ** bucket;
     hash_data_t * position, * trail = 0;
     char found = 0;
 
     // If all given information is valid
     if (hash_table && key)
     {
+        // Spread the cost of any resize across operations
+        _ht_migrate(hash_table, HT_MIGRATE_STEP);
+
         // Find where the target should be based on its key
-        key_index = hash_table->_hash(key);
-        position = hash_table->_array[key_index];
+        hash = hash_table->_hash(key);
+        bucket = _ht_bucket(hash_table, hash);
+        position = *bucket;
 
         // If there is nothing at this index
         if (position == 0)
@@ -368,7 +486,7 @@ int ht_remove(hash_table_t * hash_table, void * key)
             // Find target object
             while (position)
             {
-                if (hash_table->_compare(position->key, key))
+                if (position->_hash == hash && hash_table->_compare(position->key, key))
                 {
                     found = 1;
 
@@ -376,7 +494,7 @@ int ht_remove(hash_table_t * hash_table, void * key)
                     if (!trail)
                     {
                         // If element is first in linked list
-                        hash_table->_array[key_index] = position->_next;
+                        *bucket = position->_next;
                     }
                     else
                     {
@@ -384,9 +502,9 @@ int ht_remove(hash_table_t * hash_table, void * key)
                         trail->_next = position->_next;
                     }
 
-                    free(position->key);
-                    free(position->value);
+                    pool_free(&hash_table->_entries, position);
 
+                    hash_table->count -= 1;
                     break;
                 }
                 else
@@ -423,6 +541,9 @@ int ht_traverse(hash_table_t * hash_table, void * (*visit)(void *, void *))
     // If all given information is valid
     if (hash_table && visit)
     {
+        // Finish any resize so every data object is in one array
+        _ht_migrate(hash_table, hash_table->_previous_size);
+
         for (i = 0; i < hash_table->size; ++i)
         {
             // Set position to first hash data object in linked list
@@ -451,145 +572,212 @@ int ht_traverse(hash_table_t * hash_table, void * (*visit)(void *, void *))
 
 // #############################################################################
 // #                                                                           #
-// #    Registry queue                                                         #
+// #    Open hash table                                                        #
 // #                                                                           #
 // #############################################################################
-char * _queue_status_message[] =
+/*******************************************************************************
+ *  Function:   Open hash table key
+ *  Description:    Returns the address of the key stored in the given entry
+ ******************************************************************************/
+static void * _ot_key(open_table_t * open_table, uint32_t entry)
 {
-    "Queue is full",
-    "Queue is empty",
-    "Mutex could not be acquired",
+    return open_table->_entries + (size_t) entry * open_table->_stride;
+}
 
-};
+/*******************************************************************************
+ *  Function:   Open hash table value
+ *  Description:    Returns the address of the value stored in the given entry
+ ******************************************************************************/
+static void * _ot_value(open_table_t * open_table, uint32_t entry)
+{
+    return open_table->_entries + (size_t) entry * open_table->_stride + open_table->_value_offset;
+}
 
 /*******************************************************************************
- *  Function:   Create queue
- *  Description:    Initializes the given queue object
+ *  Function:   Open hash table find
+ *  Description:    Returns the slot referring to the given key, or -1; probing
+ *                  stops at the first slot closer to its home than the key
+ *                  would be
  ******************************************************************************/
-int queue_construct(queue_t * queue, size_t capacity)
+static int64_t _ot_find(open_table_t * open_table, uint32_t hash, void * key)
 {
-    if (queue)
+    uint32_t mask = open_table->size - 1;
+    uint32_t slot = hash & mask;
+    uint32_t probe = 1;
+
+    while(open_table->_slots[slot].probe >= probe)
     {
-        queue->queue = malloc(sizeof(void *) * capacity);
-        queue->capacity = capacity;
-        queue->size = 0;
-        queue->head = 0;
-        queue->tail = 0;
+        if(open_table->_slots[slot].hash == hash
+        && open_table->_compare(_ot_key(open_table, open_table->_slots[slot].entry), key))
+        {
+            return slot;
+        }
 
-        queue->enqueue_semaphore = malloc(sizeof(sem_t));
-        sem_init(queue->enqueue_semaphore, 0, (int) capacity);
-        queue->dequeue_semaphore = malloc(sizeof(sem_t));
-        sem_init(queue->dequeue_semaphore, 0, 0);
+        slot = (slot + 1) & mask;
+        probe += 1;
+    }
 
-        queue->enqueue_mutex = malloc(sizeof(pthread_mutex_t));
-        queue->dequeue_mutex = malloc(sizeof(pthread_mutex_t));
-        pthread_mutex_init(queue->enqueue_mutex, NULL);
-        pthread_mutex_init(queue->dequeue_mutex, NULL);
+    return -1;
+}
 
-        queue->enqueue_blocking_mutex = malloc(sizeof(pthread_mutex_t));
-        queue->dequeue_blocking_mutex = malloc(sizeof(pthread_mutex_t));
-        pthread_mutex_init(queue->enqueue_blocking_mutex, NULL);
-        pthread_mutex_init(queue->dequeue_blocking_mutex, NULL);
-    }
-    else
+/*******************************************************************************
+ *  Function:   Open hash table place
+ *  Description:    Places a slot for an entry known to be absent, displacing
+ *                  slots that sit closer to their home (Robin Hood); only the
+ *                  small slots move, never the entries
+ ******************************************************************************/
+static void _ot_place(open_table_t * open_table, uint32_t hash, uint32_t entry)
+{
+    uint32_t mask = open_table->size - 1;
+    uint32_t slot = hash & mask;
+    ot_slot_t carry = { hash, 1, entry };
+    ot_slot_t swap;
+
+    while(open_table->_slots[slot].probe)
     {
-        return ARGUMENT;
+        // Take the slot from an entry that is nearer its home than the carried one
+        if(open_table->_slots[slot].probe < carry.probe)
+        {
+            swap = open_table->_slots[slot];
+            open_table->_slots[slot] = carry;
+            carry = swap;
+        }
+
+        slot = (slot + 1) & mask;
+        carry.probe += 1;
     }
 
-    return SUCCESS;
+    open_table->_slots[slot] = carry;
 }
 
 /*******************************************************************************
- *  Function:   Destroy queue
- *  Description:    Acts as the destructor for the given registry queue object,
- *                  de-allocates all allocated memory
+ *  Function:   Open hash table resize
+ *  Description:    Re-allocates the slots and entries for the given number of
+ *                  slots and re-places every stored entry
  ******************************************************************************/
-int queue_destruct(queue_t * queue)
+static int _ot_resize(open_table_t * open_table, uint32_t size)
 {
-    if (queue)
+    ot_slot_t * slots;
+    char * entries;
+    uint32_t * hashes;
+    uint32_t i;
+
+    slots = calloc(size, sizeof(ot_slot_t));
+    entries = realloc(open_table->_entries, (size_t) size * open_table->_stride);
+    if(entries)
     {
-        free(queue->queue);
+        open_table->_entries = entries;
+    }
+    hashes = realloc(open_table->_hashes, (size_t) size * sizeof(uint32_t));
+    if(hashes)
+    {
+        open_table->_hashes = hashes;
+    }
 
-        // Destroy mutexes
-        pthread_mutex_destroy(queue->enqueue_mutex);
-        pthread_mutex_destroy(queue->dequeue_mutex);
-        free(queue->enqueue_mutex);
-        free(queue->dequeue_mutex);
+    if(!slots || !entries || !hashes)
+    {
+        // Keep the current slots; they simply stay more loaded
+        free(slots);
+        return 1;
+    }
 
-        pthread_mutex_destroy(queue->enqueue_blocking_mutex);
-        pthread_mutex_destroy(queue->dequeue_blocking_mutex);
-        free(queue->enqueue_blocking_mutex);
-        free(queue->dequeue_blocking_mutex);
+    free(open_table->_slots);
+    open_table->_slots = slots;
+    open_table->size = size;
 
-        // Destroy semaphores
-        sem_destroy(queue->enqueue_semaphore);
-        sem_destroy(queue->dequeue_semaphore);
-        free(queue->enqueue_semaphore);
-        free(queue->dequeue_semaphore);
-    }
-    else
+    // Entries keep their positions; only their slots are rebuilt
+    for(i = 0; i < open_table->count; ++i)
     {
-        return ARGUMENT;
+        _ot_place(open_table, open_table->_hashes[i], i);
     }
 
-    return SUCCESS;
+    return 0;
 }
 
 /*******************************************************************************
- *  Function:   Enqueue
- *  Description:    Adds an item to the given queue
+ *  Function:   Open hash table constructor
+ *  Description:    Acts as the constructor for an open hash table object, fills
+ *                  the given pointer with the new object; takes the same
+ *                  arguments as the chained hash table
  ******************************************************************************/
-int enqueue(queue_t * queue, void * item)
+int ot_construct(open_table_t * open_table, uint32_t size, uint32_t key_size, uint32_t value_size, \
+                 uint32_t (*hash)(void *), uint8_t (*compare)(void *, void *))
 {
-    int rval = QUEUE_FULL;
+    uint32_t slots = 2;
 
-    if (queue && item)
+    // If all given information is valid
+    if(open_table && hash && compare && key_size && value_size)
     {
-        pthread_mutex_lock(queue->enqueue_mutex);
+        // Clear current table
+        memset(open_table, 0, sizeof(open_table_t));
 
-        // If the item can be enqueued.
-        if ((queue->head != queue->tail || queue->size == 0) && sem_trywait(queue->enqueue_semaphore) == 0)
+        // Slots are selected by masking the hash
+        while(slots < size)
         {
-            // Enqueue the item.
-            queue->queue[queue->head] = item;
-            queue->head = (queue->head + 1) % queue->capacity;
-            queue->size += 1;
-            rval = SUCCESS;
-
-            sem_post(queue->dequeue_semaphore);
+            slots <<= 1;
         }
 
-        pthread_mutex_unlock(queue->enqueue_mutex);
+        // Assign methods
+        open_table->_hash = hash;
+        open_table->_compare = compare;
+
+        // Assign variables; values are kept pointer-aligned behind their keys
+        open_table->load_factor = OT_LOAD_FACTOR;
+        open_table->_key_size = key_size;
+        open_table->_value_size = value_size;
+        open_table->_value_offset = (key_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+        open_table->_stride = (open_table->_value_offset + value_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+        // Allocate arrays
+        if(_ot_resize(open_table, slots))
+        {
+            ot_destruct(open_table);
+            return ARGUMENT;
+        }
     }
     else
     {
-        rval = ARGUMENT;
+        return ARGUMENT;
     }
 
-    return rval;
+    return SUCCESS;
 }
 
 /*******************************************************************************
- *  Function:   Enqueue (blocking)
- *  Description:    Adds an item to the given queue, blocks until queue has
- *                  room for the new item
+ *  Function:   Open hash table destructor
+ *  Description:    Acts as the destructor for the given open hash table object,
+ *                  de-allocates all allocated memory
  ******************************************************************************/
-int enqueue_blocking(queue_t * queue, void * item)
+int ot_destruct(open_table_t * open_table)
 {
-    if (queue && item)
+    // If given a valid pointer
+    if(open_table)
     {
-        // Wait until the item can be enqueued.
-        pthread_mutex_lock(queue->enqueue_blocking_mutex);
-        sem_wait(queue->enqueue_semaphore);
+        free(open_table->_slots);
+        free(open_table->_entries);
+        free(open_table->_hashes);
 
-        // Enqueue the item.
-        queue->queue[queue->head] = item;
-        queue->head = (queue->head + 1) % queue->capacity;
-        queue->size += 1;
+        memset(open_table, 0, sizeof(open_table_t));
+    }
+    else
+    {
+        return ARGUMENT;
+    }
 
-        // Increment the dequeue semaphore.
-        sem_post(queue->dequeue_semaphore);
-        pthread_mutex_unlock(queue->enqueue_blocking_mutex);
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Open hash table load factor
+ *  Description:    Sets the fraction of occupied slots above which the given
+ *                  open hash table grows
+ ******************************************************************************/
+int ot_load_factor(open_table_t * open_table, float load_factor)
+{
+    // Probing needs at least one empty slot
+    if(open_table && load_factor > 0 && load_factor < 1)
+    {
+        open_table->load_factor = load_factor;
     }
     else
     {
@@ -600,31 +788,31 @@ int enqueue_blocking(queue_t * queue, void * item)
 }
 
 /*******************************************************************************
- *  Function:   Dequeue
- *  Description:    Removes an item from the given queue
+ *  Function:   Open hash table search
+ *  Description:    Searches the given open hash table for the specified key;
+ *                  the key and value pointers returned stay valid until the
+ *                  next insert or remove
  ******************************************************************************/
-int dequeue(queue_t * queue, void ** item)
+int ot_search(open_table_t * open_table, hash_data_t * hash_data, void * key)
 {
-    int rval = QUEUE_EMPTY;
+    uint32_t hash;
+    int64_t slot;
+    int rval = HT_DNE;
 
-    if (queue && item)
+    // If all given information is valid
+    if(open_table && hash_data && key)
     {
-        pthread_mutex_lock(queue->dequeue_mutex);
+        // Clear current hash data
+        memset(hash_data, 0, sizeof(hash_data_t));
 
-        // If an item can be dequeued.
-        if (queue->size > 0 && sem_trywait(queue->dequeue_semaphore) == 0)
+        hash = open_table->_hash(key);
+        if((slot = _ot_find(open_table, hash, key)) >= 0)
         {
-            // Dequeue the item.
-            *item = (void *) queue->queue[queue->tail];
-            queue->tail = (queue->tail + 1) % queue->capacity;
-            queue->size -= 1;
+            hash_data->key = _ot_key(open_table, open_table->_slots[slot].entry);
+            hash_data->value = _ot_value(open_table, open_table->_slots[slot].entry);
+            hash_data->_hash = hash;
             rval = SUCCESS;
-
-            // Decrement dequeue and increment enqueue semaphores. Should never block.
-            sem_post(queue->enqueue_semaphore);
         }
-
-        pthread_mutex_unlock(queue->dequeue_mutex);
     }
     else
     {
@@ -635,29 +823,2637 @@ int dequeue(queue_t * queue, void ** item)
 }
 
 /*******************************************************************************
- *  Function:   Dequeue (blocking)
- *  Description:    Removes and returns an item from the given queue, blocks
+ *  Function:   Open hash table insert
+ *  Description:    Copies the given key and value into the given open hash
+ *                  table
+ ******************************************************************************/
+int ot_insert(open_table_t * open_table, void * key, void * value)
+{
+    uint32_t hash;
+    uint32_t entry;
+
+    // If all given information is valid
+    if(open_table && key && value)
+    {
+        hash = open_table->_hash(key);
+
+        // Ensure no duplicate keys are already in the table
+        if(_ot_find(open_table, hash, key) >= 0)
+        {
+            return HT_DUPLICATE;
+        }
+
+        if(open_table->count + 1 > open_table->load_factor * open_table->size)
+        {
+            _ot_resize(open_table, open_table->size * 2);
+        }
+
+        // Probing needs at least one empty slot
+        if(open_table->count + 1 >= open_table->size)
+        {
+            return HT_FULL;
+        }
+
+        // Entries stay dense; new ones are appended
+        entry = open_table->count;
+        memcpy(_ot_key(open_table, entry), key, open_table->_key_size);
+        memcpy(_ot_value(open_table, entry), value, open_table->_value_size);
+        open_table->_hashes[entry] = hash;
+
+        _ot_place(open_table, hash, entry);
+        open_table->count += 1;
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Open hash table remove
+ *  Description:    Removes the specified key from the given open hash table,
+ *                  shifting following displaced slots back toward their homes
+ *                  and moving the last entry into the freed one
+ ******************************************************************************/
+int ot_remove(open_table_t * open_table, void * key)
+{
+    uint32_t mask;
+    uint32_t slot, next;
+    uint32_t entry, last;
+    int64_t found;
+
+    // If all given information is valid
+    if(open_table && key)
+    {
+        if((found = _ot_find(open_table, open_table->_hash(key), key)) < 0)
+        {
+            return HT_DNE;
+        }
+
+        // Backward-shift deletion leaves no tombstones behind
+        mask = open_table->size - 1;
+        slot = (uint32_t) found;
+        entry = open_table->_slots[slot].entry;
+        next = (slot + 1) & mask;
+
+        while(open_table->_slots[next].probe > 1)
+        {
+            open_table->_slots[slot] = open_table->_slots[next];
+            open_table->_slots[slot].probe -= 1;
+
+            slot = next;
+            next = (next + 1) & mask;
+        }
+        open_table->_slots[slot].probe = 0;
+
+        // Fill the hole with the last entry and point its slot at the new position
+        last = open_table->count - 1;
+        if(entry != last)
+        {
+            memcpy(_ot_key(open_table, entry), _ot_key(open_table, last), open_table->_stride);
+            open_table->_hashes[entry] = open_table->_hashes[last];
+
+            slot = open_table->_hashes[last] & mask;
+            while(open_table->_slots[slot].entry != last || !open_table->_slots[slot].probe)
+            {
+                slot = (slot + 1) & mask;
+            }
+            open_table->_slots[slot].entry = entry;
+        }
+
+        open_table->count -= 1;
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Open hash table traverse
+ *  Description:    Traverses the given open hash table, giving each key and
+ *                  value to the given function
+ ******************************************************************************/
+int ot_traverse(open_table_t * open_table, void * (*visit)(void *, void *))
+{
+    uint32_t i;
+
+    // If all given information is valid
+    if(open_table && visit)
+    {
+        for(i = 0; i < open_table->count; ++i)
+        {
+            visit(_ot_key(open_table, i), _ot_value(open_table, i));
+        }
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+
+// #############################################################################
+// #                                                                           #
+// #    Registry queue                                                         #
+// #                                                                           #
+// #############################################################################
+char * _queue_status_message[] =
+{
+    "Queue is full",
+    "Queue is empty",
+    "Mutex could not be acquired",
+
+};
+
+/*******************************************************************************
+ *  Function:   Create queue
+ *  Description:    Initializes the given queue object
+ ******************************************************************************/
+int queue_construct(queue_t * queue, size_t capacity)
+{
+    if (queue)
+    {
+        queue->queue = malloc(sizeof(void *) * capacity);
+        queue->capacity = capacity;
+        queue->size = 0;
+        queue->head = 0;
+        queue->tail = 0;
+
+        queue->enqueue_semaphore = malloc(sizeof(sem_t));
+        sem_init(queue->enqueue_semaphore, 0, (int) capacity);
+        queue->dequeue_semaphore = malloc(sizeof(sem_t));
+        sem_init(queue->dequeue_semaphore, 0, 0);
+
+        queue->enqueue_mutex = malloc(sizeof(pthread_mutex_t));
+        queue->dequeue_mutex = malloc(sizeof(pthread_mutex_t));
+        pthread_mutex_init(queue->enqueue_mutex, NULL);
+        pthread_mutex_init(queue->dequeue_mutex, NULL);
+
+        queue->enqueue_blocking_mutex = malloc(sizeof(pthread_mutex_t));
+        queue->dequeue_blocking_mutex = malloc(sizeof(pthread_mutex_t));
+        pthread_mutex_init(queue->enqueue_blocking_mutex, NULL);
+        pthread_mutex_init(queue->dequeue_blocking_mutex, NULL);
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Destroy queue
+ *  Description:    Acts as the destructor for the given registry queue object,
+ *                  de-allocates all allocated memory
+ ******************************************************************************/
+int queue_destruct(queue_t * queue)
+{
+    if (queue)
+    {
+        free(queue->queue);
+
+        // Destroy mutexes
+        pthread_mutex_destroy(queue->enqueue_mutex);
+        pthread_mutex_destroy(queue->dequeue_mutex);
+        free(queue->enqueue_mutex);
+        free(queue->dequeue_mutex);
+
+        pthread_mutex_destroy(queue->enqueue_blocking_mutex);
+        pthread_mutex_destroy(queue->dequeue_blocking_mutex);
+        free(queue->enqueue_blocking_mutex);
+        free(queue->dequeue_blocking_mutex);
+
+        // Destroy semaphores
+        sem_destroy(queue->enqueue_semaphore);
+        sem_destroy(queue->dequeue_semaphore);
+        free(queue->enqueue_semaphore);
+        free(queue->dequeue_semaphore);
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Enqueue
+ *  Description:    Adds an item to the given queue
+ ******************************************************************************/
+int enqueue(queue_t * queue, void * item)
+{
+    int rval = QUEUE_FULL;
+
+    if (queue && item)
+    {
+        pthread_mutex_lock(queue->enqueue_mutex);
+
+        // If the item can be enqueued.
+        if ((queue->head != queue->tail || queue->size == 0) && sem_trywait(queue->enqueue_semaphore) == 0)
+        {
+            // Enqueue the item.
+            queue->queue[queue->head] = item;
+            queue->head = (queue->head + 1) % queue->capacity;
+            queue->size += 1;
+            rval = SUCCESS;
+
+            sem_post(queue->dequeue_semaphore);
+        }
+
+        pthread_mutex_unlock(queue->enqueue_mutex);
+    }
+    else
+    {
+        rval = ARGUMENT;
+    }
+
+    return rval;
+}
+
+/*******************************************************************************
+ *  Function:   Enqueue (blocking)
+ *  Description:    Adds an item to the given queue, blocks until queue has
+ *                  room for the new item
+ ******************************************************************************/
+int enqueue_blocking(queue_t * queue, void * item)
+{
+    if (queue && item)
+    {
+        // Wait until the item can be enqueued.
+        pthread_mutex_lock(queue->enqueue_blocking_mutex);
+        sem_wait(queue->enqueue_semaphore);
+
+        // Enqueue the item.
+        queue->queue[queue->head] = item;
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->size += 1;
+
+        // Increment the dequeue semaphore.
+        sem_post(queue->dequeue_semaphore);
+        pthread_mutex_unlock(queue->enqueue_blocking_mutex);
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Dequeue
+ *  Description:    Removes an item from the given queue
+ ******************************************************************************/
+int dequeue(queue_t * queue, void ** item)
+{
+    int rval = QUEUE_EMPTY;
+
+    if (queue && item)
+    {
+        pthread_mutex_lock(queue->dequeue_mutex);
+
+        // If an item can be dequeued.
+        if (queue->size > 0 && sem_trywait(queue->dequeue_semaphore) == 0)
+        {
+            // Dequeue the item.
+            *item = (void *) queue->queue[queue->tail];
+            queue->tail = (queue->tail + 1) % queue->capacity;
+            queue->size -= 1;
+            rval = SUCCESS;
+
+            // Decrement dequeue and increment enqueue semaphores. Should never block.
+            sem_post(queue->enqueue_semaphore);
+        }
+
+        pthread_mutex_unlock(queue->dequeue_mutex);
+    }
+    else
+    {
+        rval = ARGUMENT;
+    }
+
+    return rval;
+}
+
+/*******************************************************************************
+ *  Function:   Dequeue (blocking)
+ *  Description:    Removes and returns an item from the given queue, blocks
  *                  until the queue has an item to remove
  ******************************************************************************/
-int dequeue_blocking(queue_t * queue, void ** item)
+int dequeue_blocking(queue_t * queue, void ** item)
+{
+    int rval = QUEUE_EMPTY;
+
+    if (queue && item)
+    {
+        // Wait until an item can be dequeued.
+        pthread_mutex_lock(queue->dequeue_blocking_mutex);
+        sem_wait(queue->dequeue_semaphore);
+
+        // Dequeue the item.
+        *item = (void *) queue->queue[queue->tail];
+        queue->tail = (queue->tail + 1) % queue->capacity;
+        queue->size -= 1;
+        rval = SUCCESS;
+
+        // Increment the enqueue semaphore.
+        sem_post(queue->enqueue_semaphore);
+        pthread_mutex_unlock(queue->dequeue_blocking_mutex);
+    }
+    else
+    {
+        rval = ARGUMENT;
+    }
+
+    return rval;
+}
+
+
+// #############################################################################
+// #                                                                           #
+// #    Object pool                                                            #
+// #                                                                           #
+// #############################################################################
+char * _pool_status_message[] =
+{
+    "Pool could not allocate a new slab",
+    "Requested buffer is larger than the largest class of the pool",
+
+};
+
+/*******************************************************************************
+ *  Function:   Pool constructor
+ *  Description:    Initializes the given pool object. No memory is allocated
+ *                  until the first object is requested.
+ ******************************************************************************/
+int pool_construct(pool_t * pool, size_t object_size, size_t slab_objects)
+{
+    if (pool && object_size && slab_objects)
+    {
+        memset(pool, 0, sizeof(pool_t));
+
+        // Free objects store the free list link in their first bytes
+        if (object_size < sizeof(void *))
+        {
+            object_size = sizeof(void *);
+        }
+
+        // Keep every object in a slab aligned
+        pool->object_size = (object_size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+        pool->slab_objects = slab_objects;
+
+        pthread_mutex_init(&pool->lock, NULL);
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Pool destructor
+ *  Description:    Acts as the destructor for the given pool object,
+ *                  de-allocates every slab, including objects still in use
+ ******************************************************************************/
+int pool_destruct(pool_t * pool)
+{
+    if (pool)
+    {
+        for (size_t i = 0; i < pool->slab_count; ++i)
+        {
+            free(pool->slabs[i]);
+        }
+        free(pool->slabs);
+
+        pthread_mutex_destroy(&pool->lock);
+        memset(pool, 0, sizeof(pool_t));
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Pool allocate
+ *  Description:    Takes an object from the given pool, allocating a new slab
+ *                  when no free object remains. Object contents are undefined.
+ ******************************************************************************/
+int pool_alloc(pool_t * pool, void ** object)
+{
+    int rval = SUCCESS;
+    char * slab;
+    void ** slabs;
+
+    if (pool && object)
+    {
+        pthread_mutex_lock(&pool->lock);
+
+        if (!pool->free_list)
+        {
+            // Carve a new slab into free objects
+            slab = malloc(pool->object_size * pool->slab_objects);
+            slabs = realloc(pool->slabs, (pool->slab_count + 1) * sizeof(void *));
+
+            if (slab && slabs)
+            {
+                pool->slabs = slabs;
+                pool->slabs[pool->slab_count++] = slab;
+
+                for (size_t i = 0; i < pool->slab_objects; ++i)
+                {
+                    *(void **) (slab + i * pool->object_size) = pool->free_list;
+                    pool->free_list = slab + i * pool->object_size;
+                }
+            }
+            else
+            {
+                free(slab);
+                if (slabs)
+                {
+                    pool->slabs = slabs;
+                }
+            }
+        }
+
+        if (pool->free_list)
+        {
+            // Pop the first free object
+            *object = pool->free_list;
+            pool->free_list = *(void **) pool->free_list;
+
+            pool->allocations += 1;
+            if (++pool->in_use > pool->peak)
+            {
+                pool->peak = pool->in_use;
+            }
+        }
+        else
+        {
+            *object = NULL;
+            rval = POOL_NO_MEMORY;
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+    }
+    else
+    {
+        rval = ARGUMENT;
+    }
+
+    return rval;
+}
+
+/*******************************************************************************
+ *  Function:   Pool free
+ *  Description:    Returns an object to the given pool for reuse
+ ******************************************************************************/
+int pool_free(pool_t * pool, void * object)
+{
+    if (pool && object)
+    {
+        pthread_mutex_lock(&pool->lock);
+
+        *(void **) object = pool->free_list;
+        pool->free_list = object;
+        pool->in_use -= 1;
+
+        pthread_mutex_unlock(&pool->lock);
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Pool statistics
+ *  Description:    Fills the given counters with a snapshot of the pool
+ ******************************************************************************/
+int pool_stats(pool_t * pool, pool_stats_t * stats)
+{
+    if (pool && stats)
+    {
+        pthread_mutex_lock(&pool->lock);
+
+        stats->slabs = pool->slab_count;
+        stats->allocations = pool->allocations;
+        stats->in_use = pool->in_use;
+        stats->peak = pool->peak;
+
+        pthread_mutex_unlock(&pool->lock);
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Buffer pool constructor
+ *  Description:    Initializes the given buffer pool object with classes from
+ *                  smallest bytes up to at least largest bytes. Each slab of a
+ *                  class holds about slab_bytes, and at least one buffer.
+ ******************************************************************************/
+int buffer_pool_construct(buffer_pool_t * pool, size_t smallest, size_t largest, size_t slab_bytes)
+{
+    size_t size;
+
+    if (pool && smallest && largest)
+    {
+        memset(pool, 0, sizeof(buffer_pool_t));
+        pool->smallest = smallest;
+
+        for (size = smallest; size < largest; size *= 2)
+        {
+            pool->classes += 1;
+        }
+        pool->classes += 1;
+
+        if ((pool->pools = calloc(pool->classes, sizeof(pool_t))) == NULL)
+        {
+            return POOL_NO_MEMORY;
+        }
+
+        // Each buffer is preceded by its capacity, kept aligned like the buffer itself
+        for (size_t i = 0; i < pool->classes; ++i)
+        {
+            size = smallest << i;
+            pool_construct(&pool->pools[i], sizeof(max_align_t) + size, (slab_bytes > size) ? slab_bytes / size : 1);
+        }
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Buffer pool destructor
+ *  Description:    Acts as the destructor for the given buffer pool object,
+ *                  de-allocates every class, including buffers still in use
+ ******************************************************************************/
+int buffer_pool_destruct(buffer_pool_t * pool)
+{
+    if (pool)
+    {
+        for (size_t i = 0; i < pool->classes; ++i)
+        {
+            pool_destruct(&pool->pools[i]);
+        }
+        free(pool->pools);
+        memset(pool, 0, sizeof(buffer_pool_t));
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Buffer allocate
+ *  Description:    Takes a buffer of at least size bytes from the given pool.
+ *                  Buffer contents are undefined.
+ ******************************************************************************/
+int buffer_alloc(buffer_pool_t * pool, size_t size, void ** buffer)
+{
+    int rval;
+    size_t index = 0;
+    char * object;
+
+    if (pool && buffer)
+    {
+        *buffer = NULL;
+
+        // Find the smallest class that holds the buffer
+        while (index < pool->classes && (pool->smallest << index) < size)
+        {
+            index += 1;
+        }
+        if (index == pool->classes)
+        {
+            return POOL_TOO_LARGE;
+        }
+
+        if ((rval = pool_alloc(&pool->pools[index], (void **) &object)) == SUCCESS)
+        {
+            *(size_t *) object = pool->smallest << index;
+            *buffer = object + sizeof(max_align_t);
+        }
+    }
+    else
+    {
+        rval = ARGUMENT;
+    }
+
+    return rval;
+}
+
+/*******************************************************************************
+ *  Function:   Buffer resize
+ *  Description:    Ensures the given buffer holds at least size bytes, moving
+ *                  its contents to a buffer of a larger class if need be. A
+ *                  NULL buffer is allocated. On failure the buffer is kept.
+ ******************************************************************************/
+int buffer_resize(buffer_pool_t * pool, void ** buffer, size_t size)
+{
+    int rval = SUCCESS;
+    void * resized;
+
+    if (pool && buffer)
+    {
+        if (*buffer == NULL)
+        {
+            rval = buffer_alloc(pool, size, buffer);
+        }
+        else if (buffer_capacity(*buffer) < size && (rval = buffer_alloc(pool, size, &resized)) == SUCCESS)
+        {
+            memcpy(resized, *buffer, buffer_capacity(*buffer));
+            buffer_free(pool, *buffer);
+            *buffer = resized;
+        }
+    }
+    else
+    {
+        rval = ARGUMENT;
+    }
+
+    return rval;
+}
+
+/*******************************************************************************
+ *  Function:   Buffer free
+ *  Description:    Returns a buffer to the class of the given pool it was
+ *                  taken from
+ ******************************************************************************/
+int buffer_free(buffer_pool_t * pool, void * buffer)
+{
+    size_t index = 0;
+
+    if (pool && buffer)
+    {
+        while ((pool->smallest << index) < buffer_capacity(buffer))
+        {
+            index += 1;
+        }
+        pool_free(&pool->pools[index], (char *) buffer - sizeof(max_align_t));
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Buffer pool statistics
+ *  Description:    Fills the given counters with the sum of every class of the
+ *                  buffer pool; the peak is the sum of each class's peak
+ ******************************************************************************/
+int buffer_pool_stats(buffer_pool_t * pool, pool_stats_t * stats)
+{
+    pool_stats_t class_stats;
+
+    if (pool && stats)
+    {
+        memset(stats, 0, sizeof(pool_stats_t));
+
+        for (size_t i = 0; i < pool->classes; ++i)
+        {
+            pool_stats(&pool->pools[i], &class_stats);
+            stats->slabs += class_stats.slabs;
+            stats->allocations += class_stats.allocations;
+            stats->in_use += class_stats.in_use;
+            stats->peak += class_stats.peak;
+        }
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Buffer capacity
+ *  Description:    Returns the usable size in bytes of the given buffer
+ ******************************************************************************/
+size_t buffer_capacity(void * buffer)
+{
+    return buffer ? *(size_t *) ((char *) buffer - sizeof(max_align_t)) : 0;
+}
+
+
+// #############################################################################
+// #                                                                           #
+// #    Topic trie                                                             #
+// #                                                                           #
+// #############################################################################
+char * _trie_status_message[] =
+{
+    "Pattern does not exist",
+    "Pattern is not a valid topic pattern",
+
+};
+
+/*******************************************************************************
+ *  Function:   Topic level
+ *  Description:    Returns the length of the level starting at the given
+ *                  position, and sets the given pointer to the next level, or
+ *                  to NULL if this level is the last
+ ******************************************************************************/
+static size_t _topic_level(const char * position, const char ** next)
+{
+    const char * end = strchr(position, TOPIC_SEPARATOR);
+
+    if (end)
+    {
+        *next = end + 1;
+        return end - position;
+    }
+
+    *next = NULL;
+    return strlen(position);
+}
+
+/*******************************************************************************
+ *  Function:   Topic wildcard
+ *  Description:    Returns 1 if the given pattern contains a wildcard level,
+ *                  0 if it names a single topic, or TRIE_INVALID if a wildcard
+ *                  is misplaced
+ ******************************************************************************/
+int topic_wildcard(const char * pattern)
+{
+    const char * position = pattern;
+    const char * next;
+    size_t length;
+    int rval = 0;
+
+    if (!pattern)
+    {
+        return ARGUMENT;
+    }
+
+    while (position)
+    {
+        length = _topic_level(position, &next);
+
+        if (length == 1 && (*position == TOPIC_SINGLE || *position == TOPIC_MULTI))
+        {
+            // A multi-level wildcard must be the last level
+            if (*position == TOPIC_MULTI && next)
+            {
+                return TRIE_INVALID;
+            }
+            rval = 1;
+        }
+        else if (memchr(position, TOPIC_SINGLE, length) || memchr(position, TOPIC_MULTI, length))
+        {
+            return TRIE_INVALID;
+        }
+
+        position = next;
+    }
+
+    return rval;
+}
+
+/*******************************************************************************
+ *  Function:   Topic match
+ *  Description:    Returns 1 if the given topic matches the given pattern,
+ *                  otherwise 0; a pattern without wildcards only matches the
+ *                  identical topic
+ ******************************************************************************/
+int topic_match(const char * pattern, const char * topic)
+{
+    const char * next_pattern;
+    const char * next_topic;
+    size_t pattern_length, topic_length;
+
+    if (!pattern || !topic)
+    {
+        return 0;
+    }
+
+    // Leading wildcards leave system topics alone
+    if (*topic == TOPIC_SYSTEM && (*pattern == TOPIC_SINGLE || *pattern == TOPIC_MULTI))
+    {
+        return 0;
+    }
+
+    while (pattern)
+    {
+        pattern_length = _topic_level(pattern, &next_pattern);
+
+        // Matches the parent level and anything below it, so "a/#" also matches "a"
+        if (pattern_length == 1 && *pattern == TOPIC_MULTI)
+        {
+            return 1;
+        }
+        if (!topic)
+        {
+            return 0;
+        }
+
+        topic_length = _topic_level(topic, &next_topic);
+
+        if (!(pattern_length == 1 && *pattern == TOPIC_SINGLE)
+        &&  (pattern_length != topic_length || strncmp(pattern, topic, topic_length) != 0))
+        {
+            return 0;
+        }
+
+        pattern = next_pattern;
+        topic = next_topic;
+    }
+
+    return (topic == NULL);
+}
+
+/*******************************************************************************
+ *  Function:   Trie child
+ *  Description:    Finds the named child of the given node; returns its index,
+ *                  or the index it would be inserted at, and sets found
+ ******************************************************************************/
+static uint32_t _trie_child(trie_node_t * node, const char * level, size_t length, char * found)
+{
+    uint32_t low = 0, high = node->size, middle;
+    int compare;
+
+    // Children are kept sorted, so a binary search finds the level
+    while (low < high)
+    {
+        middle = (low + high) / 2;
+        compare = strncmp(node->children[middle]->level, level, length);
+        if (compare == 0)
+        {
+            compare = (node->children[middle]->level[length] != 0);
+        }
+
+        if (compare == 0)
+        {
+            *found = 1;
+            return middle;
+        }
+        else if (compare < 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    *found = 0;
+    return low;
+}
+
+/*******************************************************************************
+ *  Function:   Trie node create
+ *  Description:    Allocates a node for the given level under the given parent
+ ******************************************************************************/
+static trie_node_t * _trie_node(trie_node_t * parent, const char * level, size_t length)
+{
+    trie_node_t * node = calloc(1, sizeof(trie_node_t));
+
+    if (node)
+    {
+        if ((node->level = malloc(length + 1)) == NULL)
+        {
+            free(node);
+            return NULL;
+        }
+        memcpy(node->level, level, length);
+        node->level[length] = 0;
+        node->parent = parent;
+    }
+
+    return node;
+}
+
+/*******************************************************************************
+ *  Function:   Trie node find
+ *  Description:    Walks the given pattern from the root, optionally creating
+ *                  missing nodes; returns the node for the pattern or NULL
+ ******************************************************************************/
+static trie_node_t * _trie_find(trie_t * trie, const char * pattern, char create)
+{
+    trie_node_t * node = &trie->root;
+    trie_node_t ** target;
+    trie_node_t ** children;
+    const char * position = pattern;
+    const char * next;
+    size_t length;
+    uint32_t index;
+    char found;
+
+    while (position && node)
+    {
+        length = _topic_level(position, &next);
+
+        if (length == 1 && *position == TOPIC_SINGLE)
+        {
+            target = &node->single;
+        }
+        else if (length == 1 && *position == TOPIC_MULTI)
+        {
+            target = &node->multi;
+        }
+        else
+        {
+            index = _trie_child(node, position, length, &found);
+
+            if (!found)
+            {
+                if (!create)
+                {
+                    return NULL;
+                }
+
+                // Grow the child array and keep it sorted
+                if (node->size == node->capacity)
+                {
+                    children = realloc(node->children, (node->capacity ? node->capacity * 2 : 2) * sizeof(trie_node_t *));
+                    if (!children)
+                    {
+                        return NULL;
+                    }
+                    node->children = children;
+                    node->capacity = node->capacity ? node->capacity * 2 : 2;
+                }
+                memmove(&node->children[index + 1], &node->children[index], (node->size - index) * sizeof(trie_node_t *));
+                if ((node->children[index] = _trie_node(node, position, length)) == NULL)
+                {
+                    memmove(&node->children[index], &node->children[index + 1], (node->size - index) * sizeof(trie_node_t *));
+                    return NULL;
+                }
+                node->size += 1;
+            }
+            target = &node->children[index];
+        }
+
+        if (!*target)
+        {
+            if (!create)
+            {
+                return NULL;
+            }
+            *target = _trie_node(node, position, length);
+        }
+
+        node = *target;
+        position = next;
+    }
+
+    return node;
+}
+
+/*******************************************************************************
+ *  Function:   Trie node release
+ *  Description:    De-allocates the given node and every node below it, giving
+ *                  each stored value to the given function
+ ******************************************************************************/
+static void _trie_release(trie_node_t * node, void (*release)(void *))
+{
+    uint32_t i;
+
+    for (i = 0; i < node->size; ++i)
+    {
+        _trie_release(node->children[i], release);
+        free(node->children[i]);
+    }
+    if (node->single)
+    {
+        _trie_release(node->single, release);
+        free(node->single);
+    }
+    if (node->multi)
+    {
+        _trie_release(node->multi, release);
+        free(node->multi);
+    }
+
+    if (node->value && release)
+    {
+        release(node->value);
+    }
+    free(node->children);
+    free(node->level);
+}
+
+/*******************************************************************************
+ *  Function:   Trie match node
+ *  Description:    Visits the values of every pattern below the given node
+ *                  that matches the remaining levels of a topic
+ ******************************************************************************/
+static void _trie_match(trie_node_t * node, const char * topic, char root, void (*visit)(void *, void *), void * user)
+{
+    const char * next;
+    size_t length;
+    uint32_t index;
+    char found;
+
+    // A final '#' matches the parent level and every level below it
+    if (node->multi && node->multi->value && !(root && topic && *topic == TOPIC_SYSTEM))
+    {
+        visit(node->multi->value, user);
+    }
+
+    if (!topic)
+    {
+        // Every level of the topic has been consumed
+        if (node->value)
+        {
+            visit(node->value, user);
+        }
+        return;
+    }
+
+    length = _topic_level(topic, &next);
+
+    if (node->single && !(root && *topic == TOPIC_SYSTEM))
+    {
+        _trie_match(node->single, next, 0, visit, user);
+    }
+
+    index = _trie_child(node, topic, length, &found);
+    if (found)
+    {
+        _trie_match(node->children[index], next, 0, visit, user);
+    }
+}
+
+/*******************************************************************************
+ *  Function:   Trie constructor
+ *  Description:    Initializes the given trie object
+ ******************************************************************************/
+int trie_construct(trie_t * trie)
+{
+    if (trie)
+    {
+        memset(trie, 0, sizeof(trie_t));
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Trie destructor
+ *  Description:    De-allocates every node of the given trie, giving each
+ *                  stored value to the given function if one is given
+ ******************************************************************************/
+int trie_destruct(trie_t * trie, void (*release)(void *))
+{
+    if (trie)
+    {
+        _trie_release(&trie->root, release);
+        memset(trie, 0, sizeof(trie_t));
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Trie insert
+ *  Description:    Stores the given value for the given pattern, creating the
+ *                  levels it needs; replaces any value already stored
+ ******************************************************************************/
+int trie_insert(trie_t * trie, const char * pattern, void * value)
+{
+    trie_node_t * node;
+
+    if (!trie || !pattern || !value)
+    {
+        return ARGUMENT;
+    }
+    if (topic_wildcard(pattern) == TRIE_INVALID)
+    {
+        return TRIE_INVALID;
+    }
+
+    if ((node = _trie_find(trie, pattern, 1)) == NULL)
+    {
+        return ARGUMENT;
+    }
+
+    if (!node->value)
+    {
+        trie->count += 1;
+    }
+    node->value = value;
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Trie search
+ *  Description:    Sets the given pointer to the value stored for exactly the
+ *                  given pattern
+ ******************************************************************************/
+int trie_search(trie_t * trie, const char * pattern, void ** value)
+{
+    trie_node_t * node;
+
+    if (!trie || !pattern || !value)
+    {
+        return ARGUMENT;
+    }
+
+    if ((node = _trie_find(trie, pattern, 0)) == NULL || !node->value)
+    {
+        return TRIE_DNE;
+    }
+    *value = node->value;
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Trie remove
+ *  Description:    Removes the given pattern from the trie, releasing nodes
+ *                  that no longer lead to any pattern; the caller owns the
+ *                  value that was stored
+ ******************************************************************************/
+int trie_remove(trie_t * trie, const char * pattern)
+{
+    trie_node_t * node, * parent;
+    uint32_t index;
+    char found;
+
+    if (!trie || !pattern)
+    {
+        return ARGUMENT;
+    }
+
+    if ((node = _trie_find(trie, pattern, 0)) == NULL || !node->value)
+    {
+        return TRIE_DNE;
+    }
+    node->value = NULL;
+    trie->count -= 1;
+
+    // Prune empty leaves back toward the root
+    while (node != &trie->root && !node->value && !node->size && !node->single && !node->multi)
+    {
+        parent = node->parent;
+
+        if (parent->single == node)
+        {
+            parent->single = NULL;
+        }
+        else if (parent->multi == node)
+        {
+            parent->multi = NULL;
+        }
+        else
+        {
+            index = _trie_child(parent, node->level, strlen(node->level), &found);
+            memmove(&parent->children[index], &parent->children[index + 1], (parent->size - index - 1) * sizeof(trie_node_t *));
+            parent->size -= 1;
+        }
+
+        free(node->children);
+        free(node->level);
+        free(node);
+        node = parent;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Trie match
+ *  Description:    Gives the value of every stored pattern matching the given
+ *                  topic to the given function, along with the user pointer
+ ******************************************************************************/
+int trie_match(trie_t * trie, const char * topic, void (*visit)(void *, void *), void * user)
+{
+    if (trie && topic && visit)
+    {
+        _trie_match(&trie->root, topic, 1, visit, user);
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+
+// #############################################################################
+// #                                                                           #
+// #    Append log                                                             #
+// #                                                                           #
+// #############################################################################
+char * _log_status_message[] =
+{
+    "Log segment could not be accessed",
+
+};
+
+/*******************************************************************************
+ *  Function:   Log segment path
+ *  Description:    Writes the file path of the given segment into the given
+ *                  buffer
+ ******************************************************************************/
+static void _log_path(log_t * log, uint64_t segment, char * path, size_t size)
+{
+    snprintf(path, size, "%s/%016llx%s", log->directory, (unsigned long long) segment, LOG_SUFFIX);
+}
+
+/*******************************************************************************
+ *  Function:   Log segment compare
+ *  Description:    Orders segment numbers for qsort()
+ ******************************************************************************/
+static int _log_compare(const void * lhs, const void * rhs)
+{
+    uint64_t left = ((const log_segment_t *) lhs)->number;
+    uint64_t right = ((const log_segment_t *) rhs)->number;
+
+    return (left > right) - (left < right);
+}
+
+/*******************************************************************************
+ *  Function:   Log retire
+ *  Description:    Deletes the oldest sealed segments while they exceed the
+ *                  retention size or age; caller holds the log lock. While a
+ *                  traversal is reading segments, retirement waits for it.
+ ******************************************************************************/
+static void _log_retire(log_t * log)
+{
+    char path[PATH_MAX];
+    struct stat status;
+    size_t total = 0;
+    size_t i;
+    time_t now = time(NULL);
+
+    if (!log->retain_bytes && !log->retain_age)
+    {
+        return;
+    }
+    if (log->readers)
+    {
+        log->retire_deferred = 1;
+        return;
+    }
+
+    for (i = 0; i + 1 < log->segment_count; ++i)
+    {
+        _log_path(log, log->segments[i].number, path, sizeof(path));
+        if (stat(path, &status) == 0)
+        {
+            total += status.st_size;
+        }
+    }
+
+    // The segment being written is never retired
+    while (log->segment_count > 1)
+    {
+        _log_path(log, log->segments[0].number, path, sizeof(path));
+        if (stat(path, &status) < 0)
+        {
+            status.st_size = 0;
+            status.st_mtime = now;
+        }
+
+        if (!(log->retain_bytes && total > log->retain_bytes)
+        &&  !(log->retain_age && now - status.st_mtime > log->retain_age))
+        {
+            break;
+        }
+
+        unlink(path);
+        total -= status.st_size;
+        memmove(&log->segments[0], &log->segments[1], (log->segment_count - 1) * sizeof(log_segment_t));
+        log->segment_count -= 1;
+    }
+}
+
+/*******************************************************************************
+ *  Function:   Log roll
+ *  Description:    Seals the segment being written, if any, and starts the
+ *                  next one at the given log position; caller holds the log
+ *                  lock
+ ******************************************************************************/
+static int _log_roll(log_t * log, uint64_t base)
+{
+    char path[PATH_MAX];
+    log_segment_t * segments;
+    uint64_t segment = log->segment_count ? log->segments[log->segment_count - 1].number + 1 : 1;
+    int fd;
+
+    _log_path(log, segment, path, sizeof(path));
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+    {
+        return LOG_IO;
+    }
+    if ((segments = realloc(log->segments, (log->segment_count + 1) * sizeof(log_segment_t))) == NULL)
+    {
+        close(fd);
+        unlink(path);
+        return LOG_IO;
+    }
+
+    if (log->fd >= 0)
+    {
+        close(log->fd);
+    }
+    log->segments = segments;
+    log->segments[log->segment_count].number = segment;
+    log->segments[log->segment_count].base = base;
+    log->segment_count += 1;
+    log->fd = fd;
+    log->active_size = 0;
+
+    _log_retire(log);
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Log writer
+ *  Description:    Writes pending records in batches, making each batch
+ *                  durable with a single fsync. A batch that fails to write
+ *                  or sync is never counted durable; the log keeps the error
+ *                  and continues in a new segment rather than behind the torn
+ *                  record.
+ ******************************************************************************/
+static void * _log_writer(void * _log)
+{
+    log_t * log = (log_t *) _log;
+    char * batch;
+    size_t capacity;
+    size_t size;
+    size_t written;
+    ssize_t bytes;
+    uint64_t target;
+    int failed;
+
+    pthread_mutex_lock(&log->lock);
+
+    while (1)
+    {
+        while (!log->pending_size && !log->stopping)
+        {
+            pthread_cond_wait(&log->ready, &log->lock);
+        }
+        if (!log->pending_size)
+        {
+            break;
+        }
+
+        // Take every pending record at once; appends continue into a new buffer
+        batch = log->pending;
+        capacity = log->pending_capacity;
+        size = log->pending_size;
+        target = log->appended;
+        log->pending = NULL;
+        log->pending_size = 0;
+        log->pending_capacity = 0;
+        pthread_mutex_unlock(&log->lock);
+
+        failed = 0;
+        for (written = 0; written < size; written += bytes)
+        {
+            if ((bytes = write(log->fd, batch + written, size - written)) < 0)
+            {
+                if (errno == EINTR)
+                {
+                    bytes = 0;
+                    continue;
+                }
+                debug_output("Failed to write log segment: [%d]!\n", errno);
+                failed = 1;
+                break;
+            }
+        }
+        if (!failed && fdatasync(log->fd) < 0)
+        {
+            debug_output("Failed to sync log segment: [%d]!\n", errno);
+            failed = 1;
+        }
+
+        pthread_mutex_lock(&log->lock);
+        log->active_size += written;
+        if (failed)
+        {
+            log->error = LOG_IO;
+        }
+        else if (!log->error)
+        {
+            log->synced = target;
+        }
+
+        // Hand the buffer back for the next batch unless appends already started a new one
+        if (!log->pending)
+        {
+            log->pending = batch;
+            log->pending_capacity = capacity;
+        }
+        else
+        {
+            free(batch);
+        }
+
+        // Later batches must not land behind a torn record, where reading stops; positions carry on from the batch
+        if ((failed || log->active_size >= log->segment_size) && _log_roll(log, target) != SUCCESS)
+        {
+            debug_output("Failed to roll log segment: [%d]!\n", errno);
+        }
+        pthread_cond_broadcast(&log->done);
+    }
+
+    pthread_mutex_unlock(&log->lock);
+    return NULL;
+}
+
+/*******************************************************************************
+ *  Function:   Log constructor
+ *  Description:    Opens the log kept in the given directory, creating the
+ *                  directory if needed, and starts its writer thread. Existing
+ *                  segments are kept and new records go to a new segment.
+ ******************************************************************************/
+int log_construct(log_t * log, const char * directory, size_t segment_size, size_t retain_bytes, time_t retain_age)
+{
+    DIR * listing;
+    struct dirent * entry;
+    struct stat status;
+    log_segment_t * segments;
+    unsigned long long segment;
+    uint64_t base = 0;
+    char path[PATH_MAX];
+    char suffix[8];
+
+    if (!log || !directory || !segment_size)
+    {
+        return ARGUMENT;
+    }
+
+    memset(log, 0, sizeof(log_t));
+    log->fd = -1;
+    log->segment_size = segment_size;
+    log->retain_bytes = retain_bytes;
+    log->retain_age = retain_age;
+
+    mkdir(directory, 0755);
+    if ((listing = opendir(directory)) == NULL)
+    {
+        return LOG_IO;
+    }
+    log->directory = strdup(directory);
+
+    // Collect the segments left by earlier runs
+    while ((entry = readdir(listing)))
+    {
+        if (sscanf(entry->d_name, "%16llx%7s", &segment, suffix) == 2 && strcmp(suffix, LOG_SUFFIX) == 0
+        &&  (segments = realloc(log->segments, (log->segment_count + 1) * sizeof(log_segment_t))))
+        {
+            log->segments = segments;
+            log->segments[log->segment_count].number = segment;
+            log->segment_count += 1;
+        }
+    }
+    closedir(listing);
+    if (log->segment_count)
+    {
+        qsort(log->segments, log->segment_count, sizeof(log_segment_t), &_log_compare);
+    }
+
+    // Positions count from the oldest segment still kept
+    for (size_t i = 0; i < log->segment_count; ++i)
+    {
+        log->segments[i].base = base;
+        _log_path(log, log->segments[i].number, path, sizeof(path));
+        if (stat(path, &status) == 0)
+        {
+            base += status.st_size;
+        }
+    }
+    log->appended = base;
+    log->synced = base;
+
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->ready, NULL);
+    pthread_cond_init(&log->done, NULL);
+
+    if (_log_roll(log, base) != SUCCESS || pthread_create(&log->writer, NULL, &_log_writer, (void *) log))
+    {
+        if (log->fd >= 0)
+        {
+            close(log->fd);
+        }
+        pthread_mutex_destroy(&log->lock);
+        pthread_cond_destroy(&log->ready);
+        pthread_cond_destroy(&log->done);
+        free(log->segments);
+        free(log->directory);
+        return LOG_IO;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Log destructor
+ *  Description:    Makes every appended record durable, stops the writer
+ *                  thread and de-allocates all allocated memory
+ ******************************************************************************/
+int log_destruct(log_t * log)
+{
+    if (log)
+    {
+        pthread_mutex_lock(&log->lock);
+        log->stopping = 1;
+        pthread_cond_signal(&log->ready);
+        pthread_mutex_unlock(&log->lock);
+        pthread_join(log->writer, NULL);
+
+        close(log->fd);
+        pthread_mutex_destroy(&log->lock);
+        pthread_cond_destroy(&log->ready);
+        pthread_cond_destroy(&log->done);
+        free(log->pending);
+        free(log->segments);
+        free(log->directory);
+        memset(log, 0, sizeof(log_t));
+        log->fd = -1;
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Log append
+ *  Description:    Queues the given record for the writer thread; the record
+ *                  is copied, and is durable once a later flush returns
+ *                  SUCCESS. Once a write has failed, records are refused with
+ *                  the writer's error. The record's log position is given
+ *                  back when asked for.
+ ******************************************************************************/
+int log_append(log_t * log, const void * record, size_t size, uint64_t * position)
+{
+    char * pending;
+    size_t capacity;
+    uint32_t hash;
+
+    if (!log || !record || size > UINT32_MAX)
+    {
+        return ARGUMENT;
+    }
+
+    pthread_mutex_lock(&log->lock);
+
+    if (log->error)
+    {
+        pthread_mutex_unlock(&log->lock);
+        return log->error;
+    }
+
+    if (log->pending_size + LOG_HEADER + size > log->pending_capacity)
+    {
+        capacity = log->pending_capacity ? log->pending_capacity : 4096;
+        while (capacity < log->pending_size + LOG_HEADER + size)
+        {
+            capacity *= 2;
+        }
+        if ((pending = realloc(log->pending, capacity)) == NULL)
+        {
+            pthread_mutex_unlock(&log->lock);
+            return LOG_IO;
+        }
+        log->pending = pending;
+        log->pending_capacity = capacity;
+    }
+
+    // A torn write at the end of a segment fails the hash and ends reading there
+    pending = log->pending + log->pending_size;
+    hash = ht_fnv1a(record, size);
+    for (int i = 0; i < 4; ++i)
+    {
+        pending[i] = (char) (size >> (24 - 8 * i));
+        pending[4 + i] = (char) (hash >> (24 - 8 * i));
+    }
+    memcpy(pending + LOG_HEADER, record, size);
+
+    if (position)
+    {
+        *position = log->appended;
+    }
+    log->pending_size += LOG_HEADER + size;
+    log->appended += LOG_HEADER + size;
+
+    pthread_cond_signal(&log->ready);
+    pthread_mutex_unlock(&log->lock);
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Log flush
+ *  Description:    Blocks until every record appended so far is durable, or
+ *                  returns the writer's error if one of them cannot be
+ ******************************************************************************/
+int log_flush(log_t * log)
+{
+    uint64_t target;
+    int rval;
+
+    if (log)
+    {
+        pthread_mutex_lock(&log->lock);
+        target = log->appended;
+        while (log->synced < target && !log->error)
+        {
+            pthread_cond_wait(&log->done, &log->lock);
+        }
+        rval = (log->synced < target) ? log->error : SUCCESS;
+        pthread_mutex_unlock(&log->lock);
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return rval;
+}
+
+/*******************************************************************************
+ *  Function:   Log start
+ *  Description:    Gives the log position of the oldest record still kept;
+ *                  records before it have been retired
+ ******************************************************************************/
+int log_start(log_t * log, uint64_t * position)
+{
+    if (log && position)
+    {
+        pthread_mutex_lock(&log->lock);
+        *position = log->segment_count ? log->segments[0].base : log->appended;
+        pthread_mutex_unlock(&log->lock);
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Log traverse
+ *  Description:    Gives every durable record, oldest first, to the given
+ *                  function along with its log position and the user pointer.
+ *                  Records are read in place from mapped segments and stay
+ *                  valid only during the call; returning non-zero stops the
+ *                  traversal. Given a position, reading starts at it, or at
+ *                  the oldest record kept if that is later, and the position
+ *                  is moved to where the next traversal should carry on.
+ *                  Appends and the writer carry on meanwhile; only retirement
+ *                  waits.
+ ******************************************************************************/
+int log_traverse(log_t * log, uint64_t * position, int (*visit)(const char *, size_t, uint64_t, void *), void * user)
+{
+    char path[PATH_MAX];
+    struct stat status;
+    const unsigned char * map;
+    size_t size, offset, length, count, durable;
+    uint64_t start = position ? *position : 0;
+    uint64_t base, end, resume = start;
+    uint32_t hash;
+    int stop = 0;
+    int fd;
+
+    if (!log || !visit)
+    {
+        return ARGUMENT;
+    }
+
+    // Being a reader keeps segments from being retired, so they stay where they are without holding the lock
+    pthread_mutex_lock(&log->lock);
+    log->readers += 1;
+    count = log->segment_count;
+    pthread_mutex_unlock(&log->lock);
+
+    for (size_t i = 0; i < count && !stop; ++i)
+    {
+        pthread_mutex_lock(&log->lock);
+        _log_path(log, log->segments[i].number, path, sizeof(path));
+        base = log->segments[i].base;
+        end = (i + 1 < log->segment_count) ? log->segments[i + 1].base : UINT64_MAX;
+        durable = (i + 1 == log->segment_count) ? log->active_size : SIZE_MAX;
+        pthread_mutex_unlock(&log->lock);
+
+        // Segments wholly before the start are skipped, and the next one always carries on past this one
+        if (end <= start)
+        {
+            continue;
+        }
+        offset = (start > base) ? start - base : 0;
+        resume = (end != UINT64_MAX) ? end : base + offset;
+
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        {
+            continue;
+        }
+
+        // Only the durable part of the segment being written is read
+        size = (fstat(fd, &status) == 0) ? (size_t) status.st_size : 0;
+        if (size > durable)
+        {
+            size = durable;
+        }
+
+        if (offset < size && (map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED)
+        {
+            for (; offset + LOG_HEADER <= size && !stop; offset += LOG_HEADER + length)
+            {
+                length = ((size_t) map[offset] << 24) | ((size_t) map[offset + 1] << 16)
+                       | ((size_t) map[offset + 2] << 8) | (size_t) map[offset + 3];
+                hash = ((uint32_t) map[offset + 4] << 24) | ((uint32_t) map[offset + 5] << 16)
+                     | ((uint32_t) map[offset + 6] << 8) | (uint32_t) map[offset + 7];
+
+                // The rest of a segment after a torn or corrupt record is ignored
+                if (length > size - offset - LOG_HEADER || ht_fnv1a(map + offset + LOG_HEADER, length) != hash)
+                {
+                    break;
+                }
+                stop = visit((const char *) map + offset + LOG_HEADER, length, base + offset, user);
+            }
+            munmap((void *) map, size);
+
+            // Stopping early, or reaching the durable end of the segment being written, resumes right after
+            if (stop || end == UINT64_MAX)
+            {
+                resume = base + offset;
+            }
+        }
+        close(fd);
+    }
+
+    // The last reader out retires what came due meanwhile
+    pthread_mutex_lock(&log->lock);
+    log->readers -= 1;
+    if (!log->readers && log->retire_deferred)
+    {
+        log->retire_deferred = 0;
+        _log_retire(log);
+    }
+    pthread_mutex_unlock(&log->lock);
+
+    if (position)
+    {
+        *position = resume;
+    }
+    return SUCCESS;
+}
+
+
+// #############################################################################
+// #                                                                           #
+// #    Message protocol                                                       #
+// #                                                                           #
+// #############################################################################
+char * _message_status_message[] =
+{
+    "Authentication failed; hash or tag mismatch",
+    "Variable message length is not valid",
+    "Cipher implementation is not supported by this CPU",
+
+};
+
+/*******************************************************************************
+ *  Function:   Create message
+ *  Description:    Initializes the given message object
+ *                  Note: Struct element sizes must conform to the sizes
+ *                        defined by the Reactant message standard
+ ******************************************************************************/
+int message_initialize(message_t * message)
+{
+    int rval = SUCCESS;
+
+    if (message)
+    {
+        // Initialize values to zero
+        message->bytes_remaining = 0;
+        message->source_id = 0;
+        memset(message->payload, 0, sizeof(message->payload));
+        memset(message->hmac, 0, sizeof(message->hmac));
+        memset(message->message_string, 0, sizeof(message->message_string));
+    }
+    else
+    {
+        rval = ARGUMENT;
+    }
+
+    return rval;
+}
+
+/*******************************************************************************
+ *  Function:   Inverse mix columns
+ *  Description:    Applies InvMixColumns to one 16-byte round key, turning
+ *                  an encryption round key into one for the equivalent
+ *                  inverse cipher
+ ******************************************************************************/
+static uint8_t _crypto_xtime(uint8_t x)
+{
+    return (uint8_t) ((x << 1) ^ ((x >> 7) * 0x1b));
+}
+
+static uint8_t _crypto_multiply(uint8_t x, uint8_t y)
+{
+    uint8_t product = 0;
+
+    for (; y; y >>= 1, x = _crypto_xtime(x))
+    {
+        if (y & 1)
+        {
+            product ^= x;
+        }
+    }
+    return product;
+}
+
+static void _crypto_inverse_mix(uint8_t * output, const uint8_t * input)
+{
+    for (int c = 0; c < 4; ++c)
+    {
+        const uint8_t * a = input + 4 * c;
+
+        output[4 * c + 0] = _crypto_multiply(a[0], 0x0e) ^ _crypto_multiply(a[1], 0x0b) ^ _crypto_multiply(a[2], 0x0d) ^ _crypto_multiply(a[3], 0x09);
+        output[4 * c + 1] = _crypto_multiply(a[0], 0x09) ^ _crypto_multiply(a[1], 0x0e) ^ _crypto_multiply(a[2], 0x0b) ^ _crypto_multiply(a[3], 0x0d);
+        output[4 * c + 2] = _crypto_multiply(a[0], 0x0d) ^ _crypto_multiply(a[1], 0x09) ^ _crypto_multiply(a[2], 0x0e) ^ _crypto_multiply(a[3], 0x0b);
+        output[4 * c + 3] = _crypto_multiply(a[0], 0x0b) ^ _crypto_multiply(a[1], 0x0d) ^ _crypto_multiply(a[2], 0x09) ^ _crypto_multiply(a[3], 0x0e);
+    }
+}
+
+/*******************************************************************************
+ *  Function:   Portable CBC
+ *  Description:    Encrypts or decrypts with the portable cipher AES_TTABLE
+ *                  builds, starting from a copy of the session's round keys
+ *                  and IV
+ ******************************************************************************/
+static void _crypto_portable_encrypt(const crypto_session_t * session, uint8_t * buffer, size_t length)
+{
+    struct AES_ctx context = session->context;
+
+    AES_CBC_encrypt_buffer(&context, buffer, (uint32_t) length);
+}
+
+static void _crypto_portable_decrypt(const crypto_session_t * session, uint8_t * const * buffers, size_t count, size_t length)
+{
+    struct AES_ctx context = session->context;
+
+    for (size_t b = 0; b < count; ++b)
+    {
+        AES_ctx_set_iv(&context, session->context.Iv);
+        AES_CBC_decrypt_buffer(&context, buffers[b], (uint32_t) length);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*******************************************************************************
+ *  Function:   AES-NI CBC
+ *  Description:    Encrypts or decrypts with the x86 AES instructions, one
+ *                  round per instruction
+ ******************************************************************************/
+__attribute__((target("aes,sse2")))
+static void _crypto_aesni_encrypt(const crypto_session_t * session, uint8_t * buffer, size_t length)
+{
+    __m128i keys[AES_ROUNDS + 1];
+    __m128i block = _mm_loadu_si128((const __m128i *) session->context.Iv);
+
+    for (int r = 0; r <= AES_ROUNDS; ++r)
+    {
+        keys[r] = _mm_loadu_si128((const __m128i *) (session->context.RoundKey + 16 * r));
+    }
+
+    // Each block is chained to the ciphertext of the one before
+    for (size_t i = 0; i + AES_BLOCKLEN <= length; i += AES_BLOCKLEN)
+    {
+        block = _mm_xor_si128(block, _mm_loadu_si128((const __m128i *) (buffer + i)));
+        block = _mm_xor_si128(block, keys[0]);
+        for (int r = 1; r < AES_ROUNDS; ++r)
+        {
+            block = _mm_aesenc_si128(block, keys[r]);
+        }
+        block = _mm_aesenclast_si128(block, keys[AES_ROUNDS]);
+        _mm_storeu_si128((__m128i *) (buffer + i), block);
+    }
+}
+
+__attribute__((target("aes,sse2")))
+static void _crypto_aesni_decrypt(const crypto_session_t * session, uint8_t * const * buffers, size_t count, size_t length)
+{
+    __m128i keys[AES_ROUNDS + 1];
+    __m128i iv = _mm_loadu_si128((const __m128i *) session->context.Iv);
+    __m128i chain = iv;
+    __m128i cipher[CRYPTO_INTERLEAVE];
+    __m128i block[CRYPTO_INTERLEAVE];
+    uint8_t * output[CRYPTO_INTERLEAVE];
+    size_t blocks = length / AES_BLOCKLEN;
+    size_t total = blocks * count;
+    size_t n;
+
+    for (int r = 0; r <= AES_ROUNDS; ++r)
+    {
+        keys[r] = _mm_loadu_si128((const __m128i *) (session->inverse + 16 * r));
+    }
+
+    // Each block depends only on ciphertext, so blocks of every buffer are decrypted
+    // CRYPTO_INTERLEAVE at a time and their rounds overlap in the pipeline
+    for (size_t k = 0; k < total; k += n)
+    {
+        n = (total - k < CRYPTO_INTERLEAVE) ? total - k : CRYPTO_INTERLEAVE;
+        for (size_t i = 0; i < CRYPTO_INTERLEAVE; ++i)
+        {
+            output[i] = (i < n) ? buffers[(k + i) / blocks] + AES_BLOCKLEN * ((k + i) % blocks) : NULL;
+            cipher[i] = output[i] ? _mm_loadu_si128((const __m128i *) output[i]) : keys[0];
+            block[i] = _mm_xor_si128(cipher[i], keys[0]);
+        }
+        for (int r = 1; r < AES_ROUNDS; ++r)
+        {
+            for (size_t i = 0; i < CRYPTO_INTERLEAVE; ++i)
+            {
+                block[i] = _mm_aesdec_si128(block[i], keys[r]);
+            }
+        }
+        for (size_t i = 0; i < n; ++i)
+        {
+            // The first block of each buffer is chained to the IV
+            if ((k + i) % blocks == 0)
+            {
+                chain = iv;
+            }
+            _mm_storeu_si128((__m128i *) output[i], _mm_xor_si128(_mm_aesdeclast_si128(block[i], keys[AES_ROUNDS]), chain));
+            chain = cipher[i];
+        }
+    }
+}
+
+static int _crypto_aesni_supported(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_AES) && (edx & bit_SSE2);
+}
+#endif
+
+#if defined(__aarch64__)
+/*******************************************************************************
+ *  Function:   ARMv8 CBC
+ *  Description:    Encrypts or decrypts with the ARMv8 Cryptography Extension
+ ******************************************************************************/
+__attribute__((target("+crypto")))
+static void _crypto_armv8_encrypt(const crypto_session_t * session, uint8_t * buffer, size_t length)
+{
+    uint8x16_t keys[AES_ROUNDS + 1];
+    uint8x16_t block = vld1q_u8(session->context.Iv);
+
+    for (int r = 0; r <= AES_ROUNDS; ++r)
+    {
+        keys[r] = vld1q_u8(session->context.RoundKey + 16 * r);
+    }
+
+    // AESE adds the round key ahead of SubBytes and ShiftRows, so the last key is added alone
+    for (size_t i = 0; i + AES_BLOCKLEN <= length; i += AES_BLOCKLEN)
+    {
+        block = veorq_u8(block, vld1q_u8(buffer + i));
+        for (int r = 0; r < AES_ROUNDS - 1; ++r)
+        {
+            block = vaesmcq_u8(vaeseq_u8(block, keys[r]));
+        }
+        block = veorq_u8(vaeseq_u8(block, keys[AES_ROUNDS - 1]), keys[AES_ROUNDS]);
+        vst1q_u8(buffer + i, block);
+    }
+}
+
+__attribute__((target("+crypto")))
+static void _crypto_armv8_decrypt(const crypto_session_t * session, uint8_t * const * buffers, size_t count, size_t length)
+{
+    uint8x16_t keys[AES_ROUNDS + 1];
+    uint8x16_t iv = vld1q_u8(session->context.Iv);
+    uint8x16_t chain = iv;
+    uint8x16_t cipher[CRYPTO_INTERLEAVE];
+    uint8x16_t block[CRYPTO_INTERLEAVE];
+    uint8_t * output[CRYPTO_INTERLEAVE];
+    size_t blocks = length / AES_BLOCKLEN;
+    size_t total = blocks * count;
+    size_t n;
+
+    for (int r = 0; r <= AES_ROUNDS; ++r)
+    {
+        keys[r] = vld1q_u8(session->inverse + 16 * r);
+    }
+
+    // As with AES-NI, CRYPTO_INTERLEAVE blocks of every buffer are in flight at once
+    for (size_t k = 0; k < total; k += n)
+    {
+        n = (total - k < CRYPTO_INTERLEAVE) ? total - k : CRYPTO_INTERLEAVE;
+        for (size_t i = 0; i < CRYPTO_INTERLEAVE; ++i)
+        {
+            output[i] = (i < n) ? buffers[(k + i) / blocks] + AES_BLOCKLEN * ((k + i) % blocks) : NULL;
+            cipher[i] = output[i] ? vld1q_u8(output[i]) : keys[0];
+            block[i] = cipher[i];
+        }
+        for (int r = 0; r < AES_ROUNDS - 1; ++r)
+        {
+            for (size_t i = 0; i < CRYPTO_INTERLEAVE; ++i)
+            {
+                block[i] = vaesimcq_u8(vaesdq_u8(block[i], keys[r]));
+            }
+        }
+        for (size_t i = 0; i < n; ++i)
+        {
+            if ((k + i) % blocks == 0)
+            {
+                chain = iv;
+            }
+            vst1q_u8(output[i], veorq_u8(veorq_u8(vaesdq_u8(block[i], keys[AES_ROUNDS - 1]), keys[AES_ROUNDS]), chain));
+            chain = cipher[i];
+        }
+    }
+}
+
+static int _crypto_armv8_supported(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+}
+#endif
+
+// Cipher implementations, indexed by crypto_backend_t
+static const struct
+{
+    void (*encrypt)(const crypto_session_t *, uint8_t *, size_t);
+    void (*decrypt)(const crypto_session_t *, uint8_t * const *, size_t, size_t);
+
+} _crypto_backends[] =
+{
+    { &_crypto_portable_encrypt, &_crypto_portable_decrypt },
+#if defined(__x86_64__) || defined(__i386__)
+    { &_crypto_aesni_encrypt, &_crypto_aesni_decrypt },
+#else
+    { NULL, NULL },
+#endif
+#if defined(__aarch64__)
+    { &_crypto_armv8_encrypt, &_crypto_armv8_decrypt },
+#else
+    { NULL, NULL },
+#endif
+};
+
+static crypto_backend_t _crypto_selected = CRYPTO_PORTABLE;
+static pthread_once_t _crypto_detected = PTHREAD_ONCE_INIT;
+
+/*******************************************************************************
+ *  Function:   Crypto detect
+ *  Description:    Selects the fastest cipher implementation the CPU supports
+ ******************************************************************************/
+static void _crypto_detect(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (_crypto_aesni_supported())
+    {
+        _crypto_selected = CRYPTO_AESNI;
+    }
+#elif defined(__aarch64__)
+    if (_crypto_armv8_supported())
+    {
+        _crypto_selected = CRYPTO_ARMV8;
+    }
+#endif
+}
+
+/*******************************************************************************
+ *  Function:   Crypto backend
+ *  Description:    Returns the cipher implementation in use; the fastest the
+ *                  CPU supports unless another was selected
+ ******************************************************************************/
+crypto_backend_t crypto_backend(void)
+{
+    pthread_once(&_crypto_detected, &_crypto_detect);
+    return _crypto_selected;
+}
+
+/*******************************************************************************
+ *  Function:   Crypto backend select
+ *  Description:    Selects the cipher implementation used by every session,
+ *                  if the CPU supports it. Every implementation produces the
+ *                  same ciphertext, so sessions in use are unaffected.
+ ******************************************************************************/
+int crypto_backend_select(crypto_backend_t backend)
+{
+    int supported = 0;
+
+    pthread_once(&_crypto_detected, &_crypto_detect);
+
+    switch (backend)
+    {
+    case CRYPTO_PORTABLE:
+        supported = 1;
+        break;
+#if defined(__x86_64__) || defined(__i386__)
+    case CRYPTO_AESNI:
+        supported = _crypto_aesni_supported();
+        break;
+#endif
+#if defined(__aarch64__)
+    case CRYPTO_ARMV8:
+        supported = _crypto_armv8_supported();
+        break;
+#endif
+    default:
+        return ARGUMENT;
+    }
+
+    if (!supported)
+    {
+        return MESSAGE_UNSUPPORTED;
+    }
+    _crypto_selected = backend;
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   CBC encrypt
+ *  Description:    Encrypts length bytes of buffer in place, a multiple of
+ *                  the cipher block, chained from the session's IV
+ ******************************************************************************/
+int crypto_cbc_encrypt(const crypto_session_t * session, uint8_t * buffer, size_t length)
+{
+    if (session && (buffer || !length) && length % AES_BLOCKLEN == 0)
+    {
+        _crypto_backends[crypto_backend()].encrypt(session, buffer, length);
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   CBC decrypt
+ *  Description:    Decrypts length bytes of buffer in place, a multiple of
+ *                  the cipher block, chained from the session's IV
+ ******************************************************************************/
+int crypto_cbc_decrypt(const crypto_session_t * session, uint8_t * buffer, size_t length)
+{
+    return crypto_cbc_decrypt_many(session, &buffer, 1, length);
+}
+
+/*******************************************************************************
+ *  Function:   CBC decrypt many
+ *  Description:    Decrypts count buffers of length bytes in place, each
+ *                  chained from the session's IV. Hardware implementations
+ *                  interleave blocks across buffers, so a batch of frames
+ *                  costs less than decrypting them one at a time.
+ ******************************************************************************/
+int crypto_cbc_decrypt_many(const crypto_session_t * session, uint8_t * const * buffers, size_t count, size_t length)
+{
+    if (session && (buffers || !count) && length % AES_BLOCKLEN == 0)
+    {
+        for (size_t b = 0; b < count; ++b)
+        {
+            if (!buffers[b] && length)
+            {
+                return ARGUMENT;
+            }
+        }
+        if (length && count)
+        {
+            _crypto_backends[crypto_backend()].decrypt(session, buffers, count, length);
+        }
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Crypto session constructor
+ *  Description:    Expands the given 32-byte key once; messages packed and
+ *                  unpacked with the session start from a copy of the round
+ *                  keys and IV, so one session may be shared across threads
+ ******************************************************************************/
+int crypto_session_construct(crypto_session_t * session, const char * key, const char * iv)
+{
+    if (session && key && iv)
+    {
+        AES_init_ctx_iv(&session->context, (const uint8_t *) key, (const uint8_t *) iv);
+        session->aead = CRYPTO_AEAD_NONE;
+        session->legacy_hash = 0;
+        session->sealing_keying = 0;
+        session->opening_keying = 0;
+        session->prefix = 0;
+        session->sealed = 0;
+
+        // Decryption round keys for the equivalent inverse cipher, in reverse order
+        memcpy(session->inverse, session->context.RoundKey + 16 * AES_ROUNDS, 16);
+        for (int r = 1; r < AES_ROUNDS; ++r)
+        {
+            _crypto_inverse_mix(session->inverse + 16 * r, session->context.RoundKey + 16 * (AES_ROUNDS - r));
+        }
+        memcpy(session->inverse + 16 * AES_ROUNDS, session->context.RoundKey, 16);
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Crypto session destructor
+ *  Description:    Clears the round keys of the given session
+ ******************************************************************************/
+int crypto_session_destruct(crypto_session_t * session)
+{
+    if (session)
+    {
+        OPENSSL_cleanse(session, sizeof(crypto_session_t));
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   AEAD cipher
+ *  Description:    Returns the libcrypto cipher of the given AEAD, or NULL
+ ******************************************************************************/
+static const EVP_CIPHER * _crypto_aead_cipher(crypto_aead_t aead)
+{
+    switch (aead)
+    {
+    case CRYPTO_AES_256_GCM:
+        return EVP_aes_256_gcm();
+    case CRYPTO_CHACHA20_POLY1305:
+        return EVP_chacha20_poly1305();
+    default:
+        return NULL;
+    }
+}
+
+// Cipher contexts of a thread, one sealing and one opening, each keyed for the session it last served
+typedef struct _crypto_scratch_t
+{
+    EVP_CIPHER_CTX * contexts[2];
+    uint64_t keyings[2];
+    crypto_aead_t aeads[2];
+
+} crypto_scratch_t;
+
+static pthread_key_t _crypto_scratch;
+static pthread_once_t _crypto_scratch_created = PTHREAD_ONCE_INIT;
+static uint64_t _crypto_keyings;
+
+static void _crypto_scratch_free(void * _scratch)
+{
+    crypto_scratch_t * scratch = (crypto_scratch_t *) _scratch;
+
+    EVP_CIPHER_CTX_free(scratch->contexts[0]);
+    EVP_CIPHER_CTX_free(scratch->contexts[1]);
+    free(scratch);
+}
+
+static void _crypto_scratch_create(void)
+{
+    pthread_key_create(&_crypto_scratch, &_crypto_scratch_free);
+}
+
+/*******************************************************************************
+ *  Function:   AEAD context
+ *  Description:    Returns the calling thread's cipher context for sealing or
+ *                  opening with the given session. A context only takes a key
+ *                  when it last served another session, so messages of the
+ *                  same session only set their nonce.
+ ******************************************************************************/
+static EVP_CIPHER_CTX * _crypto_aead_context(const crypto_session_t * session, int opening)
+{
+    crypto_scratch_t * scratch;
+    uint64_t keying = opening ? session->opening_keying : session->sealing_keying;
+    const uint8_t * key = opening ? session->opening : session->sealing;
+    const EVP_CIPHER * cipher;
+    int rval;
+
+    pthread_once(&_crypto_scratch_created, &_crypto_scratch_create);
+    if ((scratch = pthread_getspecific(_crypto_scratch)) == NULL)
+    {
+        if ((scratch = calloc(1, sizeof(crypto_scratch_t))) == NULL)
+        {
+            return NULL;
+        }
+        if ((scratch->contexts[0] = EVP_CIPHER_CTX_new()) == NULL || (scratch->contexts[1] = EVP_CIPHER_CTX_new()) == NULL)
+        {
+            _crypto_scratch_free(scratch);
+            return NULL;
+        }
+        pthread_setspecific(_crypto_scratch, scratch);
+    }
+
+    if (!keying)
+    {
+        return NULL;
+    }
+    if (scratch->keyings[opening] != keying)
+    {
+        // The cipher is only set up again when it changes
+        cipher = (scratch->aeads[opening] == session->aead) ? NULL : _crypto_aead_cipher(session->aead);
+        rval = opening ? EVP_DecryptInit_ex(scratch->contexts[opening], cipher, NULL, key, NULL)
+                       : EVP_EncryptInit_ex(scratch->contexts[opening], cipher, NULL, key, NULL);
+        if (rval != 1)
+        {
+            scratch->keyings[opening] = 0;
+            scratch->aeads[opening] = CRYPTO_AEAD_NONE;
+            return NULL;
+        }
+        scratch->keyings[opening] = keying;
+        scratch->aeads[opening] = session->aead;
+    }
+    return scratch->contexts[opening];
+}
+
+/*******************************************************************************
+ *  Function:   Seal
+ *  Description:    Seals size bytes of text in place, a message whose last
+ *                  SHA256_DIGEST_LENGTH bytes take the nonce, tag and
+ *                  reserved bytes. The 6-byte header stays in the clear and is
+ *                  authenticated with the reserved bytes; the rest is
+ *                  encrypted. The nonce is the session's prefix and a count
+ *                  of the messages it sealed, so none repeats under its key.
+ ******************************************************************************/
+static int _crypto_seal(const crypto_session_t * session, uint8_t * text, size_t size)
+{
+    EVP_CIPHER_CTX * context = _crypto_aead_context(session, 0);
+    uint8_t * nonce = text + size - SHA256_DIGEST_LENGTH;
+    uint8_t * tag = nonce + AEAD_NONCE;
+    uint8_t * reserved = tag + AEAD_TAG;
+    int body = (int) (size - 6 - SHA256_DIGEST_LENGTH);
+    uint64_t count;
+    int length;
+
+    if (!context)
+    {
+        return MESSAGE_UNSUPPORTED;
+    }
+
+    // Sessions are shared by the threads sending with them; only the count changes
+    count = __atomic_fetch_add(&((crypto_session_t *) session)->sealed, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < 4; ++i)
+    {
+        nonce[i] = (uint8_t) (session->prefix >> (24 - 8 * i));
+    }
+    for (int i = 0; i < 8; ++i)
+    {
+        nonce[4 + i] = (uint8_t) (count >> (56 - 8 * i));
+    }
+
+    memset(reserved, 0, AEAD_RESERVED);
+    if (EVP_EncryptInit_ex(context, NULL, NULL, NULL, nonce) != 1
+    ||  EVP_EncryptUpdate(context, NULL, &length, text, 6) != 1
+    ||  EVP_EncryptUpdate(context, NULL, &length, reserved, AEAD_RESERVED) != 1
+    ||  EVP_EncryptUpdate(context, text + 6, &length, text + 6, body) != 1
+    ||  EVP_EncryptFinal_ex(context, text + 6 + length, &length) != 1
+    ||  EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG, tag) != 1)
+    {
+        return MESSAGE_UNSUPPORTED;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Open
+ *  Description:    Opens size bytes of text sealed by _crypto_seal() in
+ *                  place. The text is only to be trusted if SUCCESS is
+ *                  returned.
+ ******************************************************************************/
+static int _crypto_open(const crypto_session_t * session, uint8_t * text, size_t size)
+{
+    EVP_CIPHER_CTX * context = _crypto_aead_context(session, 1);
+    uint8_t * nonce = text + size - SHA256_DIGEST_LENGTH;
+    uint8_t * tag = nonce + AEAD_NONCE;
+    uint8_t * reserved = tag + AEAD_TAG;
+    int body = (int) (size - 6 - SHA256_DIGEST_LENGTH);
+    int length;
+
+    if (!context
+    ||  EVP_DecryptInit_ex(context, NULL, NULL, NULL, nonce) != 1
+    ||  EVP_DecryptUpdate(context, NULL, &length, text, 6) != 1
+    ||  EVP_DecryptUpdate(context, NULL, &length, reserved, AEAD_RESERVED) != 1
+    ||  EVP_DecryptUpdate(context, text + 6, &length, text + 6, body) != 1
+    ||  EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG, tag) != 1)
+    {
+        return MESSAGE_UNSUPPORTED;
+    }
+    if (EVP_DecryptFinal_ex(context, text + 6 + length, &length) != 1)
+    {
+        debug_output("Tag not confirmed, message authentication failed!\n");
+        return MESSAGE_NO_AUTH;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   AEAD key
+ *  Description:    Derives the AEAD key of one sender from the pre-shared
+ *                  key and the sender's salt
+ ******************************************************************************/
+static void _crypto_aead_key(const char * key, const uint8_t * salt, uint8_t * output)
+{
+    char material[AES_KEYLEN + sizeof(AEAD_LABEL) + AEAD_SALT];
+
+    memcpy(material, key, AES_KEYLEN);
+    memcpy(material + AES_KEYLEN, AEAD_LABEL, sizeof(AEAD_LABEL));
+    memcpy(material + AES_KEYLEN + sizeof(AEAD_LABEL), salt, AEAD_SALT);
+    message_hash(material, sizeof(material), output);
+    OPENSSL_cleanse(material, sizeof(material));
+}
+
+/*******************************************************************************
+ *  Function:   Crypto session seal
+ *  Description:    Seals every message packed with the session with the given
+ *                  AEAD instead of AES-CBC and a SHA-256 hash, and expects
+ *                  every message unpacked to be sealed alike. Each direction
+ *                  is keyed from key and the salt of the end sealing it, never
+ *                  with key itself, so no key serves two ciphers and no two
+ *                  senders share one. A session given no salt for a direction
+ *                  cannot seal or open messages that way. CRYPTO_AEAD_NONE
+ *                  returns the session to AES-CBC.
+ ******************************************************************************/
+int crypto_session_seal(crypto_session_t * session, const char * key, crypto_aead_t aead, const uint8_t * sealing, const uint8_t * opening)
+{
+    if (!session || (aead != CRYPTO_AEAD_NONE && (!key || (!sealing && !opening))))
+    {
+        return ARGUMENT;
+    }
+
+    OPENSSL_cleanse(session->sealing, sizeof(session->sealing));
+    OPENSSL_cleanse(session->opening, sizeof(session->opening));
+    session->sealing_keying = 0;
+    session->opening_keying = 0;
+    session->sealed = 0;
+    session->aead = CRYPTO_AEAD_NONE;
+    if (aead == CRYPTO_AEAD_NONE)
+    {
+        return SUCCESS;
+    }
+    if (_crypto_aead_cipher(aead) == NULL)
+    {
+        return ARGUMENT;
+    }
+
+    // Every key taken gets a number of its own, even for a session at an address another one had
+    if (sealing)
+    {
+        _crypto_aead_key(key, sealing, session->sealing);
+        session->sealing_keying = __atomic_add_fetch(&_crypto_keyings, 1, __ATOMIC_RELAXED);
+    }
+    if (opening)
+    {
+        _crypto_aead_key(key, opening, session->opening);
+        session->opening_keying = __atomic_add_fetch(&_crypto_keyings, 1, __ATOMIC_RELAXED);
+    }
+    session->aead = aead;
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Crypto random
+ *  Description:    Fills the given buffer with cryptographically secure
+ *                  random bytes, such as the salt of a sealed session
+ ******************************************************************************/
+int crypto_random(void * buffer, size_t size)
+{
+    if (!buffer || size > INT_MAX)
+    {
+        return ARGUMENT;
+    }
+
+    return (RAND_bytes((unsigned char *) buffer, (int) size) == 1) ? SUCCESS : MESSAGE_UNSUPPORTED;
+}
+
+/*******************************************************************************
+ *  Function:   Preferred AEAD
+ *  Description:    Returns the AEAD fastest on this CPU; AES-256-GCM where
+ *                  the CPU has AES instructions, ChaCha20-Poly1305 elsewhere
+ ******************************************************************************/
+crypto_aead_t crypto_aead_preferred(void)
+{
+    return (crypto_backend() == CRYPTO_PORTABLE) ? CRYPTO_CHACHA20_POLY1305 : CRYPTO_AES_256_GCM;
+}
+
+/*******************************************************************************
+ *  Function:   Hash fixed message
+ *  Description:    Writes the hash of the 256 bytes of header and payload of a
+ *                  fixed message. Legacy sessions hash them up to the first
+ *                  zero byte and keep the digest up to its own first zero
+ *                  byte, as Nodes and Cores from before PROTOCOL_HASHED do.
+ ******************************************************************************/
+static void _message_hash_fixed(const crypto_session_t * session, const char * string, unsigned char * hash)
+{
+    size_t length;
+
+    if (!session->legacy_hash)
+    {
+        message_hash(string, 256, hash);
+        return;
+    }
+
+    message_hash(string, strnlen(string, 256), hash);
+    for (length = 0; length < SHA256_DIGEST_LENGTH && hash[length]; ++length);
+    memset(hash + length, 0, SHA256_DIGEST_LENGTH - length);
+}
+
+/*******************************************************************************
+ *  Function:   Pack message
+ *  Description:    Generate the message_string field of the given message_t
+ ******************************************************************************/
+int message_pack_session(message_t * message, const crypto_session_t * session)
 {
-    int rval = QUEUE_EMPTY;
+    int rval = SUCCESS;
 
-    if (queue && item)
+    if (message && session)
     {
-        // Wait until an item can be dequeued.
-        pthread_mutex_lock(queue->dequeue_blocking_mutex);
-        sem_wait(queue->dequeue_semaphore);
+        // Clear field to fill
+        memset(message->message_string, 0, sizeof(message->message_string));
 
-        // Dequeue the item.
-        *item = (void *) queue->queue[queue->tail];
-        queue->tail = (queue->tail + 1) % queue->capacity;
-        queue->size -= 1;
-        rval = SUCCESS;
+        // Convert bytes_remaining field (short, 2 bytes) to string
+        for (int i = 0; i < 2; ++i)
+        {
+            message->message_string[i] = CAPTURE_BYTE(message->bytes_remaining, 1 - i);
+        }
 
-        // Increment the enqueue semaphore.
-        sem_post(queue->enqueue_semaphore);
-        pthread_mutex_unlock(queue->dequeue_blocking_mutex);
+        // Convert source_id field (int, 4 bytes) to string
+        for (int i = 0; i < 4; ++i)
+        {
+            message->message_string[i + 2] = CAPTURE_BYTE(message->source_id, 3 - i);
+        }
+
+        // Append payload to message string; copied whole so binary fields survive
+        memcpy(message->message_string + 6, message->payload, sizeof(message->payload));
+
+        if (session->aead)
+        {
+            // Seal the payload; the nonce and tag take the place of the hash
+            rval = _crypto_seal(session, (uint8_t *) message->message_string, sizeof(message->message_string));
+            memcpy(message->hmac, message->message_string + 256, sizeof(message->hmac));
+        }
+        else
+        {
+            // Hash header and payload, every byte of them unless the peer predates that, and append to message (SHA256)
+            _message_hash_fixed(session, message->message_string, (unsigned char *) message->hmac);
+            memcpy(message->message_string + 256, message->hmac, sizeof(message->hmac));
+
+            // Encrypt message (AES256)
+            crypto_cbc_encrypt(session, (uint8_t *) message->message_string, sizeof(message->message_string));
+        }
     }
     else
     {
@@ -667,36 +3463,103 @@ int dequeue_blocking(queue_t * queue, void ** item)
     return rval;
 }
 
+/*******************************************************************************
+ *  Function:   Pack message with key
+ *  Description:    As message_pack_session(), expanding the given key for this
+ *                  message alone
+ ******************************************************************************/
+int message_pack(message_t * message, const char * key, const char * iv)
+{
+    crypto_session_t session;
 
-// #############################################################################
-// #                                                                           #
-// #    Message protocol                                                       #
-// #                                                                           #
-// #############################################################################
-char * _message_status_message[] =
+    if (crypto_session_construct(&session, key, iv) != SUCCESS)
+    {
+        return ARGUMENT;
+    }
+    return message_pack_session(message, &session);
+}
+
+/*******************************************************************************
+ *  Function:   Parse message
+ *  Description:    Fills the fields of the given message_t from its decrypted
+ *                  message_string, and checks its hash against the given
+ *                  session if it has one
+ ******************************************************************************/
+static int _message_parse(message_t * message, const crypto_session_t * hashed)
 {
-    "Authentication failed; hash value mismatch",
+    int rval = SUCCESS;
+    unsigned char hash[SHA256_DIGEST_LENGTH];
 
-};
+    // Clear fields to fill
+    message->bytes_remaining = 0;
+    message->source_id = 0;
+    memset(message->payload, 0, sizeof(message->payload));
+    memset(message->hmac, 0, sizeof(message->hmac));
+
+    // Get bytes_remaining field
+    for (int i = 0; i < 2; ++i)
+    {
+        message->bytes_remaining |= (unsigned char) message->message_string[i] << (8 * (1 - i));
+    }
+
+    // Get source_id field
+    for (int i = 2; i < 6; ++i)
+    {
+        message->source_id |= (unsigned int) (unsigned char) message->message_string[i] << (8 * (3 - (i - 2)));
+    }
+
+    // Get payload
+    for (int i = 6; i < 256; ++i)
+    {
+        message->payload[i - 6] = message->message_string[i];
+    }
+
+    // Get hash
+    for (int i = 256; i < 288; ++i)
+    {
+        message->hmac[i - 256] = (unsigned char) message->message_string[i];
+    }
+
+    // Check hash
+    if (!hashed)
+    {
+        return rval;
+    }
+    _message_hash_fixed(hashed, message->message_string, hash);
+    if (message_hash_compare(hash, message->hmac) == 0)
+    {
+        debug_output("Hash confirmed, message authenticated!\n");
+    }
+    else
+    {
+        message_debug_hex(message->message_string);
+        debug_output("Hash not confirmed, message authentication failed!\n");
+        rval = MESSAGE_NO_AUTH;
+    }
+
+    return rval;
+}
 
 /*******************************************************************************
- *  Function:   Create message
- *  Description:    Initializes the given message object
- *                  Note: Struct element sizes must conform to the sizes
- *                        defined by the Reactant message standard
+ *  Function:   Unpack message
+ *  Description:    Generate the message fields of the given message_t
  ******************************************************************************/
-int message_initialize(message_t * message)
+int message_unpack_session(message_t * message, const crypto_session_t * session)
 {
     int rval = SUCCESS;
 
-    if (message)
+    if (message && session && session->aead)
     {
-        // Initialize values to zero
-        message->bytes_remaining = 0;
-        message->source_id = 0;
-        memset(message->payload, 0, sizeof(message->payload));
-        memset(message->hmac, 0, sizeof(message->hmac));
-        memset(message->message_string, 0, sizeof(message->message_string));
+        // Open the sealed payload; the header was authenticated with it
+        rval = _crypto_open(session, (uint8_t *) message->message_string, sizeof(message->message_string));
+        _message_parse(message, NULL);
+    }
+    else if (message && session)
+    {
+        // Decrypt message (AES256)
+        crypto_cbc_decrypt(session, (uint8_t *) message->message_string, sizeof(message->message_string));
+
+        rval = _message_parse(message, session);
     }
     else
     {
@@ -707,44 +3570,140 @@ int message_initialize(message_t * message)
 }
 
 /*******************************************************************************
- *  Function:   Pack message
- *  Description:    Generate the message_string field of the given message_t
+ *  Function:   Unpack many messages
+ *  Description:    Unpacks count messages received together, decrypting them
+ *                  in one pass; status receives the result of each. Returns
+ *                  MESSAGE_NO_AUTH if any message failed authentication.
  ******************************************************************************/
-int message_pack(message_t * message, const char * key, const char * iv)
+int message_unpack_many(message_t * messages, int * status, size_t count, const crypto_session_t * session)
 {
     int rval = SUCCESS;
-    struct AES_ctx context;
-    unsigned char * hash;
+    uint8_t * buffers[UNPACK_BATCH];
+    size_t batch;
 
-    if (message)
+    if (((messages && status) || !count) && session)
     {
-        // Clear field to fill
-        memset(message->message_string, 0, sizeof(message->message_string));
+        for (size_t first = 0; first < count; first += batch)
+        {
+            batch = (count - first < UNPACK_BATCH) ? count - first : UNPACK_BATCH;
+            for (size_t m = 0; m < batch; ++m)
+            {
+                buffers[m] = (uint8_t *) messages[first + m].message_string;
+            }
+            if (!session->aead)
+            {
+                crypto_cbc_decrypt_many(session, buffers, batch, sizeof(messages->message_string));
+            }
 
-        // Convert bytes_remaining field (short, 2 bytes) to string
-        for (int i = 0; i < 2; ++i)
+            // A sealed message is opened and authenticated in one pass, so each is opened alone
+            for (size_t m = first; m < first + batch; ++m)
+            {
+                if (session->aead)
+                {
+                    status[m] = _crypto_open(session, buffers[m - first], sizeof(messages->message_string));
+                    _message_parse(&messages[m], NULL);
+                }
+                else
+                {
+                    status[m] = _message_parse(&messages[m], session);
+                }
+                if (status[m] != SUCCESS)
+                {
+                    rval = status[m];
+                }
+            }
+        }
+    }
+    else
+    {
+        rval = ARGUMENT;
+    }
+
+    return rval;
+}
+
+/*******************************************************************************
+ *  Function:   Unpack message with key
+ *  Description:    As message_unpack_session(), expanding the
+ *                  given key for this message alone
+ ******************************************************************************/
+int message_unpack(message_t * message, const char * key, const char * iv)
+{
+    crypto_session_t session;
+
+    if (crypto_session_construct(&session, key, iv) != SUCCESS)
+    {
+        return ARGUMENT;
+    }
+    return message_unpack_session(message, &session);
+}
+
+/*******************************************************************************
+ *  Function:   Variable message size
+ *  Description:    Returns the bytes taken by a variable message carrying
+ *                  payload_size bytes, its length prefix included. Variable
+ *                  messages are never MESSAGE_LENGTH bytes long, so that
+ *                  length always denotes an ordinary message.
+ ******************************************************************************/
+size_t message_variable_size(size_t payload_size)
+{
+    // [bytes_remaining][source_id][payload, zero padded to the cipher block][hash]
+    size_t size = (6 + payload_size + 1 + SHA256_DIGEST_LENGTH + 15) & ~(size_t) 15;
+
+    if (size == MESSAGE_LENGTH)
+    {
+        size += 16;
+    }
+    return MESSAGE_PREFIX + size;
+}
+
+/*******************************************************************************
+ *  Function:   Pack variable message
+ *  Description:    Write the length prefix and the encrypted message carrying
+ *                  the given payload and the header fields of the given
+ *                  message_t to output, which holds message_variable_size()
+ *                  bytes. The payload may be of any length.
+ ******************************************************************************/
+int message_pack_variable_session(message_t * message, const char * payload, size_t payload_size, char * output, const crypto_session_t * session)
+{
+    int rval = SUCCESS;
+    size_t size = message_variable_size(payload_size) - MESSAGE_PREFIX;
+    char * text = output + MESSAGE_PREFIX;
+
+    if (message && (payload || !payload_size) && output && session && size <= MESSAGE_LIMIT)
+    {
+        // Length of the encrypted message, in the clear
+        for (int i = 0; i < MESSAGE_PREFIX; ++i)
         {
-            message->message_string[i] = CAPTURE_BYTE(message->bytes_remaining, 1 - i);
+            output[i] = CAPTURE_BYTE(size, 3 - i);
         }
 
-        // Convert source_id field (int, 4 bytes) to string
+        for (int i = 0; i < 2; ++i)
+        {
+            text[i] = CAPTURE_BYTE(message->bytes_remaining, 1 - i);
+        }
         for (int i = 0; i < 4; ++i)
         {
-            message->message_string[i + 2] = CAPTURE_BYTE(message->source_id, 3 - i);
+            text[i + 2] = CAPTURE_BYTE(message->source_id, 3 - i);
         }
+        memcpy(text + 6, payload, payload_size);
+        memset(text + 6 + payload_size, 0, size - SHA256_DIGEST_LENGTH - 6 - payload_size);
 
-        // Append payload to message string
-        strncat(message->message_string + 6, message->payload, sizeof(message->payload));
-
-        // Hash and append to message (SHA256)
-        hash = message_hash(message->message_string);
-        strncpy(message->hmac, (char *) hash, SHA256_DIGEST_LENGTH);
-        free(hash);
-        strncat(message->message_string + 256, message->hmac, sizeof(message->hmac));
+        if (session->aead)
+        {
+            // Seal the payload; the nonce and tag take the place of the hash
+            rval = _crypto_seal(session, (uint8_t *) text, size);
+            memcpy(message->hmac, text + size - SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH);
+        }
+        else
+        {
+            // Hash every byte ahead of the hash (SHA256)
+            message_hash(text, size - SHA256_DIGEST_LENGTH, (unsigned char *) message->hmac);
+            memcpy(text + size - SHA256_DIGEST_LENGTH, message->hmac, SHA256_DIGEST_LENGTH);
 
-        // Encrypt message (AES256)
-        AES_init_ctx_iv(&context, (const uint8_t *) key, (const uint8_t *) iv);
-        AES_CBC_encrypt_buffer(&context, (uint8_t *) message->message_string, sizeof(message->message_string));
+            // Encrypt message (AES256)
+            crypto_cbc_encrypt(session, (uint8_t *) text, size);
+        }
     }
     else
     {
@@ -755,63 +3714,84 @@ int message_pack(message_t * message, const char * key, const char * iv)
 }
 
 /*******************************************************************************
- *  Function:   Unpack message
- *  Description:    Generate the message fields of the given message_t
+ *  Function:   Pack variable message with key
+ *  Description:    As message_pack_variable_session(), expanding the
+ *                  given key for this message alone
  ******************************************************************************/
-int message_unpack(message_t * message, const char * key, const char * iv)
+int message_pack_variable(message_t * message, const char * payload, size_t payload_size, char * output, const char * key, const char * iv)
+{
+    crypto_session_t session;
+
+    if (crypto_session_construct(&session, key, iv) != SUCCESS)
+    {
+        return ARGUMENT;
+    }
+    return message_pack_variable_session(message, payload, payload_size, output, &session);
+}
+
+/*******************************************************************************
+ *  Function:   Unpack variable message
+ *  Description:    Decrypt the given variable message of size bytes, without
+ *                  its length prefix, in place. The header fields are set in
+ *                  the given message_t and payload points to the terminated
+ *                  payload within input.
+ ******************************************************************************/
+int message_unpack_variable_session(message_t * message, char * input, size_t size, char ** payload, const crypto_session_t * session)
 {
     int rval = SUCCESS;
-    struct AES_ctx context;
-    char chkbuf[256];
+    unsigned char hash[SHA256_DIGEST_LENGTH];
 
-    if (message)
+    if (message && input && payload && session)
     {
-        // Clear fields to fill
+        *payload = NULL;
         message->bytes_remaining = 0;
         message->source_id = 0;
-        memset(message->payload, 0, sizeof(message->payload));
-        memset(message->hmac, 0, sizeof(message->hmac));
-        memset(chkbuf, 0, sizeof(chkbuf));
 
-        // Decrypt message (AES256)
-        AES_init_ctx_iv(&context, (const uint8_t *) key, (const uint8_t *) iv);
-        AES_CBC_decrypt_buffer(&context, (uint8_t *) message->message_string, sizeof(message->message_string));
-
-        // Get bytes_remaining field
-        for (int i = 0; i < 2; ++i)
+        if (size % 16 || size < message_variable_size(0) - MESSAGE_PREFIX || size > MESSAGE_LIMIT || size == MESSAGE_LENGTH)
         {
-            message->bytes_remaining |= message->message_string[i] << (8 * (1 - i));
+            return MESSAGE_INVALID;
         }
 
-        // Get source_id field
-        for (int i = 2; i < 6; ++i)
+        if (session->aead)
         {
-            message->source_id |= message->message_string[i] << (8 * (3 - (i - 2)));
+            // Open the sealed payload; the header was authenticated with it
+            rval = _crypto_open(session, (uint8_t *) input, size);
+        }
+        else
+        {
+            // Decrypt message (AES256)
+            crypto_cbc_decrypt(session, (uint8_t *) input, size);
         }
 
-        // Get payload
-        for (int i = 6; i < 256; ++i)
+        for (int i = 0; i < 2; ++i)
         {
-            message->payload[i - 6] = message->message_string[i];
+            message->bytes_remaining |= (unsigned char) input[i] << (8 * (1 - i));
         }
+        for (int i = 2; i < 6; ++i)
+        {
+            message->source_id |= (unsigned int) (unsigned char) input[i] << (8 * (3 - (i - 2)));
+        }
+        memcpy(message->hmac, input + size - SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH);
 
-        // Get hash
-        for (int i = 256; i < 288; ++i)
+        // Check hash; a sealed message was checked by its tag
+        if (!session->aead)
         {
-            message->hmac[i - 256] = (unsigned char) message->message_string[i];
+            message_hash(input, size - SHA256_DIGEST_LENGTH, hash);
+            if (message_hash_compare(hash, message->hmac) != 0)
+            {
+                debug_output("Hash not confirmed, message authentication failed!\n");
+                rval = MESSAGE_NO_AUTH;
+            }
         }
 
-        // Check hash
-        strncpy(chkbuf, message->message_string, sizeof(chkbuf));
-        if (strncmp((char *) message->hmac, (char *) message_hash(chkbuf), SHA256_DIGEST_LENGTH) == 0)
+        // The padding ahead of the hash always ends the payload with a terminator
+        if (rval == SUCCESS && input[size - SHA256_DIGEST_LENGTH - 1] != 0)
         {
-            debug_output("Hash confirmed, message authenticated!\n");
+            rval = MESSAGE_INVALID;
         }
-        else
+        else if (rval == SUCCESS)
         {
-            message_debug_hex(chkbuf);
-            debug_output("Hash not confirmed, message authentication failed!\n");
-            rval = MESSAGE_NO_AUTH;
+            *payload = input + 6;
         }
     }
     else
@@ -822,6 +3802,84 @@ int message_unpack(message_t * message, const char * key, const char * iv)
     return rval;
 }
 
+/*******************************************************************************
+ *  Function:   Unpack variable message with key
+ *  Description:    As message_unpack_variable_session(), expanding the
+ *                  given key for this message alone
+ ******************************************************************************/
+int message_unpack_variable(message_t * message, char * input, size_t size, char ** payload, const char * key, const char * iv)
+{
+    crypto_session_t session;
+
+    if (crypto_session_construct(&session, key, iv) != SUCCESS)
+    {
+        return ARGUMENT;
+    }
+    return message_unpack_variable_session(message, input, size, payload, &session);
+}
+
+/*******************************************************************************
+ *  Function:   Peek variable message
+ *  Description:    Read the header fields of the given variable message of
+ *                  size bytes, without its length prefix, into the given
+ *                  message_t. Only the first cipher block is decrypted, to a
+ *                  copy, so input is left unchanged. The fields are not
+ *                  authenticated until message_unpack_variable().
+ ******************************************************************************/
+int message_peek_variable_session(message_t * message, const char * input, size_t size, const crypto_session_t * session)
+{
+    uint8_t block[16];
+
+    if (message && input && session)
+    {
+        message->bytes_remaining = 0;
+        message->source_id = 0;
+
+        if (size % 16 || size < message_variable_size(0) - MESSAGE_PREFIX || size > MESSAGE_LIMIT || size == MESSAGE_LENGTH)
+        {
+            return MESSAGE_INVALID;
+        }
+
+        // In CBC mode the first block depends on the IV alone; a sealed header is in the clear
+        memcpy(block, input, sizeof(block));
+        if (!session->aead)
+        {
+            crypto_cbc_decrypt(session, block, sizeof(block));
+        }
+
+        for (int i = 0; i < 2; ++i)
+        {
+            message->bytes_remaining |= block[i] << (8 * (1 - i));
+        }
+        for (int i = 2; i < 6; ++i)
+        {
+            message->source_id |= (unsigned int) block[i] << (8 * (3 - (i - 2)));
+        }
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+/*******************************************************************************
+ *  Function:   Peek variable message with key
+ *  Description:    As message_peek_variable_session(), expanding the
+ *                  given key for this message alone
+ ******************************************************************************/
+int message_peek_variable(message_t * message, const char * input, size_t size, const char * key, const char * iv)
+{
+    crypto_session_t session;
+
+    if (crypto_session_construct(&session, key, iv) != SUCCESS)
+    {
+        return ARGUMENT;
+    }
+    return message_peek_variable_session(message, input, size, &session);
+}
+
 int message_debug_hex(char * message)
 {
     const int cols = 16;
@@ -849,14 +3907,35 @@ int message_debug_hex(char * message)
     return 0;
 }
 
-unsigned char * message_hash(char * message)
+/*******************************************************************************
+ *  Function:   Message hash
+ *  Description:    Writes the SHA256 hash of size bytes of data, zero bytes
+ *                  included, to the SHA256_DIGEST_LENGTH bytes of hash
+ ******************************************************************************/
+int message_hash(const void * data, size_t size, unsigned char * hash)
 {
-    unsigned char * hash = malloc(SHA256_DIGEST_LENGTH);
     SHA256_CTX sha_ctx;
 
-    SHA256_Init(&sha_ctx);
-    SHA256_Update(&sha_ctx, message, strlen(message));
-    SHA256_Final(hash, &sha_ctx);
+    if ((data || !size) && hash)
+    {
+        SHA256_Init(&sha_ctx);
+        SHA256_Update(&sha_ctx, data, size);
+        SHA256_Final(hash, &sha_ctx);
+    }
+    else
+    {
+        return ARGUMENT;
+    }
+
+    return SUCCESS;
+}
 
-    return hash;
+/*******************************************************************************
+ *  Function:   Message hash compare
+ *  Description:    Compares two hashes in time independent of where they
+ *                  differ; returns 0 when they match
+ ******************************************************************************/
+int message_hash_compare(const void * lhs, const void * rhs)
+{
+    return CRYPTO_memcmp(lhs, rhs, SHA256_DIGEST_LENGTH) != 0;
 }
@@ -31,6 +31,13 @@ int test_all(WINDOW *window) {
     print_result("SHA256", test_sha(), getmaxx(window));
     print_result("Message", test_message(), getmaxx(window));
     print_result("Channels", test_channels(), getmaxx(window));
+    print_result("Hash table", test_hash_table(), getmaxx(window));
+    print_result("Open hash table", test_open_table(), getmaxx(window));
+    print_result("Topics", test_topics(), getmaxx(window));
+    print_result("Append log", test_log(), getmaxx(window));
+    print_result("Variable message", test_variable_message(), getmaxx(window));
+    print_result("Object pool", test_pool(), getmaxx(window));
+    print_result("Core pools", test_core_pools(), getmaxx(window));
 
 
     debug_output("Press ENTER to continue!");
@@ -212,6 +219,29 @@ int test_aes_cb(WINDOW *window) {
 int test_aes() {
     int rval = 0;
     struct AES_ctx context;
+    crypto_session_t session;
+    crypto_backend_t detected = crypto_backend();
+    const uint8_t nist_key[32] = {
+        0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+        0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7, 0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4
+    };
+    const uint8_t nist_iv[16] = {
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+    };
+    const uint8_t nist_plain[64] = {
+        0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+        0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+        0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+        0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10
+    };
+    const uint8_t nist_cipher[64] = {
+        0xf5, 0x8c, 0x4c, 0x04, 0xd6, 0xe5, 0xf1, 0xba, 0x77, 0x9e, 0xab, 0xfb, 0x5f, 0x7b, 0xfb, 0xd6,
+        0x9c, 0xfc, 0x4e, 0x96, 0x7e, 0xdb, 0x80, 0x8d, 0x67, 0x9f, 0x77, 0x7b, 0xc6, 0x70, 0x2c, 0x7d,
+        0x39, 0xf2, 0x33, 0x69, 0xa9, 0xd9, 0xba, 0xcf, 0xa5, 0x30, 0xe2, 0x63, 0x04, 0x23, 0x14, 0x61,
+        0xb2, 0xeb, 0x05, 0xe2, 0xc3, 0x9b, 0xe9, 0xfc, 0xda, 0x6c, 0x19, 0x07, 0x8c, 0x6a, 0x9d, 0x1b
+    };
+    uint8_t block[288];
+    uint8_t reference[288];
     char buffer[64];
     char * str = "This is a test!";
     char * key = "12345678901234567890123456789012";
@@ -236,6 +266,81 @@ int test_aes() {
         rval = 1;
     }
 
+    // Every implementation the CPU supports matches the CBC-AES256 known answer (NIST SP 800-38A, F.2.5)
+    // and the reference implementation, across lengths and both directions
+    for (int backend = CRYPTO_PORTABLE; backend <= CRYPTO_ARMV8; ++backend) {
+        if (crypto_backend_select(backend) != SUCCESS) {
+            continue;
+        }
+
+        rval |= crypto_session_construct(&session, (const char *) nist_key, (const char *) nist_iv);
+        memcpy(block, nist_plain, sizeof(nist_plain));
+        rval |= crypto_cbc_encrypt(&session, block, sizeof(nist_plain));
+        rval |= (memcmp(block, nist_cipher, sizeof(nist_cipher)) != 0);
+        rval |= crypto_cbc_decrypt(&session, block, sizeof(nist_plain));
+        rval |= (memcmp(block, nist_plain, sizeof(nist_plain)) != 0);
+
+        rval |= crypto_session_construct(&session, key, iv);
+        for (size_t length = 0; length <= sizeof(block); length += 16) {
+            for (size_t i = 0; i < length; ++i) {
+                block[i] = reference[i] = (uint8_t) (i * 31 + length);
+            }
+            AES_init_ctx_iv(&context, (const uint8_t *) key, (const uint8_t *) iv);
+            AES_CBC_encrypt_buffer(&context, reference, length);
+            rval |= crypto_cbc_encrypt(&session, block, length);
+            rval |= (memcmp(block, reference, length) != 0);
+
+            AES_init_ctx_iv(&context, (const uint8_t *) key, (const uint8_t *) iv);
+            AES_CBC_decrypt_buffer(&context, reference, length);
+            rval |= crypto_cbc_decrypt(&session, block, length);
+            rval |= (memcmp(block, reference, length) != 0);
+        }
+
+        // Interleaved decryption across buffers matches decrypting each alone, whatever the blocks per buffer
+        for (size_t length = 16; length <= 80; length += 32) {
+            uint8_t * buffers[3];
+
+            for (size_t i = 0; i < sizeof(block); ++i) {
+                block[i] = reference[i] = (uint8_t) (i * 13 + length);
+            }
+            for (size_t b = 0; b < sizeof(buffers) / sizeof(buffers[0]); ++b) {
+                buffers[b] = block + b * length;
+                rval |= crypto_cbc_decrypt(&session, reference + b * length, length);
+            }
+            rval |= crypto_cbc_decrypt_many(&session, buffers, sizeof(buffers) / sizeof(buffers[0]), length);
+            rval |= (memcmp(block, reference, sizeof(buffers) / sizeof(buffers[0]) * length) != 0);
+        }
+        rval |= crypto_session_destruct(&session);
+        debug_output("AES256 implementation [%d] checked!\n", backend);
+    }
+    rval |= (crypto_cbc_encrypt(&session, block, 15) != ARGUMENT);
+    crypto_backend_select(detected);
+
+    // The T-table cipher is checked whichever one AES_TTABLE builds behind AES_CBC_*_buffer
+    AES_init_ctx_iv(&context, nist_key, nist_iv);
+    memcpy(block, nist_plain, sizeof(nist_plain));
+    AES_CBC_encrypt_buffer_ttable(&context, block, sizeof(nist_plain));
+    rval |= (memcmp(block, nist_cipher, sizeof(nist_cipher)) != 0);
+    AES_ctx_set_iv(&context, nist_iv);
+    AES_CBC_decrypt_buffer_ttable(&context, block, sizeof(nist_plain));
+    rval |= (memcmp(block, nist_plain, sizeof(nist_plain)) != 0);
+    for (size_t length = 16; length <= sizeof(block); length += 16) {
+        for (size_t i = 0; i < length; ++i) {
+            block[i] = reference[i] = (uint8_t) (i * 17 + length);
+        }
+        AES_init_ctx_iv(&context, (const uint8_t *) key, (const uint8_t *) iv);
+        AES_CBC_encrypt_buffer_reference(&context, reference, length);
+        AES_ctx_set_iv(&context, (const uint8_t *) iv);
+        AES_CBC_encrypt_buffer_ttable(&context, block, length);
+        rval |= (memcmp(block, reference, length) != 0);
+        AES_ctx_set_iv(&context, (const uint8_t *) iv);
+        AES_CBC_decrypt_buffer_ttable(&context, block, length);
+        for (size_t i = 0; i < length; ++i) {
+            rval |= (block[i] != (uint8_t) (i * 17 + length));
+        }
+    }
+    debug_output("AES256 T-table implementation checked!\n");
+
     debug_control(ENABLE);
     return rval;
 }
@@ -252,17 +357,24 @@ int test_sha_cb(WINDOW *window) {
 
 int test_sha() {
     int rval = 0;
-    char * str = "This is a test!";
-    char * hash = 0;
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    unsigned char other[SHA256_DIGEST_LENGTH];
+    const unsigned char expected[SHA256_DIGEST_LENGTH] = {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+        0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+    };
+    char binary[] = { 'a', 0, 'b', 0, 'c' };
     debug_control(DISABLE);
 
-    hash = (char *) message_hash(str);
-    if (hash == NULL || strcmp(hash, str) == 0) {
-        rval = 1;
-    }
-    if (hash) {
-        free(hash);
-    }
+    // Known answer
+    rval |= message_hash("abc", 3, hash);
+    rval |= message_hash_compare(hash, expected);
+
+    // Every byte counts, including those after a zero byte
+    rval |= message_hash(binary, sizeof(binary), hash);
+    binary[4] = 'd';
+    rval |= message_hash(binary, sizeof(binary), other);
+    rval |= !message_hash_compare(hash, other);
 
     debug_control(ENABLE);
     return rval;
@@ -281,6 +393,10 @@ int test_message_cb(WINDOW *window) {
 int test_message() {
     int rval = 0;
     message_t message;
+    message_t batch[20];
+    int status[20];
+    crypto_session_t session;
+    char frame[MESSAGE_LENGTH];
     char * str = "This is a test!";
     char * key = "12345678901234567890123456789012";
     char * iv = "1234567890123456";
@@ -299,6 +415,146 @@ int test_message() {
         rval = 1;
     }
 
+    // Binary payloads survive whole, and bytes after a zero byte are authenticated too
+    message_initialize(&message);
+    for (int i = 0; i < sizeof(message.payload); ++i) {
+        message.payload[i] = (char) (i * 7);
+    }
+    rval |= message_pack(&message, key, iv);
+    rval |= message_unpack(&message, key, iv);
+    for (int i = 0; i < sizeof(message.payload); ++i) {
+        rval |= (message.payload[i] != (char) (i * 7));
+    }
+
+    message_initialize(&message);
+    message.payload[200] = 1;
+    rval |= message_pack(&message, key, iv);
+    message.message_string[200] ^= 1;
+    rval |= (message_unpack(&message, key, iv) != MESSAGE_NO_AUTH);
+
+    // A session expands the key once and packs the same frames as the key itself
+    rval |= crypto_session_construct(&session, key, iv);
+    for (int i = 0; i < 3; ++i) {
+        message_initialize(&message);
+        strcpy(message.payload, str);
+        rval |= message_pack_session(&message, &session);
+        memcpy(frame, message.message_string, sizeof(frame));
+        rval |= message_pack(&message, key, iv);
+        rval |= (memcmp(frame, message.message_string, sizeof(frame)) != 0);
+        rval |= message_unpack_session(&message, &session);
+        rval |= (strcmp(message.payload, str) != 0);
+    }
+
+    // Frames unpacked together, more than one pass holds, each report their own result
+    for (int i = 0; i < 20; ++i) {
+        message_initialize(&batch[i]);
+        sprintf(batch[i].payload, "Frame %d", i);
+        batch[i].source_id = i;
+        rval |= message_pack_session(&batch[i], &session);
+    }
+    batch[17].message_string[100] ^= 1;
+    rval |= (message_unpack_many(batch, status, 20, &session) != MESSAGE_NO_AUTH);
+    for (int i = 0; i < 20; ++i) {
+        sprintf(frame, "Frame %d", i);
+        if (i == 17) {
+            rval |= (status[i] != MESSAGE_NO_AUTH);
+        } else {
+            rval |= (status[i] != SUCCESS || strcmp(batch[i].payload, frame) != 0 || batch[i].source_id != i);
+        }
+    }
+    rval |= (message_unpack_many(batch, status, 0, &session) != SUCCESS);
+
+    // Legacy sessions hash up to the first zero byte, as builds before whole hashes; the two do not mix
+    session.legacy_hash = 1;
+    message_initialize(&message);
+    message.source_id = 0x01020304;
+    strcpy(message.payload, str);
+    rval |= message_pack_session(&message, &session);
+    memcpy(frame, message.message_string, sizeof(frame));
+    rval |= message_unpack_session(&message, &session);
+    rval |= (strcmp(message.payload, str) != 0 || message.source_id != 0x01020304);
+    session.legacy_hash = 0;
+    memcpy(message.message_string, frame, sizeof(frame));
+    rval |= (message_unpack_session(&message, &session) != MESSAGE_NO_AUTH);
+
+    // Sealed sessions authenticate the header in the clear and count a nonce per message
+    for (crypto_aead_t aead = CRYPTO_AES_256_GCM; aead <= CRYPTO_CHACHA20_POLY1305; ++aead) {
+        char wire[MESSAGE_PREFIX + 512];
+        char body[300];
+        char * payload;
+        size_t size = message_variable_size(300) - MESSAGE_PREFIX;
+        uint8_t salt[AEAD_SALT];
+        uint8_t other[AEAD_SALT];
+        crypto_session_t peer;
+
+        rval |= crypto_random(salt, sizeof(salt));
+        rval |= crypto_random(other, sizeof(other));
+        rval |= crypto_session_seal(&session, key, aead, salt, salt);
+        rval |= (session.aead != aead);
+
+        // Each end seals with its own salt; only a session opening with that salt opens its messages
+        crypto_session_construct(&peer, key, iv);
+        rval |= crypto_session_seal(&peer, key, aead, other, salt);
+        message_initialize(&message);
+        strcpy(message.payload, str);
+        rval |= message_pack_session(&message, &session);
+        rval |= message_unpack_session(&message, &peer);
+        rval |= (strcmp(message.payload, str) != 0);
+        rval |= message_pack_session(&message, &peer);
+        rval |= (message_unpack_session(&message, &session) != MESSAGE_NO_AUTH);
+        rval |= crypto_session_seal(&peer, key, aead, other, NULL);
+        rval |= message_pack_session(&message, &peer);
+        rval |= (message_unpack_session(&message, &peer) != MESSAGE_UNSUPPORTED);
+        rval |= crypto_session_destruct(&peer);
+
+        message_initialize(&message);
+        strcpy(message.payload, str);
+        message.source_id = 0x01020304;
+        rval |= message_pack_session(&message, &session);
+        memcpy(frame, message.message_string, sizeof(frame));
+        rval |= message_pack_session(&message, &session);
+        rval |= (memcmp(frame, message.message_string, sizeof(frame)) == 0);
+        rval |= (memcmp(frame + MESSAGE_LENGTH - SHA256_DIGEST_LENGTH, message.message_string + MESSAGE_LENGTH - SHA256_DIGEST_LENGTH, AEAD_NONCE) == 0);
+        rval |= (message.message_string[5] != 0x04);
+        rval |= message_unpack_session(&message, &session);
+        rval |= (strcmp(message.payload, str) != 0 || message.source_id != 0x01020304);
+
+        rval |= message_pack_session(&message, &session);
+        message.message_string[5] ^= 1;
+        rval |= (message_unpack_session(&message, &session) != MESSAGE_NO_AUTH);
+        rval |= message_pack_session(&message, &session);
+        message.message_string[100] ^= 1;
+        rval |= (message_unpack_session(&message, &session) != MESSAGE_NO_AUTH);
+
+        for (int i = 0; i < 20; ++i) {
+            message_initialize(&batch[i]);
+            sprintf(batch[i].payload, "Frame %d", i);
+            rval |= message_pack_session(&batch[i], &session);
+        }
+        batch[3].message_string[1] ^= 1;
+        rval |= (message_unpack_many(batch, status, 20, &session) != MESSAGE_NO_AUTH);
+        for (int i = 0; i < 20; ++i) {
+            sprintf(frame, "Frame %d", i);
+            rval |= (i == 3) ? (status[i] != MESSAGE_NO_AUTH) : (status[i] != SUCCESS || strcmp(batch[i].payload, frame) != 0);
+        }
+
+        message_initialize(&message);
+        message.source_id = 77;
+        memset(body, 'x', sizeof(body));
+        rval |= message_pack_variable_session(&message, body, sizeof(body), wire, &session);
+        message.source_id = 0;
+        rval |= message_peek_variable_session(&message, wire + MESSAGE_PREFIX, size, &session);
+        rval |= (message.source_id != 77);
+        rval |= message_unpack_variable_session(&message, wire + MESSAGE_PREFIX, size, &payload, &session);
+        rval |= (payload == NULL || strspn(payload, "x") != 300 || payload[300] != 0);
+        rval |= message_pack_variable_session(&message, body, sizeof(body), wire, &session);
+        wire[MESSAGE_PREFIX + size - 1] ^= 1;
+        rval |= (message_unpack_variable_session(&message, wire + MESSAGE_PREFIX, size, &payload, &session) != MESSAGE_NO_AUTH);
+    }
+    rval |= crypto_session_seal(&session, NULL, CRYPTO_AEAD_NONE, NULL, NULL);
+    rval |= (session.aead != CRYPTO_AEAD_NONE);
+    rval |= crypto_session_destruct(&session);
+
     debug_control(ENABLE);
     return rval;
 }
@@ -384,6 +640,1027 @@ int test_channels() {
     return rval;
 }
 
+int test_hash_table_cb(WINDOW *window) {
+    debug_control(ENABLE);
+    endwin();
+    system("clear");
+    print_result("Hash table", test_hash_table(), getmaxx(window));
+    debug_output("Press ENTER to continue!");
+    while ((getchar() != '\n'));
+    return 0;
+}
+
+static uint32_t _test_hash_string(void * key) {
+    return ht_fnv1a(key, strlen((char *) key));
+}
+
+static uint8_t _test_compare_string(void * lhs, void * rhs) {
+    return (strcmp((char *) lhs, (char *) rhs) == 0);
+}
+
+int test_hash_table() {
+    int rval = 0;
+    hash_table_t table;
+    hash_data_t search;
+    char key[32];
+    int i;
+    debug_control(DISABLE);
+
+    rval |= ht_construct(&table, 4, sizeof(key), sizeof(int), &_test_hash_string, &_test_compare_string);
+
+    // Grow well past the initial size; keys must stay reachable while buckets migrate
+    for (i = 0; i < 5000 && !rval; ++i) {
+        memset(key, 0, sizeof(key));
+        sprintf(key, "Temperature-%d", i);
+        rval |= ht_insert(&table, key, &i);
+        rval |= (ht_search(&table, &search, "Temperature-0") != SUCCESS);
+    }
+    rval |= (table.count != 5000 || table.count > table.load_factor * table.size);
+
+    // Remove every other key
+    for (i = 0; i < 5000 && !rval; i += 2) {
+        memset(key, 0, sizeof(key));
+        sprintf(key, "Temperature-%d", i);
+        rval |= ht_remove(&table, key);
+    }
+    for (i = 0; i < 5000 && !rval; ++i) {
+        memset(key, 0, sizeof(key));
+        sprintf(key, "Temperature-%d", i);
+        if (i % 2) {
+            rval |= (ht_search(&table, &search, key) != SUCCESS || *(int *) search.value != i);
+        } else {
+            rval |= (ht_search(&table, &search, key) != HT_DNE);
+        }
+    }
+    rval |= (ht_insert(&table, "Temperature-1", &i) != HT_DUPLICATE);
+    rval |= (table.count != 2500);
+
+    ht_destruct(&table);
+
+    debug_control(ENABLE);
+    return rval;
+}
+
+int test_open_table_cb(WINDOW *window) {
+    debug_control(ENABLE);
+    endwin();
+    system("clear");
+    print_result("Open hash table", test_open_table(), getmaxx(window));
+    debug_output("Press ENTER to continue!");
+    while ((getchar() != '\n'));
+    return 0;
+}
+
+int test_open_table() {
+    int rval = 0;
+    open_table_t table;
+    hash_data_t search;
+    char key[32];
+    int i;
+    debug_control(DISABLE);
+
+    rval |= ot_construct(&table, 4, sizeof(key), sizeof(int), &_test_hash_string, &_test_compare_string);
+
+    for (i = 0; i < 5000 && !rval; ++i) {
+        memset(key, 0, sizeof(key));
+        sprintf(key, "Temperature-%d", i);
+        rval |= ot_insert(&table, key, &i);
+        rval |= (ot_search(&table, &search, "Temperature-0") != SUCCESS);
+    }
+    rval |= (table.count != 5000 || table.count > table.load_factor * table.size);
+
+    // Removal shifts displaced keys back; every survivor must still be found
+    for (i = 0; i < 5000 && !rval; i += 2) {
+        memset(key, 0, sizeof(key));
+        sprintf(key, "Temperature-%d", i);
+        rval |= ot_remove(&table, key);
+    }
+    for (i = 0; i < 5000 && !rval; ++i) {
+        memset(key, 0, sizeof(key));
+        sprintf(key, "Temperature-%d", i);
+        if (i % 2) {
+            rval |= (ot_search(&table, &search, key) != SUCCESS || *(int *) search.value != i);
+        } else {
+            rval |= (ot_search(&table, &search, key) != HT_DNE);
+        }
+    }
+    rval |= (ot_insert(&table, "Temperature-1", &i) != HT_DUPLICATE);
+    rval |= (table.count != 2500);
+
+    ot_destruct(&table);
+
+    debug_control(ENABLE);
+    return rval;
+}
+
+int test_table_benchmark_cb(WINDOW *window) {
+    debug_control(ENABLE);
+    endwin();
+    system("clear");
+    print_result("Table benchmark", test_table_benchmark(), getmaxx(window));
+    debug_output("Press ENTER to continue!");
+    while ((getchar() != '\n'));
+    return 0;
+}
+
+static double _test_elapsed(struct timespec * start) {
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+static int _test_table_benchmark(int count) {
+    int rval = 0;
+    hash_table_t chained;
+    open_table_t open;
+    hash_data_t search;
+    struct timespec start;
+    double times[2][4];
+    char (* keys)[250] = calloc(2 * count, 250);
+    char value[16] = { 0 };
+    int i;
+
+    // Keys and values are shaped like the Core's routing table; the second half is never inserted
+    for (i = 0; i < 2 * count; ++i) {
+        sprintf(keys[i], "Temperature-%d", i);
+    }
+    ht_construct(&chained, 16, 250, sizeof(value), &_test_hash_string, &_test_compare_string);
+    ot_construct(&open, 16, 250, sizeof(value), &_test_hash_string, &_test_compare_string);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; ++i) rval |= ht_insert(&chained, keys[i], value);
+    times[0][0] = _test_elapsed(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; ++i) rval |= ht_search(&chained, &search, keys[i]);
+    times[0][1] = _test_elapsed(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = count; i < 2 * count; ++i) rval |= (ht_search(&chained, &search, keys[i]) != HT_DNE);
+    times[0][2] = _test_elapsed(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; ++i) rval |= ht_remove(&chained, keys[i]);
+    times[0][3] = _test_elapsed(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; ++i) rval |= ot_insert(&open, keys[i], value);
+    times[1][0] = _test_elapsed(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; ++i) rval |= ot_search(&open, &search, keys[i]);
+    times[1][1] = _test_elapsed(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = count; i < 2 * count; ++i) rval |= (ot_search(&open, &search, keys[i]) != HT_DNE);
+    times[1][2] = _test_elapsed(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; ++i) rval |= ot_remove(&open, keys[i]);
+    times[1][3] = _test_elapsed(&start);
+
+    debug_output("%d keys, ns per operation:  insert    hit   miss remove\n", count);
+    debug_output("Chained hash table:       %6.0f %6.0f %6.0f %6.0f\n", times[0][0] / count, times[0][1] / count, times[0][2] / count, times[0][3] / count);
+    debug_output("Open hash table:          %6.0f %6.0f %6.0f %6.0f\n", times[1][0] / count, times[1][1] / count, times[1][2] / count, times[1][3] / count);
+
+    ht_destruct(&chained);
+    ot_destruct(&open);
+    free(keys);
+    return rval;
+}
+
+int test_table_benchmark() {
+    int rval = 0;
+
+    // Routing tables that fit in cache, and ones that do not
+    rval |= _test_table_benchmark(1000);
+    rval |= _test_table_benchmark(100000);
+    return rval;
+}
+
+int test_aes_benchmark_cb(WINDOW *window) {
+    debug_control(ENABLE);
+    endwin();
+    system("clear");
+    print_result("AES benchmark", test_aes_benchmark(), getmaxx(window));
+    debug_output("Press ENTER to continue!");
+    while ((getchar() != '\n'));
+    return 0;
+}
+
+// CPU cycles per nanosecond; the time stamp counter's rate on x86, the current cpufreq elsewhere
+static double _test_cycles_per_ns(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec start;
+    uint64_t cycles = __rdtsc();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (_test_elapsed(&start) < 1e7);
+    return (__rdtsc() - cycles) / _test_elapsed(&start);
+#else
+    FILE * file = fopen("/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq", "r");
+    double khz = 0;
+
+    if (file) {
+        if (fscanf(file, "%lf", &khz) != 1) khz = 0;
+        fclose(file);
+    }
+    return khz / 1e6;
+#endif
+}
+
+static int _test_aes_benchmark(size_t size, double cycles_per_ns) {
+    int rval = 0;
+    struct AES_ctx context;
+    struct timespec start;
+    double times[2][2];
+    uint8_t * buffer = calloc(size, 1);
+    uint8_t * check = calloc(size, 1);
+    const uint8_t * key = (const uint8_t *) "12345678901234567890123456789012";
+    const uint8_t * iv = (const uint8_t *) "1234567890123456";
+    int count = (int) (4 * 1024 * 1024 / size);
+    int i;
+
+    // Reference and T-table ciphers over the same buffer, each round trip ending back at zeros
+    AES_init_ctx(&context, key);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; ++i) {
+        AES_ctx_set_iv(&context, iv);
+        AES_CBC_encrypt_buffer_reference(&context, buffer, size);
+    }
+    times[0][0] = _test_elapsed(&start);
+    memcpy(check, buffer, size);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; ++i) {
+        AES_ctx_set_iv(&context, iv);
+        AES_CBC_decrypt_buffer_reference(&context, buffer, size);
+    }
+    times[0][1] = _test_elapsed(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; ++i) {
+        AES_ctx_set_iv(&context, iv);
+        AES_CBC_encrypt_buffer_ttable(&context, buffer, size);
+    }
+    times[1][0] = _test_elapsed(&start);
+    rval |= (memcmp(check, buffer, size) != 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; ++i) {
+        AES_ctx_set_iv(&context, iv);
+        AES_CBC_decrypt_buffer_ttable(&context, buffer, size);
+    }
+    times[1][1] = _test_elapsed(&start);
+    for (i = 0; i < (int) size; ++i) rval |= (buffer[i] != 0);
+
+    debug_output("%zu byte buffers, cycles per byte:  encrypt decrypt\n", size);
+    debug_output("Reference:                        %7.1f %7.1f\n", times[0][0] * cycles_per_ns / (count * size), times[0][1] * cycles_per_ns / (count * size));
+    debug_output("T-table:                          %7.1f %7.1f\n", times[1][0] * cycles_per_ns / (count * size), times[1][1] * cycles_per_ns / (count * size));
+
+    free(buffer);
+    free(check);
+    return rval;
+}
+
+int test_aes_benchmark() {
+    int rval = 0;
+    double cycles_per_ns = _test_cycles_per_ns();
+
+    if (cycles_per_ns <= 0) {
+        debug_output("CPU frequency unknown; figures below are nanoseconds per byte\n");
+        cycles_per_ns = 1;
+    }
+
+    // A single fixed message, and a bulk transfer chunk
+    rval |= _test_aes_benchmark(288, cycles_per_ns);
+    rval |= _test_aes_benchmark(TRANSFER_CHUNK, cycles_per_ns);
+    return rval;
+}
+
+int test_topics_cb(WINDOW *window) {
+    debug_control(ENABLE);
+    endwin();
+    system("clear");
+    print_result("Topics", test_topics(), getmaxx(window));
+    debug_output("Press ENTER to continue!");
+    while ((getchar() != '\n'));
+    return 0;
+}
+
+static void _test_count_match(void * value, void * user) {
+    *(int *) user += *(int *) value;
+}
+
+int test_topics() {
+    int rval = 0;
+    trie_t trie;
+    void * value;
+    int values[] = { 1, 2, 4, 8, 16, 32 };
+    int matched;
+    debug_control(DISABLE);
+
+    // Patterns on their own
+    rval |= (topic_match("sensors/+/temp", "sensors/a/temp") != 1);
+    rval |= (topic_match("sensors/+/temp", "sensors/a/b/temp") != 0);
+    rval |= (topic_match("sensors/#", "sensors") != 1);
+    rval |= (topic_match("sensors/#", "sensors/a/b") != 1);
+    rval |= (topic_match("sensors", "sensors/a") != 0);
+    rval |= (topic_match("#", "$SYS/load") != 0);
+    rval |= (topic_match("$SYS/#", "$SYS/load") != 1);
+    rval |= (topic_wildcard("sensors/temp") != 0);
+    rval |= (topic_wildcard("sensors/+") != 1);
+    rval |= (topic_wildcard("sensors/#/temp") != TRIE_INVALID);
+    rval |= (topic_wildcard("sensors/a+") != TRIE_INVALID);
+
+    // Every stored pattern matching a topic is visited once
+    rval |= trie_construct(&trie);
+    rval |= trie_insert(&trie, "sensors/+/temp", &values[0]);
+    rval |= trie_insert(&trie, "sensors/#", &values[1]);
+    rval |= trie_insert(&trie, "sensors/a/temp", &values[2]);
+    rval |= trie_insert(&trie, "#", &values[3]);
+    rval |= trie_insert(&trie, "+/+", &values[4]);
+    rval |= trie_insert(&trie, "$SYS/+", &values[5]);
+    rval |= (trie_insert(&trie, "sensors/#/temp", &values[0]) != TRIE_INVALID);
+    rval |= (trie.count != 6);
+
+    matched = 0;
+    trie_match(&trie, "sensors/a/temp", &_test_count_match, &matched);
+    rval |= (matched != 1 + 2 + 4 + 8);
+    matched = 0;
+    trie_match(&trie, "sensors/b", &_test_count_match, &matched);
+    rval |= (matched != 2 + 8 + 16);
+    matched = 0;
+    trie_match(&trie, "sensors", &_test_count_match, &matched);
+    rval |= (matched != 2 + 8);
+    matched = 0;
+    trie_match(&trie, "$SYS/load", &_test_count_match, &matched);
+    rval |= (matched != 32);
+
+    // Removal prunes levels no other pattern uses
+    rval |= trie_remove(&trie, "sensors/a/temp");
+    rval |= (trie_remove(&trie, "sensors/a/temp") != TRIE_DNE);
+    rval |= (trie_search(&trie, "sensors/+/temp", &value) != SUCCESS || value != &values[0]);
+    rval |= (trie_search(&trie, "sensors/a", &value) != TRIE_DNE);
+    rval |= (trie.root.size != 2);
+    matched = 0;
+    trie_match(&trie, "sensors/a/temp", &_test_count_match, &matched);
+    rval |= (matched != 1 + 2 + 8);
+    rval |= (trie.count != 5);
+
+    trie_destruct(&trie, NULL);
+
+    debug_control(ENABLE);
+    return rval;
+}
+
+int test_log_cb(WINDOW *window) {
+    debug_control(ENABLE);
+    endwin();
+    system("clear");
+    print_result("Append log", test_log(), getmaxx(window));
+    debug_output("Press ENTER to continue!");
+    while ((getchar() != '\n'));
+    return 0;
+}
+
+static int _test_count_record(const char * record, size_t size, uint64_t position, void * user) {
+    int * count = (int *) user;
+    char expected[32];
+
+    // Records come back whole and in the order they were appended
+    sprintf(expected, "Temperature-%d", *count);
+    if (size != strlen(expected) + 1 || strcmp(record, expected) != 0) {
+        return 1;
+    }
+    *count += 1;
+    return 0;
+}
+
+static int _test_page_record(const char * record, size_t size, uint64_t position, void * user) {
+    // Stops after every tenth record, to be carried on by the next traversal
+    return _test_count_record(record, size, position, user) || *(int *) user % 10 == 0;
+}
+
+static int _test_append_record(const char * record, size_t size, uint64_t position, void * log) {
+    // The log would deadlock here were it locked throughout the traversal
+    return log_append((log_t *) log, record, size, NULL) != SUCCESS || log_flush((log_t *) log) != SUCCESS;
+}
+
+static void _test_log_remove(const char * directory) {
+    char path[PATH_MAX];
+    DIR * listing;
+    struct dirent * entry;
+
+    if ((listing = opendir(directory))) {
+        while ((entry = readdir(listing))) {
+            if (entry->d_name[0] != '.') {
+                snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+                unlink(path);
+            }
+        }
+        closedir(listing);
+    }
+    rmdir(directory);
+}
+
+int test_log() {
+    int rval = 0;
+    log_t log;
+    char directory[] = "/tmp/reactant-log-XXXXXX";
+    char record[32];
+    size_t segments;
+    uint64_t positions[100];
+    uint64_t position;
+    int count;
+    int full;
+    int i;
+    debug_control(DISABLE);
+
+    if (!mkdtemp(directory)) {
+        return 1;
+    }
+
+    rval |= log_construct(&log, directory, 256, 0, 0);
+    for (i = 0; i < 1000 && !rval; ++i) {
+        sprintf(record, "Temperature-%d", i);
+        rval |= log_append(&log, record, strlen(record) + 1, NULL);
+    }
+    rval |= log_flush(&log);
+
+    count = 0;
+    rval |= log_traverse(&log, NULL, &_test_count_record, &count);
+    rval |= (count != 1000);
+    rval |= (log.segment_count < 2);
+    rval |= log_destruct(&log);
+
+    // Records survive reopening; new ones go to a new segment after them
+    rval |= log_construct(&log, directory, 256, 0, 0);
+    for (i = 1000; i < 1100 && !rval; ++i) {
+        sprintf(record, "Temperature-%d", i);
+        rval |= log_append(&log, record, strlen(record) + 1, &positions[i - 1000]);
+    }
+    rval |= log_flush(&log);
+
+    count = 0;
+    rval |= log_traverse(&log, NULL, &_test_count_record, &count);
+    rval |= (count != 1100);
+
+    // Reading from a record's position resumes where the last traversal stopped, across segments
+    count = 1050;
+    position = positions[50];
+    rval |= log_traverse(&log, &position, &_test_page_record, &count);
+    rval |= (count != 1060 || position != positions[60]);
+    rval |= log_traverse(&log, &position, &_test_count_record, &count);
+    rval |= (count != 1100 || position != log.appended);
+    rval |= log_destruct(&log);
+
+    // A batch that fails to write is never reported durable, and nothing is written behind it
+    rval |= log_construct(&log, directory, 256, 0, 0);
+    segments = log.segment_count;
+    if ((full = open("/dev/full", O_WRONLY)) >= 0) {
+        pthread_mutex_lock(&log.lock);
+        dup2(full, log.fd);
+        pthread_mutex_unlock(&log.lock);
+        close(full);
+        rval |= log_append(&log, "Temperature", 12, NULL);
+        rval |= (log_flush(&log) != LOG_IO);
+        rval |= (log_append(&log, "Temperature", 12, NULL) != LOG_IO);
+        rval |= (log.segment_count != segments + 1);
+    }
+    rval |= log_destruct(&log);
+
+    // Retention only keeps the newest segments, and waits for traversals reading them
+    rval |= log_construct(&log, directory, 256, 1024, 0);
+    rval |= (log.segment_count > 1024 / 256 + 2);
+    for (i = 0; i < 100 && !rval; ++i) {
+        sprintf(record, "Temperature-%d", i);
+        rval |= log_append(&log, record, strlen(record) + 1, NULL);
+        rval |= log_flush(&log);
+    }
+    rval |= log_traverse(&log, NULL, &_test_append_record, &log);
+    rval |= log_flush(&log);
+    rval |= (log.segment_count > 1024 / 256 + 2);
+    rval |= log_destruct(&log);
+
+    _test_log_remove(directory);
+
+    debug_control(ENABLE);
+    return rval;
+}
+
+int test_variable_message_cb(WINDOW *window) {
+    debug_control(ENABLE);
+    endwin();
+    system("clear");
+    print_result("Variable message", test_variable_message(), getmaxx(window));
+    debug_output("Press ENTER to continue!");
+    while ((getchar() != '\n'));
+    return 0;
+}
+
+int test_variable_message() {
+    int rval = 0;
+    buffer_pool_t pool;
+    message_t message;
+    char * key = "12345678901234567890123456789012";
+    char * iv = "1234567890123456";
+    char * text;
+    char * frame;
+    char * payload;
+    size_t size = 100000;
+    size_t i;
+    debug_control(DISABLE);
+
+    // Buffers come from the smallest class that holds them and are reused once freed
+    rval |= buffer_pool_construct(&pool, 512, 4 * size, 64 * 1024);
+    rval |= buffer_alloc(&pool, size + 1, (void **) &text);
+    rval |= (buffer_capacity(text) < size + 1 || buffer_capacity(text) >= 2 * (size + 1));
+    rval |= buffer_free(&pool, text);
+    rval |= buffer_alloc(&pool, size, (void **) &frame);
+    rval |= (frame != text);
+    rval |= (buffer_alloc(&pool, 8 * size, (void **) &frame) != POOL_TOO_LARGE);
+
+    // Resizing keeps the contents
+    rval |= buffer_alloc(&pool, 16, (void **) &frame);
+    strcpy(frame, "Temperature-1");
+    rval |= buffer_resize(&pool, (void **) &frame, 4096);
+    rval |= (buffer_capacity(frame) < 4096 || strcmp(frame, "Temperature-1") != 0);
+    rval |= buffer_free(&pool, frame);
+
+    for (i = 0; i < size; ++i) {
+        text[i] = 'a' + i % 26;
+    }
+    text[size] = 0;
+
+    // Only ordinary messages are MESSAGE_LENGTH long
+    for (i = 0; i < 1024; ++i) {
+        rval |= (message_variable_size(i) == MESSAGE_PREFIX + MESSAGE_LENGTH);
+    }
+
+    rval |= buffer_alloc(&pool, message_variable_size(size), (void **) &frame);
+    if (!rval) {
+        message_initialize(&message);
+        message.source_id = 0x741;
+        rval |= message_pack_variable(&message, text, size, frame, key, iv);
+
+        // The header can be read without disturbing the message
+        message_initialize(&message);
+        rval |= message_peek_variable(&message, frame + MESSAGE_PREFIX, message_variable_size(size) - MESSAGE_PREFIX, key, iv);
+        rval |= (message.source_id != 0x741);
+
+        // Unpacked in place, after the length prefix
+        message_initialize(&message);
+        rval |= message_unpack_variable(&message, frame + MESSAGE_PREFIX, message_variable_size(size) - MESSAGE_PREFIX, &payload, key, iv);
+        rval |= (message.source_id != 0x741 || !payload || strcmp(payload, text) != 0);
+
+        // Every byte is covered by the hash
+        message_initialize(&message);
+        rval |= message_pack_variable(&message, text, size, frame, key, iv);
+        frame[MESSAGE_PREFIX + size / 2] ^= 1;
+        rval |= (message_unpack_variable(&message, frame + MESSAGE_PREFIX, message_variable_size(size) - MESSAGE_PREFIX, &payload, key, iv) != MESSAGE_NO_AUTH);
+        rval |= (message_unpack_variable(&message, frame + MESSAGE_PREFIX, MESSAGE_LENGTH, &payload, key, iv) != MESSAGE_INVALID);
+    }
+
+    rval |= buffer_pool_destruct(&pool);
+
+    debug_control(ENABLE);
+    return rval;
+}
+
+int test_pool_cb(WINDOW *window) {
+    endwin();
+    debug_output("\n");
+
+    print_result("Object pool", test_pool(), getmaxx(window));
+    debug_output("Press ENTER to continue!");
+    while ((getchar() != '\n'));
+    return 0;
+}
+
+int test_pool() {
+    int rval = 0;
+    pool_t pool;
+    pool_stats_t stats;
+    hash_table_t table;
+    hash_data_t data;
+    void * objects[40];
+    char key[250] = { 0 };
+    uint32_t value;
+    int i, j;
+    debug_control(DISABLE);
+
+    // Objects are carved a slab at once; the counters follow every allocation
+    rval |= pool_construct(&pool, 24, 16);
+    for (i = 0; i < 40; ++i) {
+        rval |= pool_alloc(&pool, &objects[i]);
+    }
+    rval |= pool_stats(&pool, &stats);
+    rval |= (stats.slabs != 3 || stats.allocations != 40 || stats.in_use != 40 || stats.peak != 40);
+
+    // Once warmed up, freeing and allocating again never reaches the system allocator
+    for (j = 0; j < 1000; ++j) {
+        for (i = 0; i < 40; ++i) {
+            rval |= pool_free(&pool, objects[i]);
+        }
+        for (i = 0; i < 40; ++i) {
+            rval |= pool_alloc(&pool, &objects[i]);
+        }
+    }
+    rval |= pool_free(&pool, objects[0]);
+    rval |= pool_stats(&pool, &stats);
+    rval |= (stats.slabs != 3 || stats.in_use != 39 || stats.peak != 40);
+    rval |= pool_destruct(&pool);
+
+    // Hash table data objects, with their keys and values, come from the table's own pool
+    rval |= ht_construct(&table, 16, sizeof(key), sizeof(uint32_t), &_test_hash_string, &_test_compare_string);
+    for (j = 0; j < 100; ++j) {
+        for (i = 0; i < 50; ++i) {
+            snprintf(key, sizeof(key), "Channel-%d", i);
+            value = i;
+            rval |= ht_insert(&table, key, &value);
+        }
+        for (i = 0; i < 50; ++i) {
+            snprintf(key, sizeof(key), "Channel-%d", i);
+            rval |= ht_search(&table, &data, key);
+            rval |= (*(uint32_t *) data.value != (uint32_t) i);
+            rval |= ht_remove(&table, key);
+        }
+    }
+    rval |= pool_stats(&table._entries, &stats);
+    rval |= (stats.slabs != 1 || stats.in_use != 0 || stats.allocations != 5000);
+    rval |= ht_destruct(&table);
+
+    debug_control(ENABLE);
+    return rval;
+}
+
+int test_core_pools_cb(WINDOW *window) {
+    debug_control(ENABLE);
+    endwin();
+    system("clear");
+    print_result("Core pools", test_core_pools(), getmaxx(window));
+    debug_output("Press ENTER to continue!");
+    while ((getchar() != '\n'));
+    return 0;
+}
+
+static gencfg_t _test_core_settings;
+static core_config_t _test_core_config;
+static int _test_core_relays;
+
+static void * _test_core_thread(void * unused) {
+    return (void *) (intptr_t) start_core_server_config(_test_core_settings.port, _test_core_settings.key, _test_core_settings.iv, &_test_core_config);
+}
+
+static void _test_core_callback(char * message) {
+    __sync_fetch_and_add(&_test_core_relays, 1);
+}
+
+static int _test_core_round(core_t * core, int count, int expected) {
+    char channel[32];
+    char payload[64];
+    int rval = 0;
+    int i;
+
+    struct timespec delay;
+    delay.tv_sec = 0;
+    delay.tv_nsec = 10 * 1000 * 1000;
+
+    rval |= start_node_client(core, 0x942, "127.0.0.1", _test_core_settings.port, _test_core_settings.key, _test_core_settings.iv);
+    if (rval) {
+        return rval;
+    }
+
+    _test_core_relays = 0;
+    for (i = 0; i < 4; ++i) {
+        sprintf(channel, "Pool-%d", i);
+        rval |= subscribe(core, channel, _test_core_callback);
+    }
+    nanosleep(&delay, NULL);
+    for (i = 0; i < count; ++i) {
+        sprintf(channel, "Pool-%d", i % 4);
+        sprintf(payload, "Publish %d of %d", i, count);
+        rval |= (i % 9) ? publish(core, channel, payload) : publish_retained(core, channel, payload);
+    }
+    for (i = 0; i < 200 && _test_core_relays < expected; ++i) {
+        nanosleep(&delay, NULL);
+    }
+    rval |= (_test_core_relays != expected);
+
+    stop_node_client(core);
+    return rval;
+}
+
+static size_t _test_core_record(char * record, uint32_t sequence, const char * channel, size_t payload_size) {
+    size_t channel_size = strlen(channel);
+
+    // [flags][sequence][channel][payload] as the Core logs a publish, each string with its terminator
+    record[0] = 0;
+    for (int i = 0; i < 4; ++i) {
+        record[1 + i] = (char) (sequence >> (24 - 8 * i));
+    }
+    memcpy(record + 5, channel, channel_size + 1);
+    memset(record + 6 + channel_size, 'r', payload_size);
+    record[6 + channel_size + payload_size] = 0;
+
+    return 7 + channel_size + payload_size;
+}
+
+static int _test_core_recover() {
+    int rval = 0;
+    pthread_t thread;
+    void * result;
+    core_stats_t stats;
+    core_t core;
+    log_t log;
+    char directory[] = "/tmp/reactant-recover-XXXXXX";
+    char * record;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    int i;
+
+    struct timespec delay;
+    delay.tv_sec = 0;
+    delay.tv_nsec = 10 * 1000 * 1000;
+
+    if (!mkdtemp(directory) || (record = malloc(page)) == NULL) {
+        return 1;
+    }
+
+    // The filler leaves room for the last record, 15 bytes, to end exactly at the end of the page, and of the mapping
+    rval |= log_construct(&log, directory, LOG_SEGMENT, 0, 0);
+    rval |= log_append(&log, record, _test_core_record(record, 1, "Filler", page - 2 * LOG_HEADER - 15 - 13), NULL);
+    rval |= log_append(&log, record, _test_core_record(record, 1, "Recover", 1), NULL);
+    rval |= log_flush(&log);
+    rval |= log_destruct(&log);
+    free(record);
+
+    // Recovery reads each channel name in place, and must not read past it
+    core_config_default(&_test_core_config);
+    _test_core_config.shards = 1;
+    _test_core_config.history = 16;
+    strcpy(_test_core_config.log_directory, directory);
+    if (rval || pthread_create(&thread, NULL, &_test_core_thread, NULL)) {
+        _test_log_remove(directory);
+        return 1;
+    }
+    for (i = 0; i < 200 && core_stats(&stats); ++i) {
+        nanosleep(&delay, NULL);
+    }
+
+    // The recovered channel keeps its name and its message
+    _test_core_relays = 0;
+    if ((rval |= start_node_client(&core, 0x943, "127.0.0.1", _test_core_settings.port, _test_core_settings.key, _test_core_settings.iv)) == 0) {
+        rval |= subscribe_from(&core, "Recover", _test_core_callback, 1);
+        for (i = 0; i < 200 && _test_core_relays < 1; ++i) {
+            nanosleep(&delay, NULL);
+        }
+        rval |= (_test_core_relays != 1);
+        stop_node_client(&core);
+    }
+
+    rval |= stop_core_server();
+    pthread_join(thread, &result);
+    rval |= (result != NULL);
+
+    _test_log_remove(directory);
+    return rval;
+}
+
+int test_core_pools() {
+    int rval = 0;
+    pthread_t thread;
+    void * result;
+    core_stats_t warm, stats;
+    core_t core;
+    int round, i;
+
+    struct timespec delay;
+    delay.tv_sec = 0;
+    delay.tv_nsec = 10 * 1000 * 1000;
+
+    if (ini_browse(&_gencfg_handler, &_test_core_settings, CONF_INI) < 0) {
+        debug_output("Failed to load configuration settings!\n");
+        return 1;
+    }
+    debug_control(DISABLE);
+
+    // A Core of its own, beside the one the configuration names, keeping history so rings are taken too
+    _test_core_settings.port += 1;
+    core_config_default(&_test_core_config);
+    _test_core_config.shards = 1;
+    _test_core_config.history = 16;
+    if (pthread_create(&thread, NULL, &_test_core_thread, NULL)) {
+        debug_control(ENABLE);
+        return 1;
+    }
+    for (i = 0; i < 200 && core_stats(&stats); ++i) {
+        nanosleep(&delay, NULL);
+    }
+
+    // The first round takes every slab the load needs; connecting, subscribing and publishing again takes none
+    for (round = 0; round < 5 && !rval; ++round) {
+        // Rounds after the first are also sent the message retained on each channel
+        rval |= _test_core_round(&core, 400, round ? 404 : 400);
+        for (i = 0; i < 200 && (core_stats(&stats) || stats.connections.in_use); ++i) {
+            nanosleep(&delay, NULL);
+        }
+        if (round == 0) {
+            warm = stats;
+            continue;
+        }
+        rval |= (stats.frames.slabs != warm.frames.slabs || stats.buffers.slabs != warm.buffers.slabs);
+        rval |= (stats.payloads.slabs != warm.payloads.slabs || stats.channels.slabs != warm.channels.slabs);
+        rval |= (stats.connections.slabs != warm.connections.slabs || stats.lists.slabs != warm.lists.slabs);
+    }
+
+    rval |= stop_core_server();
+    pthread_join(thread, &result);
+    rval |= (result != NULL);
+
+    // A Core restarted on a log ending at a page boundary recovers it
+    rval |= _test_core_recover();
+
+    debug_control(ENABLE);
+    return rval;
+}
+
+int test_core_benchmark_cb(WINDOW *window) {
+    debug_control(ENABLE);
+    endwin();
+    system("clear");
+    print_result("Core benchmark", test_core_benchmark(), getmaxx(window));
+    debug_output("Press ENTER to continue!");
+    while ((getchar() != '\n'));
+    return 0;
+}
+
+static char _test_core_publishes[8 * 2 * MESSAGE_LENGTH];
+static int _test_core_rounds;
+static long _test_core_expected;
+static long _test_core_received;
+
+static int _test_core_connect() {
+    struct sockaddr_in address;
+    struct timeval timeout;
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(_test_core_settings.port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    // A subscriber stops waiting once the Core has been silent this long
+    timeout.tv_sec = 5;
+    timeout.tv_usec = 0;
+    if (sock >= 0 && (connect(sock, (struct sockaddr *) &address, sizeof(address)) < 0
+    ||  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void _test_core_frame(crypto_session_t * session, char * output, int source_id, char * payload) {
+    message_t message;
+
+    message_initialize(&message);
+    message.source_id = source_id;
+    strcpy(message.payload, payload);
+    message_pack_session(&message, session);
+    memcpy(output, message.message_string, MESSAGE_LENGTH);
+}
+
+static void * _test_core_publisher(void * _sock) {
+    int sock = *(int *) _sock;
+    ssize_t bytes;
+
+    // The same eight publishes, one per channel, over and over; the Core decrypts and relays each anew
+    for (int i = 0; i < _test_core_rounds; ++i) {
+        for (size_t sent = 0; sent < sizeof(_test_core_publishes); sent += bytes) {
+            if ((bytes = write(sock, _test_core_publishes + sent, sizeof(_test_core_publishes) - sent)) <= 0) {
+                return (void *) 1;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void * _test_core_subscriber(void * _sock) {
+    int sock = *(int *) _sock;
+    char buffer[16 * MESSAGE_LENGTH];
+    long received = 0;
+    ssize_t bytes;
+
+    while (received < _test_core_expected && (bytes = read(sock, buffer, sizeof(buffer))) > 0) {
+        received += bytes;
+    }
+    __sync_fetch_and_add(&_test_core_received, received);
+    return NULL;
+}
+
+static int _test_core_benchmark(int shards, int publishers, int subscribers, double * rate) {
+    int rval = 0;
+    pthread_t thread;
+    pthread_t * threads = calloc(publishers + subscribers, sizeof(pthread_t));
+    int * socks = calloc(publishers + subscribers, sizeof(int));
+    crypto_session_t session;
+    core_stats_t stats;
+    struct timespec start;
+    char frame[MESSAGE_LENGTH];
+    char channel[32];
+    void * result;
+    int started = 0;
+    int i, j;
+
+    struct timespec delay;
+    delay.tv_sec = 0;
+    delay.tv_nsec = 100 * 1000 * 1000;
+
+    // Queues hold every relay, so a subscriber falling behind delays the figures rather than losing messages
+    core_config_default(&_test_core_config);
+    _test_core_config.shards = shards;
+    _test_core_config.high_water = 8 * _test_core_rounds * publishers;
+    if (pthread_create(&thread, NULL, &_test_core_thread, NULL)) {
+        free(threads);
+        free(socks);
+        return 1;
+    }
+    for (i = 0; i < 20 && core_stats(&stats); ++i) {
+        nanosleep(&delay, NULL);
+    }
+
+    // Legacy devices, so the figures are the Core's own rather than a Node's; each subscriber takes every channel
+    crypto_session_construct(&session, _test_core_settings.key, _test_core_settings.iv);
+    session.legacy_hash = 1;
+    for (i = 0; i < publishers + subscribers; ++i) {
+        socks[i] = _test_core_connect();
+        rval |= (socks[i] < 0);
+    }
+    for (i = publishers; i < publishers + subscribers && !rval; ++i) {
+        for (j = 0; j < 8; ++j) {
+            sprintf(channel, "Bench-%d", j);
+            _test_core_frame(&session, frame, 0x950 + i, channel);
+            rval |= (write(socks[i], frame, MESSAGE_LENGTH) != MESSAGE_LENGTH);
+        }
+    }
+    for (j = 0; j < 8; ++j) {
+        sprintf(channel, "Bench-%d", j);
+        _test_core_frame(&session, _test_core_publishes + 2 * j * MESSAGE_LENGTH, 0, channel);
+        _test_core_frame(&session, _test_core_publishes + (2 * j + 1) * MESSAGE_LENGTH, 0, "Benchmark payload");
+    }
+    crypto_session_destruct(&session);
+    nanosleep(&delay, NULL);
+
+    // Time from the first publish until every subscriber has read every relay, a channel and a payload frame each
+    _test_core_expected = (long) sizeof(_test_core_publishes) * _test_core_rounds * publishers;
+    _test_core_received = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < publishers + subscribers && !rval; ++i) {
+        rval |= pthread_create(&threads[i], NULL, (i < publishers) ? &_test_core_publisher : &_test_core_subscriber, &socks[i]);
+        started += !rval;
+    }
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], &result);
+        rval |= (result != NULL);
+    }
+    *rate = _test_core_received / (2.0 * MESSAGE_LENGTH) / (_test_elapsed(&start) / 1e9);
+    rval |= (_test_core_received != _test_core_expected * subscribers);
+
+    for (i = 0; i < publishers + subscribers; ++i) {
+        if (socks[i] >= 0) {
+            close(socks[i]);
+        }
+    }
+    rval |= stop_core_server();
+    pthread_join(thread, &result);
+    rval |= (result != NULL);
+
+    free(threads);
+    free(socks);
+    return rval;
+}
+
+int test_core_benchmark() {
+    int rval = 0;
+    int shards[] = { 1, 2, 4, 8 };
+    double rates[4] = { 0 };
+    int i;
+
+    if (ini_browse(&_gencfg_handler, &_test_core_settings, CONF_INI) < 0) {
+        debug_output("Failed to load configuration settings!\n");
+        return 1;
+    }
+    debug_control(DISABLE);
+
+    // Four publishers fan out to four subscribers, on a Core of its own beside the one the configuration names
+    _test_core_settings.port += 1;
+    _test_core_rounds = 1000;
+    for (i = 0; i < 4; ++i) {
+        rval |= _test_core_benchmark(shards[i], 4, 4, &rates[i]);
+    }
+
+    debug_control(ENABLE);
+    debug_output("%ld CPUs online, relays per second by shard count:\n", sysconf(_SC_NPROCESSORS_ONLN));
+    for (i = 0; i < 4; ++i) {
+        debug_output("%d shards:  %10.0f\n", shards[i], rates[i]);
+    }
+    return rval;
+}
+
 /* ################################################################################################################## */
 /* ################################################################################################################## */
 